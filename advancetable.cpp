@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#include <advancetable.hpp>
+#include <hbfontcache.hpp>
+
+#include <glib.h>
+
+#include <limits>
+
+namespace {
+
+// Basic Latin, Latin-1 Supplement, Latin Extended-A and the
+// dashes, quotes and ellipsis of General Punctuation.
+const int NUM_SLOTS = 95 + 224 + 48;
+
+const int32_t NO_ADVANCE = std::numeric_limits<int32_t>::min();
+const int16_t PAIR_UNKNOWN = std::numeric_limits<int16_t>::min();
+const int16_t PAIR_NEEDS_SHAPING = std::numeric_limits<int16_t>::min() + 1;
+
+int codepoint_slot(uint32_t codepoint) {
+    if(codepoint >= 0x20 && codepoint < 0x7F) {
+        return codepoint - 0x20;
+    }
+    if(codepoint >= 0xA0 && codepoint < 0x180) {
+        return 95 + (codepoint - 0xA0);
+    }
+    if(codepoint >= 0x2010 && codepoint < 0x2040) {
+        return 95 + 224 + (codepoint - 0x2010);
+    }
+    return -1;
+}
+
+uint32_t slot_codepoint(int slot) {
+    if(slot < 95) {
+        return 0x20 + slot;
+    }
+    if(slot < 95 + 224) {
+        return 0xA0 + (slot - 95);
+    }
+    return 0x2010 + (slot - 95 - 224);
+}
+
+} // namespace
+
+AdvanceTable::AdvanceTable(hb_font_t *font_, const ShapePlan &plan_, hb_buffer_t *buf)
+    : font{font_}, plan{plan_}, advances(NUM_SLOTS, NO_ADVANCE), glyph_ids(NUM_SLOTS, 0),
+      pairs{new std::atomic<int16_t>[NUM_SLOTS * NUM_SLOTS]} {
+    for(int i = 0; i < NUM_SLOTS * NUM_SLOTS; ++i) {
+        pairs[i].store(PAIR_UNKNOWN, std::memory_order_relaxed);
+    }
+    for(int slot = 0; slot < NUM_SLOTS; ++slot) {
+        const uint32_t codepoint = slot_codepoint(slot);
+        if(!shape_codepoints(&codepoint, 1, buf)) {
+            continue;
+        }
+        unsigned int glyph_count;
+        hb_glyph_info_t *glyph_info = hb_buffer_get_glyph_infos(buf, &glyph_count);
+        hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
+        // Glyph zero is .notdef, the font does not have the character.
+        if(glyph_count != 1 || glyph_info[0].codepoint == 0) {
+            continue;
+        }
+        advances[slot] = glyph_pos[0].x_advance;
+        glyph_ids[slot] = glyph_info[0].codepoint;
+    }
+}
+
+bool AdvanceTable::shape_codepoints(const uint32_t *codepoints,
+                                    size_t num_codepoints,
+                                    hb_buffer_t *buf) const {
+    hb_buffer_clear_contents(buf);
+    hb_buffer_add_utf32(buf, codepoints, num_codepoints, 0, -1);
+    hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
+    hb_buffer_set_script(buf, HB_SCRIPT_LATIN);
+    hb_buffer_set_language(buf, plan.language);
+    hb_buffer_guess_segment_properties(buf);
+    return hb_shape_plan_execute(
+        plan.plan.get(), font, buf, plan.features.data(), plan.features.size());
+}
+
+int16_t AdvanceTable::pair_adjustment(int first_slot, int second_slot, hb_buffer_t *buf) const {
+    auto &entry = pairs[first_slot * NUM_SLOTS + second_slot];
+    auto adjustment = entry.load(std::memory_order_relaxed);
+    if(adjustment != PAIR_UNKNOWN) {
+        return adjustment;
+    }
+    // Several threads may compute the same pair, but they all get the same result.
+    adjustment = PAIR_NEEDS_SHAPING;
+    const uint32_t codepoints[2] = {slot_codepoint(first_slot), slot_codepoint(second_slot)};
+    if(shape_codepoints(codepoints, 2, buf)) {
+        unsigned int glyph_count;
+        hb_glyph_info_t *glyph_info = hb_buffer_get_glyph_infos(buf, &glyph_count);
+        hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
+        if(glyph_count == 2 && glyph_info[0].codepoint == glyph_ids[first_slot] &&
+           glyph_info[1].codepoint == glyph_ids[second_slot]) {
+            const int32_t kerning = glyph_pos[0].x_advance + glyph_pos[1].x_advance -
+                                    advances[first_slot] - advances[second_slot];
+            if(kerning > PAIR_NEEDS_SHAPING && kerning <= std::numeric_limits<int16_t>::max()) {
+                adjustment = kerning;
+            }
+        }
+    }
+    entry.store(adjustment, std::memory_order_relaxed);
+    return adjustment;
+}
+
+std::optional<int32_t> AdvanceTable::width(std::string_view utf8_text, hb_buffer_t *buf) const {
+    int32_t total_width = 0;
+    int previous_slot = -1;
+    const char *end = utf8_text.data() + utf8_text.size();
+    for(const char *c = utf8_text.data(); c < end; c = g_utf8_next_char(c)) {
+        const int slot = codepoint_slot(g_utf8_get_char(c));
+        if(slot < 0 || advances[slot] == NO_ADVANCE) {
+            return {};
+        }
+        total_width += advances[slot];
+        if(previous_slot >= 0) {
+            const auto adjustment = pair_adjustment(previous_slot, slot, buf);
+            if(adjustment == PAIR_NEEDS_SHAPING) {
+                return {};
+            }
+            total_width += adjustment;
+        }
+        previous_slot = slot;
+    }
+    return total_width;
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#pragma once
+
+#include <hb.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+struct ShapePlan;
+
+// Measures plain Latin text without shaping it. Single glyph advances
+// are measured when the table is created. Pairs are shaped the first
+// time they are seen to get their kerning and to find out whether the
+// font does something to them (ligatures and other substitutions) that
+// the table can not represent.
+class AdvanceTable {
+public:
+    AdvanceTable(hb_font_t *font, const ShapePlan &plan, hb_buffer_t *buf);
+
+    // Width in font units or nothing if the text must be shaped.
+    // Takes a scratch buffer because measuring may shape new pairs.
+    std::optional<int32_t> width(std::string_view utf8_text, hb_buffer_t *buf) const;
+
+private:
+    int16_t pair_adjustment(int first_slot, int second_slot, hb_buffer_t *buf) const;
+    bool shape_codepoints(const uint32_t *codepoints,
+                          size_t num_codepoints,
+                          hb_buffer_t *buf) const;
+
+    hb_font_t *font;
+    const ShapePlan &plan;
+    std::vector<int32_t> advances;
+    std::vector<hb_codepoint_t> glyph_ids;
+    // Kerning of slot pairs or a marker for unknown and unusable pairs.
+    std::unique_ptr<std::atomic<int16_t>[]> pairs;
+};
@@ -22,6 +22,16 @@
 #include <glib.h>
 #include <cassert>
 #include <cstring>
+#include <chrono>
+#include <filesystem>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 void replace_dashes(std::string &str) {
     size_t dash_loc;
@@ -105,24 +115,21 @@ Document load_document(const char *fname) {
         const auto fpath = doc.data.top_dir / s;
         MMapper map(fpath.c_str());
         if(!g_utf8_validate(map.data(), map.size(), nullptr)) {
-            printf("Invalid utf-8.\n");
-            std::abort();
+            throw std::runtime_error("Input file " + fpath.string() + " is not valid UTF-8.");
         }
         for(const auto c : map.view()) {
             if(c == '\t') {
-                printf("Input file %s contains a TAB character. These are prohibited in input "
-                       "files.\n",
-                       fpath.c_str());
-                std::abort();
+                throw std::runtime_error("Input file " + fpath.string() +
+                                         " contains a TAB character. These are prohibited in "
+                                         "input files.");
             }
             if(c == 0 || c == '\n' || c >= 32 || c < 0) {
                 // OK.
             } else {
-                printf("Input file %s contains a prohibited invisible ASCII control character "
-                       "%d.\n",
-                       fpath.c_str(),
-                       int(c));
-                std::abort();
+                throw std::runtime_error("Input file " + fpath.string() +
+                                         " contains a prohibited invisible ASCII control "
+                                         "character " +
+                                         std::to_string(int(c)) + ".");
             }
         }
 
@@ -142,14 +149,102 @@ Document load_document(const char *fname) {
     return doc;
 }
 
-int main(int argc, char **argv) {
-    if(argc != 2) {
-        printf("%s <bookdef.json>\n", argv[0]);
-        return 1;
+// Editors often save by writing a new file and renaming it over the old
+// one, so this watches the directories the files are in instead of the
+// files themselves.
+class SourceWatcher {
+public:
+    SourceWatcher() {
+        fd = inotify_init1(IN_CLOEXEC);
+        if(fd < 0) {
+            perror("Could not initialize inotify");
+            std::abort();
+        }
+    }
+    ~SourceWatcher() { close(fd); }
+
+    void watch(const std::vector<std::filesystem::path> &files) {
+        watched.clear();
+        for(const auto &f : files) {
+            const auto full = std::filesystem::absolute(f).lexically_normal();
+            watched.insert(full);
+            const auto dir = full.parent_path();
+            bool found = false;
+            for(const auto &[wd, d] : dirs) {
+                found = found || d == dir;
+            }
+            if(found) {
+                continue;
+            }
+            const int wd =
+                inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+            if(wd < 0) {
+                perror("Could not watch directory");
+                std::abort();
+            }
+            dirs[wd] = dir;
+        }
+    }
+
+    // Blocks until at least one watched file has changed. Waits for a
+    // moment after that so that one save only causes one rebuild.
+    std::set<std::filesystem::path> wait_for_changes() {
+        const int settle_ms = 100;
+        std::set<std::filesystem::path> changed;
+        while(true) {
+            pollfd p{fd, POLLIN, 0};
+            const int rc = poll(&p, 1, changed.empty() ? -1 : settle_ms);
+            if(rc == 0) {
+                return changed;
+            }
+            if(rc < 0) {
+                perror("Poll failed");
+                std::abort();
+            }
+            read_events(changed);
+        }
     }
+
+private:
+    void read_events(std::set<std::filesystem::path> &changed) {
+        alignas(inotify_event) char buf[4096];
+        const ssize_t num_bytes = read(fd, buf, sizeof(buf));
+        if(num_bytes <= 0) {
+            return;
+        }
+        for(const char *c = buf; c < buf + num_bytes;) {
+            const auto *event = reinterpret_cast<const inotify_event *>(c);
+            c += sizeof(inotify_event) + event->len;
+            auto it = dirs.find(event->wd);
+            if(event->len == 0 || it == dirs.end()) {
+                continue;
+            }
+            const auto file = it->second / event->name;
+            if(watched.find(file) != watched.end()) {
+                changed.insert(file);
+            }
+        }
+    }
+
+    int fd;
+    std::unordered_map<int, std::filesystem::path> dirs;
+    std::set<std::filesystem::path> watched;
+};
+
+std::vector<std::filesystem::path> book_files(const char *bookdef) {
+    const auto m = load_book_json(bookdef);
+    std::vector<std::filesystem::path> files;
+    files.emplace_back(bookdef);
+    for(const auto &s : m.sources) {
+        files.emplace_back(m.top_dir / s);
+    }
+    return files;
+}
+
+void build_book(const char *bookdef, RebuildCache *rebuild_cache) {
     // std::string bob("Hello \" there --- my ... man");
     // replace_characters(bob);
-    auto doc = load_document(argv[1]);
+    auto doc = load_document(bookdef);
     preprocess_document(doc);
     if(doc.data.generate_pdf) {
         if(doc.data.is_draft) {
@@ -157,7 +252,7 @@ int main(int argc, char **argv) {
             auto ofile = doc.data.top_dir / doc.data.pdf.ofname;
             p.generate_pdf(ofile.c_str());
         } else {
-            PrintPaginator p(doc);
+            PrintPaginator p(doc, rebuild_cache);
             auto ofile = doc.data.top_dir / doc.data.pdf.ofname;
             p.generate_pdf(ofile.c_str());
         }
@@ -166,5 +261,52 @@ int main(int argc, char **argv) {
         Epub epub(doc);
         epub.generate(doc.data.epub.ofname.c_str());
     }
+}
+
+// Rebuilds whenever the book definition or one of its sources changes.
+// Layouts of paragraphs and chapters that did not change are kept in memory,
+// as are the fonts and the hyphenator. A build that fails because of an
+// error in the input is reported and the next change is waited for.
+void watch_book(const char *bookdef) {
+    const auto bookdef_path = std::filesystem::absolute(bookdef).lexically_normal();
+    SourceWatcher watcher;
+    RebuildCache rebuild_cache;
+    // If the book definition can not be read, wait for it to be fixed.
+    watcher.watch({bookdef_path});
+    while(true) {
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            watcher.watch(book_files(bookdef));
+            build_book(bookdef, &rebuild_cache);
+            rebuild_cache.finish_build();
+            const auto end = std::chrono::steady_clock::now();
+            printf("Build took %.2f s. Waiting for changes.\n",
+                   std::chrono::duration<double>(end - start).count());
+        } catch(const std::exception &e) {
+            printf("Build failed: %s\nWaiting for changes.\n", e.what());
+        }
+        const auto changed = watcher.wait_for_changes();
+        // Styles and fonts are defined in the book definition.
+        if(changed.find(bookdef_path) != changed.end()) {
+            rebuild_cache.clear();
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if(argc == 3 && strcmp(argv[1], "--watch") == 0) {
+        watch_book(argv[2]);
+        return 0;
+    }
+    if(argc != 2) {
+        printf("%s [--watch] <bookdef.json>\n", argv[0]);
+        return 1;
+    }
+    try {
+        build_book(argv[1], nullptr);
+    } catch(const std::exception &e) {
+        printf("%s\n", e.what());
+        return 1;
+    }
     return 0;
 }
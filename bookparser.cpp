@@ -19,20 +19,53 @@
 #include <cassert>
 
 #include <algorithm>
+#include <array>
+#include <exception>
+#include <stdexcept>
 
 namespace {
 
 static const std::array<const char *, 10> superscript_numbers{
     "⁰", "¹", "²", "³", "⁴", "⁵", "⁶", "⁷", "⁸", "⁹"};
 
-const std::unordered_map<std::string, SpecialBlockType> specialmap{
+const std::array<std::pair<std::string_view, SpecialBlockType>, 6> specialmap{{
     {"code", SpecialBlockType::Code},
     {"footnote", SpecialBlockType::Footnote},
     {"numberlist", SpecialBlockType::NumberList},
     {"letter", SpecialBlockType::Letter},
     {"sign", SpecialBlockType::Sign},
     {"menu", SpecialBlockType::Menu},
-};
+}};
+
+const std::string_view block_fence{"```"};
+
+// The code point at the start of text, or a negative value if there is no
+// complete one.
+gunichar first_char(std::string_view text) {
+    if(text.empty()) {
+        return (gunichar)-2;
+    }
+    return g_utf8_get_char_validated(text.data(), text.length());
+}
+
+// Word characters and spaces are the same as \w and \s in the Unicode
+// mode of GRegex. Both return the length of the character in bytes, or zero
+// if text does not start with one.
+int64_t word_char_length(std::string_view text) {
+    const auto c = first_char(text);
+    if(c == (gunichar)-1 || c == (gunichar)-2 || !(c == '_' || g_unichar_isalnum(c))) {
+        return 0;
+    }
+    return g_utf8_next_char(text.data()) - text.data();
+}
+
+int64_t space_char_length(std::string_view text) {
+    const auto c = first_char(text);
+    if(c == (gunichar)-1 || c == (gunichar)-2 || !g_unichar_isspace(c)) {
+        return 0;
+    }
+    return g_utf8_next_char(text.data()) - text.data();
+}
 
 } // namespace
 
@@ -43,16 +76,35 @@ std::string get_normalized_string(std::string_view v) {
     return result;
 }
 
-ReMatchOffsets ReMatchResult::offsets_for(int group) {
-    gint start_pos, end_pos;
-    g_match_info_fetch_pos(minfo.get(), gint(group), &start_pos, &end_pos);
-    assert(group != 0 || start_pos == 0);
-    return ReMatchOffsets{offset_to_match_start + start_pos, offset_to_match_start + end_pos};
+int64_t LineParser::line_end(int64_t pos) const {
+    while(pos < data_size && data[pos] != '\n') {
+        ++pos;
+    }
+    return pos;
 }
 
-std::string_view ReMatchResult::view_for(int group, const char *original_data) {
-    ReMatchOffsets off = offsets_for(group);
-    return std::string_view(original_data + off.start_pos, off.end_pos - off.start_pos);
+int64_t LineParser::word_end(int64_t pos) const {
+    while(const auto len = word_char_length(std::string_view(data + pos, data_size - pos))) {
+        pos += len;
+    }
+    return pos;
+}
+
+// A fence followed by optional spaces and a newline. Returns the length of
+// the match or zero if there is none.
+int64_t LineParser::block_end_length(int64_t pos) const {
+    const std::string_view rest(data + pos, data_size - pos);
+    if(!rest.starts_with(block_fence)) {
+        return 0;
+    }
+    int64_t end = pos + block_fence.length();
+    while(end < data_size && data[end] == ' ') {
+        ++end;
+    }
+    if(end >= data_size || data[end] != '\n') {
+        return 0;
+    }
+    return end + 1 - pos;
 }
 
 line_token LineParser::next() {
@@ -61,89 +113,110 @@ line_token LineParser::next() {
     }
 
     if(parsing_specialblock) {
-        auto block_end = try_match(specialblock_end, GRegexMatchFlags(0));
-        if(block_end) {
+        if(const auto block_end = block_end_length(offset)) {
+            offset += block_end;
             parsing_specialblock = false;
             return EndOfSpecialBlock{};
-        } else {
-            auto full_line = try_match(line, GRegexMatchFlags(0));
-            auto nl = try_match(single_newline, GRegexMatchFlags(0));
-            if(!nl) {
-                std::abort();
-            }
-            if(full_line) {
-                return PlainLine{full_line->whole_match};
-            }
-            return PlainLine{std::string_view{}}; // Empty line.
         }
+        const auto eol = line_end(offset);
+        if(eol >= data_size) {
+            throw std::runtime_error("Special block is not terminated.");
+        }
+        const std::string_view text(data + offset, eol - offset);
+        offset = eol + 1;
+        return PlainLine{text}; // Empty for empty lines.
     }
-    auto match_result = try_match(multi_newline, GRegexMatchFlags(0));
-    if(match_result) {
-        if(match_result->whole_match.length() > 1) {
+
+    if(data[offset] == '\n') {
+        int64_t newlines = 0;
+        while(offset < data_size && data[offset] == '\n') {
+            ++offset;
+            ++newlines;
+        }
+        if(newlines > 1) {
             return NewBlock{};
         }
         return NewLine{};
     }
-    match_result = try_match(specialblock_start, GRegexMatchFlags(0));
-    if(match_result) {
-        if(parsing_specialblock) {
-            printf("Nested codeblocks not supported.\n");
-            std::abort();
+
+    const std::string_view rest(data + offset, data_size - offset);
+    if(rest.starts_with(block_fence) && word_char_length(rest.substr(block_fence.length())) > 0) {
+        const auto name_start = offset + int64_t(block_fence.length());
+        const auto name_end = word_end(name_start);
+        if(name_end >= data_size || data[name_end] != '\n') {
+            throw std::runtime_error("Special block name must be followed by a newline.");
         }
-        parsing_specialblock = true;
-        if(!try_match(multi_newline, GRegexMatchFlags(0))) {
-            std::abort();
+        offset = name_end;
+        while(offset < data_size && data[offset] == '\n') {
+            ++offset;
         }
-        const auto block_name = match_result->view_for(1, data);
-        auto it = specialmap.find(std::string{block_name});
-        if(it != specialmap.end()) {
-            return StartOfSpecialBlock{it->second};
+        parsing_specialblock = true;
+        const std::string_view block_name(data + name_start, name_end - name_start);
+        for(const auto &[name, type] : specialmap) {
+            if(name == block_name) {
+                return StartOfSpecialBlock{type};
+            }
         }
-        std::string tmp{block_name};
-        printf("Unknown special block type: %s\n", tmp.c_str());
-        std::abort();
+        throw std::runtime_error("Unknown special block type: " + std::string{block_name});
     }
-    match_result = try_match(specialblock_end, GRegexMatchFlags(0));
-    if(match_result) {
-        printf("End of codeblock without start of same.\n");
-        std::abort();
+    if(block_end_length(offset) > 0) {
+        throw std::runtime_error("End of codeblock without start of same.");
     }
-    match_result = try_match(directive, GRegexMatchFlags(0));
-    if(match_result) {
-        auto dir_name = match_result->view_for(1, data);
+
+    if(rest.front() == '#' && word_char_length(rest.substr(1)) > 0) {
+        // A directive name, optionally followed by spaces and an argument.
+        const auto name_start = offset + 1;
+        const auto name_end = word_end(name_start);
+        auto arg_start = name_end;
+        while(arg_start < data_size && data[arg_start] == ' ') {
+            ++arg_start;
+        }
+        std::string_view arg;
+        if(arg_start > name_end && arg_start < data_size) {
+            const auto arg_end = line_end(arg_start + 1);
+            arg = std::string_view(data + arg_start, arg_end - arg_start);
+            offset = arg_end;
+        } else {
+            offset = name_end;
+        }
+        const std::string_view dir_name(data + name_start, name_end - name_start);
         if(dir_name == "s") {
             return SceneDecl{};
         } else if(dir_name == "figure") {
-            auto fname = match_result->view_for(2, data);
-            while(!fname.empty() && fname.front() == ' ') {
-                fname.remove_prefix(1);
-            }
-            return FigureDecl{std::string{fname}};
+            return FigureDecl{arg};
         } else {
-            std::string tmp{dir_name};
-            printf("Unknown directive '%s'.\n", tmp.c_str());
-            std::abort();
+            throw std::runtime_error("Unknown directive '" + std::string{dir_name} + "'.");
         }
     }
-    match_result = try_match(section, GRegexMatchFlags(0));
-    if(match_result) {
-        const auto hash_offsets = match_result->offsets_for(1);
-        const int depth = hash_offsets.end_pos - hash_offsets.start_pos;
-        assert(depth == 1); // Fix eventually.
 
-        return SectionDecl{depth, match_result->view_for(2, data)};
-    }
-    match_result = try_match(line, GRegexMatchFlags(0));
-    if(match_result) {
-        return PlainLine{match_result->whole_match};
+    if(rest.front() == '#') {
+        auto hash_end = offset;
+        while(hash_end < data_size && data[hash_end] == '#') {
+            ++hash_end;
+        }
+        auto text_start = hash_end;
+        while(const auto len =
+                  space_char_length(std::string_view(data + text_start, data_size - text_start))) {
+            text_start += len;
+        }
+        if(text_start > hash_end) {
+            const int depth = hash_end - offset;
+            assert(depth == 1); // Fix eventually.
+            const auto text_end = line_end(text_start);
+            offset = text_end;
+            return SectionDecl{depth, std::string_view(data + text_start, text_end - text_start)};
+        }
     }
 
-    printf("Parsing failed.");
-    std::abort();
+    const auto eol = line_end(offset);
+    const std::string_view text(data + offset, eol - offset);
+    offset = eol;
+    return PlainLine{text};
 }
 
 StructureParser::~StructureParser() {
-    if(!stored_lines.empty()) {
+    // Input errors throw in the middle of a block.
+    if(!stored_lines.empty() && std::uncaught_exceptions() == 0) {
         printf("Stored lines not fully drained.\n");
         std::abort();
     }
@@ -343,7 +416,7 @@ void StructureParser::push(const line_token &l) {
         doc.elements.push_back(SceneChange{});
     } else if(std::holds_alternative<FigureDecl>(l)) {
         set_state(ParsingState::unset);
-        doc.elements.push_back(Figure{std::get<FigureDecl>(l).fname});
+        doc.elements.push_back(Figure{std::string{std::get<FigureDecl>(l).fname}});
     } else if(std::holds_alternative<EndOfFile>(l)) {
         set_state(ParsingState::unset);
     } else {
@@ -26,38 +26,10 @@
 #include <variant>
 #include <memory>
 
-struct MatchDeleter final {
-    void operator()(GMatchInfo *mi) { g_match_info_unref(mi); }
-};
-
-typedef std::unique_ptr<GMatchInfo, MatchDeleter> re_match;
-
-struct ReMatchOffsets {
-    int64_t start_pos;
-    int64_t end_pos;
-
-    std::string get_normalized_string(const char *original_data) const {
-        gchar *norm =
-            g_utf8_normalize(original_data + start_pos, end_pos - start_pos, G_NORMALIZE_NFC);
-        std::string result{norm};
-        g_free(norm);
-        return result;
-    }
-};
-
 std::string get_normalized_string(std::string_view v);
 
 enum class SpecialBlockType : int { Code, Footnote, NumberList, Letter, Sign, Menu, Unset };
 
-struct ReMatchResult {
-    re_match minfo;
-    int64_t offset_to_match_start;
-    std::string_view whole_match;
-
-    ReMatchOffsets offsets_for(int group);
-    std::string_view view_for(int group, const char *original_data);
-};
-
 struct SectionDecl {
     int level;
     std::string_view text;
@@ -72,7 +44,7 @@ struct NewLine {};
 struct SceneDecl {};
 
 struct FigureDecl {
-    std::string fname;
+    std::string_view fname;
 };
 
 struct NewBlock {};
@@ -96,60 +68,23 @@ typedef std::variant<SectionDecl,
                      EndOfFile>
     line_token;
 
+// Splits bookdown source into tokens in a single pass. The tokens point
+// into the source data, which must outlive them.
 class LineParser {
 public:
-    LineParser(const char *data_, const int64_t data_size_) : data(data_), data_size(data_size_) {
-        whitespace = g_regex_new("  \\s+", GRegexCompileFlags(0), G_REGEX_MATCH_ANCHORED, nullptr);
-        section =
-            g_regex_new("(#+)\\s+(.*)", GRegexCompileFlags(0), G_REGEX_MATCH_ANCHORED, nullptr);
-        line = g_regex_new(".+", GRegexCompileFlags(0), G_REGEX_MATCH_ANCHORED, nullptr);
-        multi_newline = g_regex_new("\\n+", G_REGEX_MULTILINE, G_REGEX_MATCH_ANCHORED, nullptr);
-        single_newline = g_regex_new("\\n", G_REGEX_MULTILINE, G_REGEX_MATCH_ANCHORED, nullptr);
-        directive = g_regex_new(
-            "#(\\w+)( +[^ ].*)?", GRegexCompileFlags(0), G_REGEX_MATCH_ANCHORED, nullptr);
-        specialblock_start =
-            g_regex_new("```(\\w+)", GRegexCompileFlags(0), G_REGEX_MATCH_ANCHORED, nullptr);
-        specialblock_end =
-            g_regex_new("``` *\n", G_REGEX_MULTILINE, G_REGEX_MATCH_ANCHORED, nullptr);
-    }
-
-    ~LineParser() {
-        g_regex_unref(multi_newline);
-        g_regex_unref(single_newline);
-        g_regex_unref(section);
-        g_regex_unref(line);
-        g_regex_unref(whitespace);
-        g_regex_unref(specialblock_start);
-        g_regex_unref(specialblock_end);
-    }
+    LineParser(const char *data_, const int64_t data_size_) : data(data_), data_size(data_size_) {}
 
     line_token next();
 
 private:
-    std::optional<ReMatchResult> try_match(GRegex *regex, GRegexMatchFlags flags) {
-        GMatchInfo *minfo = nullptr;
-        if(g_regex_match(regex, data + offset, flags, &minfo)) {
-            ReMatchResult match_info{re_match{minfo}, offset, std::string_view{}};
-            match_info.whole_match = match_info.view_for(0, data);
-            offset += match_info.whole_match.length();
-            return match_info;
-        }
-        g_match_info_free(minfo);
-        return {};
-    }
+    int64_t line_end(int64_t pos) const;
+    int64_t word_end(int64_t pos) const;
+    int64_t block_end_length(int64_t pos) const;
 
     const char *data;
     bool parsing_specialblock = false;
     int64_t data_size;
     int64_t offset = 0;
-    GRegex *whitespace;
-    GRegex *section;
-    GRegex *line;
-    GRegex *single_newline;
-    GRegex *multi_newline;
-    GRegex *directive;
-    GRegex *specialblock_start;
-    GRegex *specialblock_end;
 };
 
 class StructureParser {
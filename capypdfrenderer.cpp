@@ -30,47 +30,22 @@
 
 namespace {
 
-size_t
-get_endpoint(hb_glyph_info_t *glyph_info, size_t glyph_count, size_t i, const char *sampletext) {
-    if(i + 1 < glyph_count) {
-        return glyph_info[i + 1].cluster;
-    }
-    return strlen(sampletext);
-}
-
-void hb_buffer_to_textsequence(hb_buffer_t *buf,
-                               capypdf::TextSequence &ts,
-                               FontInfo &fontinfo,
-                               double hbscale,
-                               const char *unshaped_text) {
-
-    unsigned int glyph_count;
-    hb_glyph_info_t *glyph_info = hb_buffer_get_glyph_infos(buf, &glyph_count);
-    hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
-    for(unsigned int i = 0; i < glyph_count; i++) {
-        const hb_glyph_info_t *current = glyph_info + i;
-        const hb_glyph_position_t *curpos = glyph_pos + i;
-        const hb_codepoint_t glyphid = current->codepoint;
-        // const hb_position_t x_offset = curpos->x_offset;
-        // hb_position_t y_offset = curpos->y_offset;
-        const hb_position_t x_advance = curpos->x_advance;
-        // hb_position_t y_advance = curpos->y_advance;
-        const auto original_text_start = unshaped_text + glyph_info[i].cluster;
-        const auto original_text_end =
-            unshaped_text + get_endpoint(glyph_info, glyph_count, i, unshaped_text);
+void shaped_run_to_textsequence(const HBRun &run, capypdf::TextSequence &ts) {
+    const char *unshaped_text = run.text.c_str();
+    for(size_t i = 0; i < run.glyphs.size(); i++) {
+        const auto &glyph = run.glyphs[i];
+        const auto original_text_start = unshaped_text + glyph.cluster;
+        const size_t text_end =
+            i + 1 < run.glyphs.size() ? run.glyphs[i + 1].cluster : run.text.size();
+        const auto original_text_end = unshaped_text + text_end;
         const std::string_view original_text(original_text_start, original_text_end);
-        const auto hb_glyph_advance_in_font_units =
-            hb_font_get_glyph_h_advance(fontinfo.f, current->codepoint) / hbscale *
-            fontinfo.units_per_em;
-        const auto hb_advance_in_font_units = x_advance / hbscale * fontinfo.units_per_em;
-        const int32_t kerning_delta =
-            int32_t(hb_glyph_advance_in_font_units - hb_advance_in_font_units);
+        const int32_t kerning_delta = glyph.nominal_advance - glyph.x_advance;
         const auto *one_char_forward = g_utf8_next_char(original_text_start);
         if(one_char_forward == original_text_end) {
             const uint32_t original_codepoint = g_utf8_get_char(original_text_start);
-            ts.append_raw_glyph(glyphid, original_codepoint);
+            ts.append_raw_glyph(glyph.glyph_id, original_codepoint);
         } else {
-            ts.append_ligature_glyph(glyphid, original_text);
+            ts.append_ligature_glyph(glyph.glyph_id, original_text);
         }
         if(kerning_delta != 0) {
             ts.append_kerning(kerning_delta);
@@ -197,27 +172,18 @@ void CapyPdfRenderer::draw_poly_line(const std::vector<Coord> &points, Length th
     ctx.cmd_Q();
 }
 
-void CapyPdfRenderer::render_line_justified(const HBLine line,
-                                            Length line_width,
-                                            Length x,
-                                            Length y) {
-    const Length text_width = meas.text_width(line);
+void CapyPdfRenderer::render_line_justified(
+    const HBLine &line, Length line_width, Length text_width, Length x, Length y) {
     const double num_spaces = line.words.size() - 1;
     // assert(num_spaces > 1);
     const Length space_extra_width{num_spaces > 0 ? ((line_width - text_width) / num_spaces)
                                                   : Length::zero()};
     const Length space_extra_width_fontunits = 1000 * space_extra_width;
 
-    hb_buffer_t *buf = hb_buffer_create();
-    std::unique_ptr<hb_buffer_t, HBBufferCloser> bc(buf);
-
-    const double num_steps = HBFontCache::NUM_STEPS;
-
     assert(!line.words.empty());
 
     capypdf::Text text = ctx.text_new();
     text.cmd_Td(x.pt(), y.pt());
-    std::vector<hb_feature_t> features;
 
     for(size_t i = 0; i < line.words.size(); ++i) {
         // const bool is_first = i == 0;
@@ -228,27 +194,11 @@ void CapyPdfRenderer::render_line_justified(const HBLine line,
             // FIXME, only set font if the style changes.
             auto fontinfo = std::move(fc.get_font(run.par.par).value());
             auto capyfont_id = hbfont2capyfont(fontinfo);
-            const double run_font_size = run.par.size.pt();
-
-            const double hbscale = run_font_size * num_steps;
-
-            hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
-            hb_buffer_set_script(buf, HB_SCRIPT_LATIN);
-            hb_buffer_set_language(buf, hb_language_from_string("fi", -1));
-            hb_buffer_add_utf8(buf, run.text.data(), run.text.size(), 0, -1);
-
-            hb_font_set_scale(fontinfo.f, hbscale, hbscale);
-
-            features.clear();
-            append_shaping_options(run.par, features);
-            hb_shape(fontinfo.f, buf, features.data(), features.size());
-
             text.cmd_Tf(capyfont_id, run.par.size.pt());
-            hb_buffer_to_textsequence(buf, ts, fontinfo, hbscale, run.text.c_str());
+            append_run(run, ts);
             if(!is_last) {
                 ts.append_kerning(-space_extra_width_fontunits.pt() / run.par.size.pt());
             }
-            hb_buffer_reset(buf);
         }
         text.cmd_TJ(ts);
     }
@@ -272,23 +222,11 @@ void CapyPdfRenderer::render_text_as_is(const char *line,
 void CapyPdfRenderer::render_run(const HBRun &run, Length x, Length y) {
     auto fontinfo = std::move(fc.get_font(run.par.par).value());
     auto capyfont_id = hbfont2capyfont(fontinfo);
-    hb_buffer_t *buf = hb_buffer_create();
-    std::unique_ptr<hb_buffer_t, HBBufferCloser> bc(buf);
-
-    const double num_steps = HBFontCache::NUM_STEPS;
-    const double hbscale = run.par.size.pt() * num_steps;
-
-    hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
-    hb_buffer_set_script(buf, HB_SCRIPT_LATIN);
-    hb_buffer_set_language(buf, hb_language_from_string("fi", -1));
-
-    hb_buffer_guess_segment_properties(buf);
-    hb_font_set_scale(fontinfo.f, hbscale, hbscale);
 
     capypdf::Text text = ctx.text_new();
     text.cmd_Tf(capyfont_id, run.par.size.pt());
     text.cmd_Td(x.pt(), y.pt());
-    serialize_single_run(run, text, buf);
+    serialize_single_run(run, text);
 
     ctx.render_text_obj(text);
 }
@@ -307,34 +245,26 @@ void CapyPdfRenderer::render_text_as_is(
     }
 }
 
-void CapyPdfRenderer::serialize_single_run(const HBRun &run,
-                                           capypdf::Text &tobj,
-                                           hb_buffer_t *buf) {
-    auto fontinfo = std::move(fc.get_font(run.par.par).value());
-    auto *hbfont = fontinfo.f;
-
+void CapyPdfRenderer::append_run(const HBRun &run, capypdf::TextSequence &ts) {
     if(run.text.empty()) {
         return;
     }
+    if(!run.glyphs.empty()) {
+        shaped_run_to_textsequence(run, ts);
+        return;
+    }
+    // Text that did not go through layout, such as page numbers.
+    HBRun shaped_run = run;
+    meas.shape(shaped_run);
+    shaped_run_to_textsequence(shaped_run, ts);
+}
 
-    const double num_steps = HBFontCache::NUM_STEPS;
-    const double hbscale = run.par.size.pt() * num_steps;
-
-    hb_buffer_clear_contents(buf);
-    hb_buffer_add_utf8(buf, run.text.data(), run.text.size(), 0, -1);
-
-    hb_buffer_guess_segment_properties(buf);
-    hb_font_set_scale(hbfont, hbscale, hbscale);
-
-    // tobj.cmd_Tf(capyfont_id, run.par.size.pt());
+void CapyPdfRenderer::serialize_single_run(const HBRun &run, capypdf::Text &tobj) {
+    if(run.text.empty()) {
+        return;
+    }
     capypdf::TextSequence ts;
-
-    std::vector<hb_feature_t> features;
-    append_shaping_options(run.par, features);
-    hb_shape(hbfont, buf, features.data(), features.size());
-
-    hb_buffer_to_textsequence(buf, ts, fontinfo, hbscale, run.text.c_str());
-
+    append_run(run, ts);
     tobj.cmd_TJ(ts);
 }
 
@@ -375,17 +305,6 @@ void CapyPdfRenderer::render_runs(const std::vector<HBRun> &runs,
         }
     }
 
-    hb_buffer_t *buf = hb_buffer_create();
-    std::unique_ptr<hb_buffer_t, HBBufferCloser> bc(buf);
-
-    const double num_steps = HBFontCache::NUM_STEPS;
-
-    hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
-    hb_buffer_set_script(buf, HB_SCRIPT_LATIN);
-    hb_buffer_set_language(buf, hb_language_from_string("fi", -1));
-
-    hb_buffer_guess_segment_properties(buf);
-
     capypdf::Text text = ctx.text_new();
     text.cmd_Td((x + deltax).pt(), y.pt());
     for(size_t i = 0; i < runs.size(); ++i) {
@@ -393,11 +312,9 @@ void CapyPdfRenderer::render_runs(const std::vector<HBRun> &runs,
         if(i == 0 || runs[i].par != runs[i - 1].par) {
             auto fontinfo = std::move(fc.get_font(run.par.par).value());
             auto capyfont_id = hbfont2capyfont(fontinfo);
-            const double hbscale = run.par.size.pt() * num_steps;
-            hb_font_set_scale(fontinfo.f, hbscale, hbscale);
             text.cmd_Tf(capyfont_id, run.par.size.pt());
         }
-        serialize_single_run(run, text, buf);
+        serialize_single_run(run, text);
     }
 
     ctx.render_text_obj(text);
@@ -538,12 +455,13 @@ void CapyPdfRenderer::add_section_outline(int section_number, const std::string
 
 CapyPDF_FontId CapyPdfRenderer::hbfont2capyfont(const FontInfo &fontinfo) {
     assert(fontinfo.f);
-    auto it = loaded_fonts.find(fontinfo.f);
+    // All scaled versions of a font map to the same PDF font.
+    auto it = loaded_fonts.find(*fontinfo.fname);
     if(it != loaded_fonts.end()) {
         return it->second;
     }
     capypdf::FontProperties fprop;
     auto font_id = capygen.load_font(fontinfo.fname->string().c_str(), fprop);
-    loaded_fonts[fontinfo.f] = font_id;
+    loaded_fonts[*fontinfo.fname] = font_id;
     return font_id;
 }
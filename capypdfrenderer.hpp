@@ -42,7 +42,8 @@ public:
                              HBFontCache &fc_);
     ~CapyPdfRenderer();
 
-    void render_line_justified(const HBLine line, Length line_width_mm, Length x, Length y);
+    void render_line_justified(
+        const HBLine &line, Length line_width, Length text_width, Length x, Length y);
 
     void render_text_as_is(const char *line, const HBTextParameters &par, Length x, Length y);
     void render_text_as_is(
@@ -97,7 +98,8 @@ private:
     void draw_grid();
     void draw_cropmarks();
 
-    void serialize_single_run(const HBRun &run, capypdf::Text &tobj, hb_buffer_t *buf);
+    void serialize_single_run(const HBRun &run, capypdf::Text &tobj);
+    void append_run(const HBRun &run, capypdf::TextSequence &ts);
 
     CapyPDF_FontId hbfont2capyfont(const FontInfo &fontinfo);
 
@@ -107,7 +109,7 @@ private:
     double bleed;
     double pagew, pageh;
     double mediaw, mediah;
-    std::unordered_map<hb_font_t *, CapyPDF_FontId> loaded_fonts;
+    std::unordered_map<std::filesystem::path, CapyPDF_FontId> loaded_fonts;
     std::unordered_map<std::filesystem::path, CapyImageInfo> loaded_images;
     std::string outname;
     HBFontCache &fc;
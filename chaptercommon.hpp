@@ -20,6 +20,7 @@
 
 #include <functional>
 #include <string>
+#include <vector>
 #include <cmath>
 #include <cstdint>
 
@@ -50,6 +51,27 @@ struct ExtraPenaltyAmounts {
     double single_split_word_line = 500;
 };
 
+// Split point indices where the lines of a paragraph end and the
+// penalty of splitting it that way. If hyphenation was left to the line
+// breaker, only the words that lines end within are hyphenated in the split
+// points that the line ends refer to.
+struct ParagraphBreaking {
+    std::vector<size_t> line_ends;
+    double penalty;
+    std::vector<size_t> hyphenated_words;
+};
+
+// How much work an optimizer may do. Zero means no limit.
+struct SearchLimits {
+    int64_t milliseconds = 0;
+    uint64_t nodes = 0;
+};
+
+enum class SplitAlgorithm : int {
+    Dynamic,
+    Recursive,
+};
+
 // Some fonts have "medium" instead of "regular" as their weight.
 // For example Nimbus Roman. This is currently ignored, might need
 // to be fixed.
@@ -199,9 +221,18 @@ struct HBChapterStyles {
     HBChapterParameters credits;
 };
 
+// Output of shaping. Advances are in font units.
+struct ShapedGlyph {
+    uint32_t glyph_id;
+    uint32_t cluster; // Byte offset of the glyph's text in the run.
+    int32_t x_advance;
+    int32_t nominal_advance; // The glyph's own advance without kerning.
+};
+
 struct HBRun {
     HBTextParameters par;
     std::string text;
+    std::vector<ShapedGlyph> glyphs; // Empty until the run has been shaped.
 };
 
 struct HBWord {
@@ -211,20 +242,3 @@ struct HBWord {
 struct HBLine {
     std::vector<HBWord> words;
 };
-
-struct HBStyledPlainText {
-    std::string text;
-    HBTextParameters font;
-
-    bool operator==(const HBStyledPlainText &o) const noexcept {
-        return text == o.text && font == o.font;
-    }
-};
-
-template<> struct std::hash<HBStyledPlainText> {
-    std::size_t operator()(HBStyledPlainText const &s) const noexcept {
-        auto h1 = std::hash<std::string>{}(s.text);
-        auto h2 = std::hash<HBTextParameters>{}(s.font);
-        return (h1 * 13) + h2;
-    }
-};
@@ -18,209 +18,259 @@
 #include <algorithm>
 #include <cassert>
 
-ChapterFormatter::ChapterFormatter(const TextElementIterator &start_,
-                                   const TextElementIterator &end_,
-                                   const std::vector<TextElement> &elms,
-                                   size_t target_height_)
-    : start{start_}, end{end_}, elements{elms}, target_height{target_height_} {}
-
-PageLayoutResult ChapterFormatter::optimize_pages() {
-    PageLayoutResult r;
+namespace {
 
-    auto run_start = start;
-    try {
-        optimize_recursive(run_start, r);
-    } catch(const OptimalResultFound &) {
-    }
-    return std::move(best_layout);
+uint64_t state_key(size_t position, bool odd_page, size_t previous_height) {
+    return (uint64_t(position) << 32) | (uint64_t(previous_height) << 1) | uint64_t(odd_page);
 }
 
-bool ChapterFormatter::stop_recursing(TextElementIterator loc, const PageLayoutResult &r) {
-    size_t max_reaches = 5;
-    auto current_penalty = compute_penalties(r.pages).total_penalty;
-    auto &reaches = best_reaches[loc];
-    if(reaches.size() >= max_reaches) {
-        if(current_penalty >= reaches.back()) {
-            return true;
-        }
-        reaches.pop_back();
-    }
-    auto insertion_point = std::lower_bound(reaches.begin(), reaches.end(), current_penalty);
-    reaches.insert(insertion_point, current_penalty);
+} // namespace
 
-    return false;
+ChapterFormatter::ChapterFormatter(const LineTable &lines_,
+                                   const std::vector<TextElement> &elms,
+                                   size_t target_height_,
+                                   SearchBudget &budget_)
+    : lines{lines_}, elements{elms}, end{lines_.size()}, target_height{target_height_},
+      budget{budget_} {}
+
+ChapterFormatter::ChapterFormatter(const LineTable &lines_,
+                                   const std::vector<TextElement> &elms,
+                                   size_t target_height_,
+                                   SearchBudget &budget_,
+                                   ChapterFormatter &base_,
+                                   size_t changed_element)
+    : ChapterFormatter(lines_, elms, target_height_, budget_) {
+    base = &base_;
+    shared_from = lines.first_line(changed_element + 1);
+    base_shared_from = base->lines.first_line(changed_element + 1);
+    assert(end - shared_from == base->end - base_shared_from);
 }
 
-void ChapterFormatter::optimize_recursive(
-    TextElementIterator run_start,
-    PageLayoutResult &r,
-    const std::optional<ImageElement> incoming_pending_image) {
-    size_t lines_on_page = 0;
-    std::optional<size_t> page_section_number;
-    std::optional<ImageElement> current_page_image;
-    std::optional<ImageElement> outgoing_pending_image;
-    if(compute_penalties(r.pages).total_penalty > best_penalty) {
-        return;
+PageLayoutResult ChapterFormatter::optimize_pages() {
+    fills.assign(end, std::nullopt);
+
+    PageLayoutResult r;
+    const size_t total_penalty = best_choice(PageState{0, false, 0}).penalty;
+    // Pages refer to elements rather than lines, so the ones that come from
+    // the base can be used as is.
+    ChapterFormatter *f = this;
+    std::optional<PageState> state = PageState{0, false, 0};
+    while(state) {
+        if(f->in_base(*state)) {
+            state = f->to_base(*state);
+            f = f->base;
+        }
+        const auto &choice = f->best_choice(*state);
+        if(choice.page) {
+            r.pages.push_back(*choice.page);
+        }
+        state = choice.next;
     }
+    r.stats = compute_penalties(r.pages);
+    r.budget_limited = budget.exhausted();
+    assert(r.stats.total_penalty == total_penalty);
+    (void)total_penalty;
+    return r;
+}
 
-    if(incoming_pending_image) {
-        // FIXME, check for full page images.
-        current_page_image = incoming_pending_image;
-        lines_on_page = current_page_image->height_in_lines;
+// Adds lines to a page until it is full or the chapter ends.
+const ChapterFormatter::PageFill &ChapterFormatter::fill_page(size_t position) {
+    auto &cached = fills[position];
+    if(cached) {
+        return *cached;
     }
-    for(TextElementIterator current = run_start; current != end; ++current) {
-        auto push_and_resume = [&](const TextElementIterator &startpoint,
-                                   const TextElementIterator &endpoint) {
-            TextLimits limits{startpoint, endpoint};
-            if(page_section_number) {
-                assert(!current_page_image);
-                r.pages.emplace_back(SectionPage{*page_section_number, limits});
-            } else {
-                r.pages.emplace_back(RegularPage{limits, {}, current_page_image});
-            }
-            const size_t height_validation = r.pages.size();
-            optimize_recursive(endpoint, r);
-            assert(height_validation == r.pages.size());
-            r.pages.pop_back();
-        };
-        // Have we filled the current page?
-        if(lines_on_page >= target_height) {
-            // Exact.
-            auto endpoint = current;
-            push_and_resume(run_start, endpoint);
-            // One line short
-            --endpoint;
-            push_and_resume(run_start, endpoint);
-            // One line long
-            if(current != end) {
-                endpoint = current;
-                ++endpoint;
-                push_and_resume(run_start, endpoint);
-            }
-            // It's a bit weird to return here, but that's recursion for you.
-            return;
+    PageFill fill;
+    std::optional<ImageElement> pending_image;
+    for(size_t i = position; i < end; ++i) {
+        if(fill.lines >= target_height) {
+            fill.full_at = i;
+            break;
         }
-        if(auto *sec = std::get_if<SectionElement>(&current.element())) {
+        switch(lines.kind[i]) {
+        case LineKind::Section:
             // There can be only one of these in a chapter and it must come first.
-            assert(current == run_start);
-            assert(lines_on_page == 0);
-            const size_t chapter_heading_top_whitespace = 8;
-            lines_on_page +=
-                chapter_heading_top_whitespace; // Hack, replace with a proper whitespace element.
-            page_section_number = sec->chapter_number;
-            ++lines_on_page;
-        } else if(auto *par = std::get_if<ParagraphElement>(&current.element())) {
-            (void)par;
-            ++lines_on_page;
-        } else if(const auto *empty = std::get_if<EmptyLineElement>(&current.element())) {
-            if(lines_on_page != 0) {
+            assert(i == position);
+            assert(fill.lines == 0);
+            fill.lines += lines.fill_height(i);
+            fill.section_number =
+                std::get<SectionElement>(elements[lines.element_id[i]]).chapter_number;
+            break;
+        case LineKind::Paragraph:
+        case LineKind::Special:
+            fill.lines += lines.fill_height(i);
+            break;
+        case LineKind::Empty:
+            if(fill.lines != 0) {
                 // Ignore empty space at the beginning of the line.
-                lines_on_page += empty->num_lines;
+                fill.lines += lines.fill_height(i);
             }
-        } else if(const auto *cb = std::get_if<SpecialTextElement>(&current.element())) {
-            (void)cb;
-            ++lines_on_page;
-        } else if(const auto *imel = std::get_if<ImageElement>(&current.element())) {
-            if(lines_on_page + imel->height_in_lines > target_height) {
-                assert(!outgoing_pending_image);
-                outgoing_pending_image = *imel;
+            break;
+        case LineKind::Image:
+            if(fill.lines + lines.fill_height(i) > target_height) {
+                // FIXME, images that do not fit are not moved to the next page.
+                assert(!pending_image);
+                pending_image = std::get<ImageElement>(elements[lines.element_id[i]]);
             } else {
-                assert(!current_page_image);
-                lines_on_page += imel->height_in_lines;
-                current_page_image = *imel;
+                assert(!fill.image);
+                fill.lines += lines.fill_height(i);
+                fill.image = std::get<ImageElement>(elements[lines.element_id[i]]);
             }
-        } else {
-            // FIXME, add images etc.
-            std::abort();
+            break;
         }
     }
-    if(lines_on_page > 0) {
-        TextLimits limits;
-        limits.start = run_start;
-        limits.end = end;
-        if(page_section_number) {
-            r.pages.emplace_back(SectionPage{page_section_number.value(), limits});
+    cached = std::move(fill);
+    return *cached;
+}
+
+// True if no more pages are needed after this position.
+bool ChapterFormatter::is_empty_tail(size_t position) {
+    if(position == end) {
+        return true;
+    }
+    const auto &fill = fill_page(position);
+    return !fill.full_at && fill.lines == 0;
+}
+
+// A full page can end exactly where it got full, one line before or one
+// line after. Ties are resolved in that order.
+ChapterFormatter::PageState ChapterFormatter::to_base(const PageState &state) const {
+    return PageState{
+        state.position - shared_from + base_shared_from, state.odd_page, state.previous_height};
+}
+
+const ChapterFormatter::PageChoice &ChapterFormatter::best_choice(const PageState &state) {
+    if(in_base(state)) {
+        // Nothing from here on has changed and a choice only depends on
+        // the lines after it.
+        return base->best_choice(to_base(state));
+    }
+    const auto key = state_key(state.position, state.odd_page, state.previous_height);
+    auto it = best_choices.find(key);
+    if(it != best_choices.end()) {
+        return it->second;
+    }
+    const auto &fill = fill_page(state.position);
+    std::vector<size_t> endpoints;
+    bool chapter_end = false;
+    if(fill.full_at) {
+        const auto full_at = *fill.full_at;
+        endpoints.push_back(full_at);
+        // Stepping back one line does not cross element boundaries.
+        if(lines.element_id[full_at] == 0 || lines.line_id[full_at] == 0) {
+            endpoints.push_back(full_at);
         } else {
-            r.pages.emplace_back(RegularPage{limits, {}, {}});
+            endpoints.push_back(full_at - 1);
         }
+        endpoints.push_back(full_at + 1);
+    } else if(fill.lines > 0) {
+        endpoints.push_back(end);
+        chapter_end = true;
     }
-    r.stats = compute_penalties(r.pages);
-    if(r.stats.total_penalty < best_penalty) {
-        best_layout = r;
-        best_penalty = r.stats.total_penalty;
-        if(best_penalty == 0) {
-            throw OptimalResultFound{};
-        }
+    // Only the parity and whether this is the first page matter.
+    const bool first_page = state.position == 0;
+    const size_t page_num = first_page ? 0 : (state.odd_page ? 1 : 2);
+    // Without budget only the exact break is tried.
+    const bool explore = budget.spend();
+    PageChoice best{size_t(-1), {}, {}};
+    if(endpoints.empty()) {
+        best.penalty = 0;
     }
-    if(lines_on_page > 0) {
-        r.pages.pop_back();
+    for(const auto endpoint : endpoints) {
+        if(endpoint <= state.position) {
+            // An empty page would never get anywhere.
+            continue;
+        }
+        TextLimits limits{lines.iterator(state.position), lines.iterator(endpoint)};
+        Page page;
+        if(fill.section_number) {
+            assert(!fill.image);
+            page = SectionPage{*fill.section_number, limits};
+        } else {
+            page = RegularPage{limits, {}, chapter_end ? std::nullopt : fill.image};
+        }
+        const bool last_page = is_empty_tail(endpoint);
+        PageStatistics stats;
+        add_page_penalties(stats, page, page_num, last_page, state.previous_height);
+        size_t penalty = stats.total_penalty;
+        std::optional<PageState> next;
+        if(!last_page) {
+            const bool next_odd = !state.odd_page;
+            next = PageState{endpoint, next_odd, next_odd ? 0 : lines.lines_on_page(page)};
+            penalty += best_choice(*next).penalty;
+        }
+        if(penalty < best.penalty) {
+            best = PageChoice{penalty, std::move(page), next};
+        }
+        if(!explore) {
+            break;
+        }
     }
+    return best_choices[key] = std::move(best);
 }
 
 PageStatistics ChapterFormatter::compute_penalties(const std::vector<Page> &pages) const {
     PageStatistics stats;
-    const size_t page_number_offset = 1;
-    size_t even_page_height = 0;
-    size_t odd_page_height = 0;
+    size_t previous_height = 0;
     for(size_t page_num = 0; page_num < pages.size(); ++page_num) {
         const auto &p = pages[page_num];
-        const size_t num_lines_on_page = lines_on_page(p);
-        if((page_num + 1) % 2) {
-            odd_page_height = num_lines_on_page;
-        } else {
-            even_page_height = num_lines_on_page;
-        }
         const bool on_last_page = page_num == pages.size() - 1;
-        const bool on_first_page = page_num == 0;
-        const TextLimits *limits = nullptr;
-        if(auto *rp = std::get_if<RegularPage>(&p)) {
-            limits = &rp->main_text;
-        } else if(const auto *sp = std::get_if<SectionPage>(&p)) {
-            limits = &sp->main_text;
-        } else {
-            fprintf(stderr, "Unsupported.\n");
-            std::abort();
-        }
-        const size_t first_element_id = limits->start.element_id;
-        const size_t first_line_id = limits->start.line_id;
-        const size_t last_element_id = limits->end.element_id;
-        const size_t last_line_id = limits->end.line_id;
+        add_page_penalties(stats, p, page_num, on_last_page, previous_height);
+        previous_height = lines.lines_on_page(p);
+    }
+    return stats;
+}
 
-        const auto &start_lines = get_lines(elements[first_element_id]);
-        if(last_element_id >= elements.size()) {
-            if(first_element_id == elements.size() - 1 && first_line_id == start_lines.size() - 1) {
-                stats.single_line_last_page = true;
-                stats.total_penalty += SingleLinePage;
-                continue;
-            }
+void ChapterFormatter::add_page_penalties(PageStatistics &stats,
+                                          const Page &p,
+                                          size_t page_num,
+                                          bool on_last_page,
+                                          size_t previous_height) const {
+    const size_t page_number_offset = 1;
+    const bool on_first_page = page_num == 0;
+    const TextLimits *limits = nullptr;
+    if(auto *rp = std::get_if<RegularPage>(&p)) {
+        limits = &rp->main_text;
+    } else if(const auto *sp = std::get_if<SectionPage>(&p)) {
+        limits = &sp->main_text;
+    } else {
+        fprintf(stderr, "Unsupported.\n");
+        std::abort();
+    }
+    const auto first_line = lines.index(limits->start);
+    const auto last_line = lines.index(limits->end);
+    const size_t first_line_id = lines.line_id[first_line];
+    const size_t start_lines = lines.element_lines[first_line];
+    if(limits->end.element_id >= elements.size()) {
+        if(lines.element_id[first_line] == elements.size() - 1 &&
+           first_line_id == start_lines - 1) {
+            stats.single_line_last_page = true;
+            stats.total_penalty += SingleLinePage;
+            return;
         }
-        if(last_element_id < elements.size()) {
-            const auto &end_lines = get_lines(elements[last_element_id]);
-
-            // Orphan (single line at the end of a page)
-            if(end_lines.size() > 1 && last_line_id == 1) {
-                stats.orphans.push_back(page_number_offset + page_num);
-                stats.total_penalty += OrphanPenalty;
-            }
+    }
+    if(last_line < lines.size()) {
+        // Orphan (single line at the end of a page)
+        if(lines.element_lines[last_line] > 1 && lines.line_id[last_line] == 1) {
+            stats.orphans.push_back(page_number_offset + page_num);
+            stats.total_penalty += OrphanPenalty;
         }
-        // These are only counted for "regular" pages.
-        if(std::holds_alternative<RegularPage>(p)) {
-            // Widow
-            if(start_lines.size() > 1 && first_line_id == start_lines.size() - 1) {
-                stats.widows.push_back(page_number_offset + page_num);
-                stats.total_penalty += WidowPenalty;
-            }
-            // Mismatch
-            if(!on_first_page && !on_last_page && (((page_num + 1) % 2) == 1)) {
-                if(even_page_height != odd_page_height) {
-                    const auto mismatch_amount =
-                        (int64_t)even_page_height - (int64_t)odd_page_height;
-                    stats.mismatches.emplace_back(
-                        HeightMismatch{page_number_offset + page_num, mismatch_amount});
-                    stats.total_penalty += abs(mismatch_amount) * MismatchPenalty;
-                }
+    }
+    // These are only counted for "regular" pages.
+    if(std::holds_alternative<RegularPage>(p)) {
+        // Widow
+        if(start_lines > 1 && first_line_id == start_lines - 1) {
+            stats.widows.push_back(page_number_offset + page_num);
+            stats.total_penalty += WidowPenalty;
+        }
+        // Mismatch between the heights of facing pages.
+        if(!on_first_page && !on_last_page && (((page_num + 1) % 2) == 1)) {
+            const size_t page_height = lines.lines_on_page(p);
+            if(previous_height != page_height) {
+                const auto mismatch_amount = (int64_t)previous_height - (int64_t)page_height;
+                stats.mismatches.emplace_back(
+                    HeightMismatch{page_number_offset + page_num, mismatch_amount});
+                stats.total_penalty += abs(mismatch_amount) * MismatchPenalty;
             }
         }
     }
-    return stats;
 }
@@ -17,39 +17,95 @@
 #pragma once
 
 #include <printpaginator.hpp>
+#include <searchbudget.hpp>
+#include <utils.hpp>
 
-struct OptimalResultFound {};
+#include <optional>
+#include <unordered_map>
 
+// Splits the text of one chapter into pages. The best layout is found
+// with dynamic programming over page start positions, so the running
+// time is linear in the length of the chapter. Once the budget runs out
+// the remaining pages are filled greedily.
 class ChapterFormatter {
 public:
-    ChapterFormatter(const TextElementIterator &start,
-                     const TextElementIterator &end,
+    // The line table must only contain the chapter.
+    ChapterFormatter(const LineTable &lines,
                      const std::vector<TextElement> &elms,
-                     size_t target_height);
+                     size_t target_height,
+                     SearchBudget &budget);
+    // For laying the chapter out again after the lines of one element have
+    // changed. The pages after that element are taken from base, which must
+    // have been laid out from the same elements and must outlive this.
+    ChapterFormatter(const LineTable &lines,
+                     const std::vector<TextElement> &elms,
+                     size_t target_height,
+                     SearchBudget &budget,
+                     ChapterFormatter &base,
+                     size_t changed_element);
 
     PageLayoutResult optimize_pages();
 
-private:
     static constexpr size_t WidowPenalty = 10;
     static constexpr size_t OrphanPenalty = 10;
     static constexpr size_t MismatchPenalty = 7;
     static constexpr size_t SingleLinePage = 1000;
+    // Converts paragraph penalties into the units of the page penalties above
+    // when a paragraph variant is weighed against the pages it changes. It
+    // scales the paragraph side. Paragraph penalties are squared millimetres
+    // of line width error, five times that for overfull lines, so a widow
+    // is worth about one line that is 3 mm too loose.
+    static constexpr double ParagraphPenaltyWeight = 1.0;
 
-    PageStatistics compute_penalties(const std::vector<Page> &pages) const;
+private:
 
-    void optimize_recursive(TextElementIterator run_start,
-                            PageLayoutResult &r,
-                            const std::optional<ImageElement> incoming_pending_image = {});
+    // What happens when text is added to an empty page starting from a position.
+    struct PageFill {
+        std::optional<size_t> full_at; // Line where the page got full.
+        size_t lines = 0;
+        std::optional<size_t> section_number;
+        std::optional<ImageElement> image;
+    };
 
-    bool stop_recursing(TextElementIterator loc, const PageLayoutResult &r);
+    // The penalty of a page only depends on the pages before it through
+    // the parity of its page number and the height of the previous page.
+    struct PageState {
+        size_t position;
+        bool odd_page;
+        size_t previous_height; // Only needed on even pages.
+    };
 
-    const TextElementIterator start;
-    const TextElementIterator end;
-    const std::vector<TextElement> elements;
+    struct PageChoice {
+        size_t penalty; // Of this page and all pages after it.
+        std::optional<Page> page;
+        std::optional<PageState> next;
+    };
 
-    size_t best_penalty = size_t(-1);
-    PageLayoutResult best_layout;
+    PageStatistics compute_penalties(const std::vector<Page> &pages) const;
+    void add_page_penalties(PageStatistics &stats,
+                            const Page &p,
+                            size_t page_num,
+                            bool on_last_page,
+                            size_t previous_height) const;
+
+    const PageFill &fill_page(size_t position);
+    bool is_empty_tail(size_t position);
+    const PageChoice &best_choice(const PageState &state);
+    bool in_base(const PageState &state) const {
+        return base && state.position >= shared_from;
+    }
+    PageState to_base(const PageState &state) const;
+
+    const LineTable &lines;
+    const std::vector<TextElement> &elements;
+    const size_t end; // Number of lines in the chapter.
     const size_t target_height;
+    SearchBudget &budget;
+
+    std::vector<std::optional<PageFill>> fills;
+    std::unordered_map<uint64_t, PageChoice> best_choices;
 
-    std::unordered_map<TextElementIterator, std::vector<std::size_t>> best_reaches;
+    ChapterFormatter *base = nullptr;
+    size_t shared_from = 0; // First line after the changed element.
+    size_t base_shared_from = 0;
 };
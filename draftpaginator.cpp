@@ -31,14 +31,6 @@ const int image_dpi = 600;
 
 const Length image_separator = Length::from_mm(4);
 
-template<typename T> void style_change(T &stack, typename T::value_type val) {
-    if(stack.contains(val)) {
-        stack.pop(val);
-    } else {
-        stack.push(val);
-    }
-}
-
 void adjust_y(HBTextCommands &c, Length diff) {
     if(std::holds_alternative<HBRunDrawCommand>(c)) {
         auto &mc = std::get<HBRunDrawCommand>(c);
@@ -89,68 +81,17 @@ HBChapterStyles build_default_styles() {
 
 } // namespace
 
-// NOTE: mutates the input words.
-std::vector<FormattingChange> extract_styling(StyleStack &current_style, std::string &word) {
-    std::vector<FormattingChange> changes;
-    std::string buf;
-    const char *word_start = word.c_str();
-    const char *in = word_start;
-    int num_changes = 0;
-
-    while(*in) {
-        auto c = g_utf8_get_char(in);
-
-        switch(c) {
-        case italic_codepoint:
-            style_change(current_style, ITALIC_S);
-            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), ITALIC_S});
-            ++num_changes;
-            break;
-        case bold_codepoint:
-            style_change(current_style, BOLD_S);
-            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), BOLD_S});
-            ++num_changes;
-            break;
-        case tt_codepoint:
-            style_change(current_style, TT_S);
-            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), TT_S});
-            ++num_changes;
-            break;
-        case smallcaps_codepoint:
-            style_change(current_style, SMALLCAPS_S);
-            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), SMALLCAPS_S});
-            ++num_changes;
-            break;
-        case superscript_codepoint:
-            style_change(current_style, SUPERSCRIPT_S);
-            changes.push_back(
-                FormattingChange{size_t(in - word_start - num_changes), SUPERSCRIPT_S});
-            ++num_changes;
-            break;
-        case subscript_codepoint:
-            style_change(current_style, SUBSCRIPT_S);
-            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), SUBSCRIPT_S});
-            ++num_changes;
-            break;
-        default:
-            char tmp[10];
-            const int bytes_written = g_unichar_to_utf8(c, tmp);
-            tmp[bytes_written] = '\0';
-            buf += tmp;
-        }
-        in = g_utf8_next_char(in);
-    }
-    word = buf;
-    return changes;
-}
-
 DraftPaginator::DraftPaginator(const Document &d)
     : doc(d), page(doc.data.pdf.page), styles(build_default_styles()), spaces(d.data.pdf.spaces),
-      m(doc.data.pdf.margins), fc(d.data.draftdata.fonts) {
+      m(doc.data.pdf.margins),
+      hyphen_cache(d.data.hyphenation_cache ? d.data.top_dir / HYPHENATION_CACHE_FILE
+                                            : std::filesystem::path{}),
+      fc(d.data.draftdata.fonts) {
     if(!doc.data.is_draft) {
         fprintf(stderr, "Tried to create draft output in non-draft mode.\n");
         std::abort();
     }
+    hyphen.set_cache(&hyphen_cache);
 }
 
 void DraftPaginator::generate_pdf(const char *outfile) {
@@ -173,6 +114,7 @@ void DraftPaginator::generate_pdf(const char *outfile) {
         new_page(false);
     }
     create_maintext();
+    hyphen_cache.save();
 
     while(!layout.empty()) {
         render_page_num(styles.normal);
@@ -188,11 +130,14 @@ void DraftPaginator::create_maintext() {
     bool first_paragraph = true;
     bool first_section = true;
 
-    for(const auto &e : doc.elements) {
+    const auto paragraph_words =
+        enrich_paragraphs(doc, &hyphen_cache, worker_thread_count(doc.data.pdf.threads));
+    for(size_t element_id = 0; element_id < doc.elements.size(); ++element_id) {
+        const auto &e = doc.elements[element_id];
         if(std::holds_alternative<Section>(e)) {
             create_section(std::get<Section>(e), rel_y, first_section, first_paragraph);
         } else if(std::holds_alternative<Paragraph>(e)) {
-            create_paragraph(std::get<Paragraph>(e),
+            create_paragraph(paragraph_words[element_id],
                              rel_y,
                              bottom_watermark,
                              first_paragraph ? styles.normal_noindent : styles.normal,
@@ -240,9 +185,11 @@ void DraftPaginator::create_maintext() {
             heights.whitespace_height += spaces.different_paragraphs;
             first_paragraph = true;
             for(const auto &partext : l.paragraphs) {
-                Paragraph p{partext};
-                create_paragraph(
-                    p, rel_y, bottom_watermark, styles.letter, doc.data.pdf.spaces.letter_indent);
+                create_paragraph(text_to_formatted_words(partext),
+                                 rel_y,
+                                 bottom_watermark,
+                                 styles.letter,
+                                 doc.data.pdf.spaces.letter_indent);
                 first_paragraph = false;
             }
             rel_y -= spaces.different_paragraphs;
@@ -297,8 +244,7 @@ void DraftPaginator::create_maintext() {
                     rel_y = Length::zero();
                 }
                 if(!line.empty()) {
-                    std::vector<EnrichedWord> processed_words =
-                        text_to_formatted_words(line, false);
+                    WordStore processed_words = text_to_formatted_words(line, false);
                     // FIXME, menu should have its own style.
                     DraftParagraphFormatter b(
                         processed_words, Length::from_mm(100000), styles.normal, fc);
@@ -351,7 +297,7 @@ void DraftPaginator::create_section(const Section &s,
     title_string += s.text;
     section_alignment = TextAlignment::Left;
     // The title. Hyphenation is prohibited.
-    std::vector<EnrichedWord> processed_words = text_to_formatted_words(title_string, false);
+    WordStore processed_words = text_to_formatted_words(title_string, false);
     DraftParagraphFormatter b(processed_words, section_width, styles.section, fc);
     auto lines = b.split_formatted_lines_to_runs();
     auto built_lines =
@@ -366,14 +312,13 @@ void DraftPaginator::create_section(const Section &s,
     first_paragraph = true;
 }
 
-void DraftPaginator::create_paragraph(const Paragraph &p,
+void DraftPaginator::create_paragraph(const WordStore &words,
                                       Length &rel_y,
                                       const Length &bottom_watermark,
                                       const HBChapterParameters &chpar,
                                       Length extra_indent) {
     const auto paragraph_width = textblock_width() - 2 * extra_indent;
-    std::vector<EnrichedWord> processed_words = text_to_formatted_words(p.text);
-    DraftParagraphFormatter b(processed_words, paragraph_width, chpar, fc);
+    DraftParagraphFormatter b(words, paragraph_width, chpar, fc);
     auto lines = b.split_formatted_lines_to_runs();
     std::vector<HBTextCommands> built_lines;
     built_lines =
@@ -417,7 +362,7 @@ void DraftPaginator::create_paragraph(const Paragraph &p,
 void DraftPaginator::create_footnote(const Footnote &f, const Length &bottom_watermark) {
     const auto paragraph_width = page.w - m.inner - m.outer;
     heights.whitespace_height += spaces.footnote_separation;
-    std::vector<EnrichedWord> processed_words = text_to_formatted_words(f.text);
+    WordStore processed_words = text_to_formatted_words(f.text);
     const Length number_indent = Length::from_pt(16);
     DraftParagraphFormatter b(
         processed_words, paragraph_width - number_indent, styles.footnote, fc);
@@ -456,7 +401,7 @@ void DraftPaginator::create_numberlist(const NumberList &nl, Length &rel_y) {
             rel_y -= item_separator;
             heights.whitespace_height += item_separator;
         }
-        std::vector<EnrichedWord> processed_words = text_to_formatted_words(nl.items[i]);
+        WordStore processed_words = text_to_formatted_words(nl.items[i]);
         DraftParagraphFormatter b(processed_words, text_width, styles.lists, fc);
         auto lines = b.split_formatted_lines_to_runs();
         std::string fnum = std::to_string(i + 1);
@@ -548,24 +493,9 @@ DraftPaginator::build_ragged_paragraph(const std::vector<std::vector<HBRun>> &li
     return line_commands;
 }
 
-std::vector<EnrichedWord> DraftPaginator::text_to_formatted_words(const std::string &text,
-                                                                  bool permit_hyphenation) {
-    StyleStack current_style("dummy", Length::from_pt(10));
-    auto plain_words = split_to_words(std::string_view(text));
-    std::vector<EnrichedWord> processed_words;
-    const Language lang = permit_hyphenation ? doc.data.language : Language::Unset;
-    for(const auto &word : plain_words) {
-        auto working_word = word;
-        auto start_style = current_style;
-        auto formatting_data = extract_styling(current_style, working_word);
-        restore_special_chars(working_word);
-        auto hyphenation_data = hyphen.hyphenate(working_word, lang);
-        processed_words.emplace_back(EnrichedWord{std::move(working_word),
-                                                  std::move(hyphenation_data),
-                                                  std::move(formatting_data),
-                                                  start_style});
-    }
-    return processed_words;
+WordStore DraftPaginator::text_to_formatted_words(const std::string &text,
+                                                  bool permit_hyphenation) {
+    return enrich_text(text, hyphen, permit_hyphenation ? doc.data.language : Language::Unset);
 }
 
 void DraftPaginator::new_page(bool draw_page_num) {
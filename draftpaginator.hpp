@@ -21,6 +21,8 @@
 #include <bookparser.hpp>
 #include <capypdfrenderer.hpp>
 #include <formatting.hpp>
+#include <hyphenationcache.hpp>
+#include <wordenricher.hpp>
 #include <hbfontcache.hpp>
 #include <draftparagraphformatter.hpp>
 #include <capypdf.hpp>
@@ -81,8 +83,6 @@ struct Heights {
     }
 };
 
-std::vector<FormattingChange> extract_styling(StyleStack &current_style, std::string &word);
-
 class DraftPaginator {
 public:
     explicit DraftPaginator(const Document &d);
@@ -103,8 +103,7 @@ private:
                                                        const TextAlignment alignment,
                                                        Length extra_x,
                                                        Length rel_y);
-    std::vector<EnrichedWord> text_to_formatted_words(const std::string &text,
-                                                      bool permit_hyphenation = true);
+    WordStore text_to_formatted_words(const std::string &text, bool permit_hyphenation = true);
 
     Length current_left_margin() const { return current_page % 2 ? m.inner : m.outer; }
 
@@ -123,7 +122,7 @@ private:
 
     void
     create_section(const Section &s, Length &rel_y, bool &first_section, bool &first_paragraph);
-    void create_paragraph(const Paragraph &p,
+    void create_paragraph(const WordStore &words,
                           Length &rel_y,
                           const Length &bottom_watermark,
                           const HBChapterParameters &chpar,
@@ -140,6 +139,7 @@ private:
     const Spaces &spaces;
     const Margins &m;
     std::unique_ptr<CapyPdfRenderer> rend;
+    HyphenationCache hyphen_cache;
     WordHyphenator hyphen;
     int current_page = 1;
     int chapter_start_page = -1;
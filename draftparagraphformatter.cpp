@@ -24,60 +24,6 @@
 
 namespace {
 
-void toggle_format(StyleStack &current_style, std::string &line, const char format_to_toggle) {
-    if(current_style.contains(format_to_toggle)) {
-        current_style.pop(format_to_toggle);
-        switch(format_to_toggle) {
-        case ITALIC_S:
-            line.append("</i>");
-            break;
-        case BOLD_S:
-            line.append("</b>");
-            break;
-        case TT_S:
-            line.append(current_style.inline_code_end_tag());
-            break;
-        case SMALLCAPS_S:
-            line.append("</span>");
-            break;
-        case SUPERSCRIPT_S:
-            line.append("</sup>");
-            break;
-        case SUBSCRIPT_S:
-            line.append("</sub>");
-            break;
-        default:
-            printf("Bad style end bit.\n");
-            std::abort();
-        }
-    } else {
-        current_style.push(format_to_toggle);
-        switch(format_to_toggle) {
-        case ITALIC_S:
-            line.append("<i>");
-            break;
-        case BOLD_S:
-            line.append("<b>");
-            break;
-        case TT_S:
-            line.append(current_style.inline_code_start_tag());
-            break;
-        case SMALLCAPS_S:
-            line.append("<span variant=\"small-caps\" letter_spacing=\"100\">");
-            break;
-        case SUPERSCRIPT_S:
-            line.append("<sup>");
-            break;
-        case SUBSCRIPT_S:
-            line.append("<sub>");
-            break;
-        default:
-            printf("Bad style start bit.\n");
-            std::abort();
-        }
-    }
-}
-
 void toggle_format(StyleStack &current_style, const char format_to_toggle) {
     if(current_style.contains(format_to_toggle)) {
         current_style.pop(format_to_toggle);
@@ -178,7 +124,7 @@ std::vector<HBRun> wordfragment2runs(const HBTextParameters &original_par,
 
 } // namespace
 
-DraftParagraphFormatter::DraftParagraphFormatter(const std::vector<EnrichedWord> &words_,
+DraftParagraphFormatter::DraftParagraphFormatter(const WordStore &words_,
                                                  const Length target_width,
                                                  const HBChapterParameters &in_params,
                                                  HBFontCache &hbfc)
@@ -187,29 +133,20 @@ DraftParagraphFormatter::DraftParagraphFormatter(const std::vector<EnrichedWord>
 std::vector<std::vector<HBRun>> DraftParagraphFormatter::split_formatted_lines_to_runs() {
     HBMeasurer shaper(fc, "fi");
     precompute();
-    return stats_to_line_runs(simple_split(shaper));
+    auto lines = stats_to_line_runs(simple_split(shaper));
+    for(auto &line : lines) {
+        for(auto &run : line) {
+            shaper.shape(run);
+        }
+    }
+    return lines;
 }
 
 void DraftParagraphFormatter::precompute() {
-    split_points.clear();
-    split_points.reserve(words.size() * 3);
-    for(size_t word_index = 0; word_index < words.size(); ++word_index) {
-        split_points.emplace_back(BetweenWordSplit{word_index});
-        for(size_t hyphen_index = 0; hyphen_index < words[word_index].hyphen_points.size();
-            ++hyphen_index) {
-            split_points.emplace_back(WithinWordSplit{word_index, hyphen_index});
-        }
-    }
-    split_points.emplace_back(BetweenWordSplit{words.size()}); // The end sentinel
+    split_points.build(words);
     // printf("The text has a total of %d words and %d split points.\n\n",
     //        (int)words.size(),
     //        (int)split_points.size());
-    split_locations.clear();
-    split_locations.reserve(split_points.size());
-    for(const auto &i : split_points) {
-        split_locations.emplace_back(point_to_location(i));
-    }
-    assert(split_points.size() == split_locations.size());
 }
 
 std::vector<LineStats> DraftParagraphFormatter::simple_split(HBMeasurer &shaper) {
@@ -245,29 +182,7 @@ Length DraftParagraphFormatter::current_line_width(size_t line_num) const {
 
 WordsOnLine DraftParagraphFormatter::words_for_splits(size_t from_split_ind,
                                                       size_t to_split_ind) const {
-    WordsOnLine w;
-    const auto &from_split = split_points[from_split_ind];
-    const auto &to_split = split_points[to_split_ind];
-    const auto &from_loc = split_locations[from_split_ind];
-    const auto &to_loc = split_locations[to_split_ind];
-
-    if(std::holds_alternative<WithinWordSplit>(from_split)) {
-        w.first = WordStart{from_loc.word_index, from_loc.offset + 1};
-        w.full_word_begin = from_loc.word_index + 1;
-    } else {
-        w.full_word_begin = from_loc.word_index;
-    }
-
-    w.full_word_end = to_loc.word_index;
-    if(std::holds_alternative<WithinWordSplit>(to_split)) {
-        const auto &fs = std::get<WithinWordSplit>(to_split);
-
-        w.last =
-            WordEnd{fs.word_index,
-                    to_loc.offset + 1,
-                    words[fs.word_index].hyphen_points[fs.hyphen_index].type == SplitType::Regular};
-    }
-    return w;
+    return split_points.words_for_splits(from_split_ind, to_split_ind);
 }
 
 std::string DraftParagraphFormatter::build_line_text_debug(size_t from_split_ind,
@@ -308,9 +223,7 @@ std::vector<HBRun> DraftParagraphFormatter::build_line_words_runs(size_t from_sp
     }
 
     const WordsOnLine line_words = words_for_splits(from_split_ind, to_split_ind);
-    const auto &from_loc = split_locations[from_split_ind];
-
-    StyleStack current_style = determine_style(from_loc);
+    StyleStack current_style = split_points.style[from_split_ind];
 
     if(line_words.first) {
         auto new_runs = wordfragment2runs(params.font,
@@ -347,34 +260,6 @@ std::vector<HBRun> DraftParagraphFormatter::build_line_words_runs(size_t from_sp
     return runs;
 }
 
-StyleStack DraftParagraphFormatter::determine_style(TextLocation t) const {
-    const auto &current_word = words[t.word_index];
-    StyleStack style = words[t.word_index].start_style;
-    size_t i = 0;
-    size_t style_point = 0;
-    std::string dummy;
-    while(i < t.offset) {
-        while(style_point < current_word.f.size() && current_word.f[style_point].offset == i) {
-            toggle_format(style, dummy, current_word.f[style_point].format);
-            ++style_point;
-        }
-        ++i;
-    }
-    return style;
-}
-
-TextLocation DraftParagraphFormatter::point_to_location(const SplitPoint &p) const {
-    if(std::holds_alternative<BetweenWordSplit>(p)) {
-        const auto &r = std::get<BetweenWordSplit>(p);
-        return TextLocation{r.word_index, 0};
-    } else if(std::holds_alternative<WithinWordSplit>(p)) {
-        const auto &r = std::get<WithinWordSplit>(p);
-        return TextLocation{r.word_index, words[r.word_index].hyphen_points[r.hyphen_index].loc};
-    } else {
-        assert(false);
-    }
-}
-
 LineStats DraftParagraphFormatter::get_closest_line_end(size_t start_split,
                                                         const HBMeasurer &shaper,
                                                         size_t line_num) const {
@@ -387,28 +272,21 @@ LineStats DraftParagraphFormatter::compute_closest_line_end(size_t start_split,
                                                             size_t line_num) const {
     assert(start_split < split_points.size() - 1);
     const Length target_line_width_mm = current_line_width(line_num);
-    size_t chosen_point = -1;
-    auto ppoint = std::partition_point(
-        split_points.begin() + start_split + 2,
-        split_points.end(),
-        [this, &shaper, start_split, target_line_width_mm](const SplitPoint &p) {
-            const auto loc = &p - split_points.data();
-            const auto trial_runs = build_line_words_runs(start_split, loc);
+    size_t chosen_point = split_points.first_not_fitting(
+        start_split + 2, [this, &shaper, start_split, target_line_width_mm](size_t end_split) {
+            const auto trial_runs = build_line_words_runs(start_split, end_split);
             const auto trial_width = shaper.text_width(trial_runs);
             return trial_width <= target_line_width_mm;
         });
-    if(ppoint == split_points.end()) {
+    if(chosen_point == split_points.size()) {
         chosen_point = split_points.size() - 1;
     } else {
-        --ppoint; // We want the last point that satisfies the constraint rather than the first
-                  // which does not.
-        chosen_point = size_t(&(*ppoint) - split_points.data());
+        --chosen_point; // We want the last point that satisfies the constraint rather than the
+                        // first which does not.
     }
 
     const auto final_line = build_line_words_runs(start_split, chosen_point);
     const auto final_width = shaper.text_width(final_line);
     // FIXME, check whether the word ends in a dash.
-    return LineStats{chosen_point,
-                     final_width,
-                     std::holds_alternative<WithinWordSplit>(split_points[chosen_point])};
+    return LineStats{chosen_point, final_width, split_points.within_word(chosen_point)};
 }
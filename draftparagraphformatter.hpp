@@ -27,7 +27,7 @@ class HBFontCache;
 
 class DraftParagraphFormatter {
 public:
-    DraftParagraphFormatter(const std::vector<EnrichedWord> &words,
+    DraftParagraphFormatter(const WordStore &words,
                             const Length target_width,
                             const HBChapterParameters &in_params,
                             HBFontCache &hbfc);
@@ -36,7 +36,6 @@ public:
 
 private:
     void precompute();
-    TextLocation point_to_location(const SplitPoint &p) const;
     LineStats
     get_closest_line_end(size_t start_split, const HBMeasurer &shaper, size_t line_num) const;
     LineStats
@@ -53,11 +52,8 @@ private:
     std::vector<HBRun> build_line_words_runs(size_t from_split_ind, size_t to_split_ind) const;
 
     Length paragraph_width;
-    std::vector<EnrichedWord> words;
-    std::vector<SplitPoint> split_points;
-    std::vector<TextLocation> split_locations;
-
-    StyleStack determine_style(TextLocation t) const;
+    WordStore words;
+    SplitPointTable split_points;
 
     // Cached results of best states we have achieved thus far.
     SplitStates state_cache;
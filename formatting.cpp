@@ -15,3 +15,35 @@
  */
 
 #include "formatting.hpp"
+
+void WordStore::reserve(size_t num_words, size_t text_bytes) {
+    text.reserve(text_bytes);
+    start_styles.reserve(num_words);
+    text_start.reserve(num_words + 1);
+    hyphen_start.reserve(num_words + 1);
+    formatting_start.reserve(num_words + 1);
+}
+
+void WordStore::add_word(std::string_view word_text,
+                         std::span<const HyphenPoint> word_hyphen_points,
+                         std::span<const FormattingChange> word_formatting,
+                         const StyleStack &start_style) {
+    text.append(word_text);
+    hyphen_points.insert(hyphen_points.end(), word_hyphen_points.begin(), word_hyphen_points.end());
+    formatting.insert(formatting.end(), word_formatting.begin(), word_formatting.end());
+    start_styles.push_back(start_style);
+    text_start.push_back(text.size());
+    hyphen_start.push_back(hyphen_points.size());
+    formatting_start.push_back(formatting.size());
+}
+
+void WordStore::set_hyphen_points(const std::vector<std::vector<HyphenPoint>> &points) {
+    assert(points.size() == size());
+    hyphen_points.clear();
+    hyphen_start.clear();
+    hyphen_start.push_back(0);
+    for(const auto &word_points : points) {
+        hyphen_points.insert(hyphen_points.end(), word_points.begin(), word_points.end());
+        hyphen_start.push_back(hyphen_points.size());
+    }
+}
@@ -22,6 +22,9 @@
 #include <cstdint>
 #include <cstdlib>
 #include <cassert>
+#include <span>
+#include <string_view>
+#include <type_traits>
 
 const char ITALIC_S = 1;
 const char BOLD_S = (1 << 1);
@@ -57,27 +60,6 @@ public:
     // FIXME, convert to an actual class once Pango goes away.
     friend class HBStyleApplier;
 
-    SmallStack() {
-        tt_start_tag = "<tt>";
-        tt_end_tag = "</tt>";
-    }
-
-    explicit SmallStack(const std::string inline_typewriter_font_name, const Length ptsize) {
-        const int buf_size = 1024;
-        char buf[buf_size];
-
-        if(inline_typewriter_font_name.find('"') != std::string::npos) {
-            std::abort();
-        }
-        snprintf(buf,
-                 buf_size,
-                 R"(<span font="%s" size="%.2fpt">)",
-                 inline_typewriter_font_name.c_str(),
-                 ptsize.pt());
-        tt_start_tag = buf;
-        tt_end_tag = "</span>";
-    }
-
     bool empty() const { return size == 0; }
 
     bool contains(T val) const {
@@ -132,18 +114,15 @@ public:
     const T *crbegin() const { return arr + size - 1; } // FIXME, need to use -- to progress.
     const T *crend() const { return arr - 1; }
 
-    const std::string &inline_code_start_tag() const { return tt_start_tag; }
-    const std::string &inline_code_end_tag() const { return tt_end_tag; }
-
 private:
     T arr[max_elements];
-    std::string tt_start_tag;
-    std::string tt_end_tag;
     int size = 0;
 };
 
 typedef SmallStack<char, 6> StyleStack;
 
+static_assert(std::is_trivially_copyable_v<StyleStack>);
+
 class HBStyleApplier {
 public:
     HBStyleApplier(const StyleStack &stack_) : stack{stack_} {}
@@ -186,9 +165,55 @@ struct FormattingChange {
     char format;
 };
 
+// One word of a WordStore.
 struct EnrichedWord {
+    std::string_view text;
+    std::span<const HyphenPoint> hyphen_points;
+    std::span<const FormattingChange> f;
+    StyleStack start_style;
+};
+
+// The words of a paragraph. The text, hyphen points and formatting changes
+// of all words are kept in shared buffers, so a paragraph only needs a few
+// allocations no matter how many words it has.
+class WordStore {
+public:
+    void add_word(std::string_view word_text,
+                  std::span<const HyphenPoint> word_hyphen_points,
+                  std::span<const FormattingChange> word_formatting,
+                  const StyleStack &start_style);
+
+    void reserve(size_t num_words, size_t text_bytes);
+
+    // Replaces the hyphen points of every word. Indexed by word.
+    void set_hyphen_points(const std::vector<std::vector<HyphenPoint>> &points);
+
+    // Words that are stored without hyphen points have them computed by the
+    // line breaker for this language, but only if they may end a line.
+    Language pending_hyphenation() const { return pending_language; }
+    void set_pending_hyphenation(Language lang) { pending_language = lang; }
+
+    size_t size() const { return start_styles.size(); }
+    bool empty() const { return start_styles.empty(); }
+
+    EnrichedWord operator[](size_t i) const {
+        return EnrichedWord{
+            std::string_view{text}.substr(text_start[i], text_start[i + 1] - text_start[i]),
+            std::span<const HyphenPoint>{hyphen_points}.subspan(
+                hyphen_start[i], hyphen_start[i + 1] - hyphen_start[i]),
+            std::span<const FormattingChange>{formatting}.subspan(
+                formatting_start[i], formatting_start[i + 1] - formatting_start[i]),
+            start_styles[i]};
+    }
+
+private:
     std::string text;
     std::vector<HyphenPoint> hyphen_points;
-    std::vector<FormattingChange> f;
-    StyleStack start_style;
+    std::vector<FormattingChange> formatting;
+    std::vector<StyleStack> start_styles;
+    // Where the data of each word begins, plus the total.
+    std::vector<uint32_t> text_start{0};
+    std::vector<uint32_t> hyphen_start{0};
+    std::vector<uint32_t> formatting_start{0};
+    Language pending_language = Language::Unset;
 };
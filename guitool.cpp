@@ -377,12 +377,10 @@ void run_optimization_cb(GtkButton *, gpointer data) {
     ExtraPenaltyAmounts extras = get_penalties(app);
     auto words = get_entry_widget_text_words(app);
     auto hyphenated_words = hyp.hyphenate(words, lang);
-    std::vector<EnrichedWord> rich_words;
-    rich_words.reserve(hyphenated_words.size());
+    WordStore rich_words;
     StyleStack empty_style;
     for(size_t i = 0; i < words.size(); ++i) {
-        rich_words.emplace_back(
-            EnrichedWord{std::move(words[i]), std::move(hyphenated_words[i]), {}, empty_style});
+        rich_words.add_word(words[i], hyphenated_words[i], {}, empty_style);
     }
     ParagraphFormatter builder{rich_words, paragraph_width, params, extras, fc};
     auto new_lines = builder.split_formatted_lines();
@@ -2,10 +2,33 @@
 // Copyright 2025 Jussi Pakkanen
 
 #include "hbfontcache.hpp"
+#include <utils.hpp>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#include <mutex>
+
+void append_shaping_options(const HBFontProperties &par, std::vector<hb_feature_t> &out) {
+    if(par.extra == TextExtra::SmallCaps) {
+        hb_feature_t userfeature;
+        userfeature.tag = HB_TAG('s', 'm', 'c', 'p');
+        userfeature.value = 1;
+        userfeature.start = HB_FEATURE_GLOBAL_START;
+        userfeature.end = HB_FEATURE_GLOBAL_END;
+        out.push_back(std::move(userfeature));
+    }
+    // FIXME, a hack, but works well enough.
+    if(par.cat == TextCategory::Serif) {
+        hb_feature_t userfeature;
+        userfeature.tag = HB_TAG('o', 'n', 'u', 'm');
+        userfeature.value = 1;
+        userfeature.start = HB_FEATURE_GLOBAL_START;
+        userfeature.end = HB_FEATURE_GLOBAL_END;
+        out.push_back(std::move(userfeature));
+    }
+}
+
 HBFontCache::HBFontCache() { load_default_fonts(); }
 
 HBFontCache::HBFontCache(const FontFiles &serif_files,
@@ -69,6 +92,10 @@ FontOwner HBFontCache::open_file(const std::filesystem::path &fontfile) {
     if(!blob) {
         throw std::runtime_error("HB file open failed.");
     }
+    unsigned int blob_size;
+    const char *blob_data = hb_blob_get_data(blob, &blob_size);
+    StableHasher hasher;
+    hasher.add(blob_data, blob_size);
     hb_face_t *face = hb_face_create(blob, 0);
     hb_blob_destroy(blob);
     if(!face) {
@@ -79,9 +106,11 @@ FontOwner HBFontCache::open_file(const std::filesystem::path &fontfile) {
     if(!font) {
         throw std::runtime_error("HB font creation failed.\n");
     }
-    // hb_font_set_scale(font, hbscale, hbscale);
+    // Fonts are shared between threads and never scaled. Shaping results
+    // are in font units and get converted to the point size afterwards.
+    hb_font_make_immutable(font);
     std::unique_ptr<hb_font_t, HBFontCloser> h{font};
-    FontOwner result{std::move(h), fontfile, get_em_units(fontfile)};
+    FontOwner result{std::move(h), fontfile, get_em_units(fontfile), hasher.value()};
 
     return result;
 }
@@ -162,3 +191,95 @@ std::optional<FontInfo> HBFontCache::get_font(TextCategory cat, TextStyle style)
     }
     return result;
 }
+
+uint64_t HBFontCache::font_digest() const {
+    StableHasher hasher;
+    for(const FontPtrs *p : {&serif, &sansserif, &monospace}) {
+        for(const FontOwner *o : {&p->regular, &p->italic, &p->bold, &p->bolditalic}) {
+            hasher.add(o->handle ? o->digest : uint64_t(0));
+        }
+    }
+    return hasher.value();
+}
+
+const ShapePlan &HBFontCache::get_shape_plan(const HBFontProperties &par,
+                                             hb_language_t language) const {
+    const ShapePlanKey key{par, language};
+    {
+        std::shared_lock l(plan_lock);
+        auto it = shape_plans.find(key);
+        if(it != shape_plans.end()) {
+            return it->second;
+        }
+    }
+    auto font_o = get_font(par);
+    if(!font_o) {
+        printf("Requested font does not exist.\n");
+        std::abort();
+    }
+    std::unique_lock l(plan_lock);
+    auto &entry = shape_plans[key];
+    if(!entry.plan) {
+        hb_segment_properties_t props = HB_SEGMENT_PROPERTIES_DEFAULT;
+        props.direction = HB_DIRECTION_LTR;
+        props.script = HB_SCRIPT_LATIN;
+        props.language = language;
+        append_shaping_options(par, entry.features);
+        entry.language = language;
+        // Plans only depend on the face so all sizes can share them.
+        entry.plan.reset(hb_shape_plan_create_cached(hb_font_get_face(font_o->f),
+                                                     &props,
+                                                     entry.features.data(),
+                                                     entry.features.size(),
+                                                     nullptr));
+    }
+    return entry;
+}
+
+const AdvanceTable &HBFontCache::get_advance_table(const HBFontProperties &par,
+                                                   hb_language_t language) const {
+    const ShapePlanKey key{par, language};
+    {
+        std::shared_lock l(table_lock);
+        auto it = advance_tables.find(key);
+        if(it != advance_tables.end()) {
+            return *it->second;
+        }
+    }
+    const auto &plan = get_shape_plan(par, language);
+    auto font_o = get_font(par);
+    std::unique_lock l(table_lock);
+    auto &table = advance_tables[key];
+    if(!table) {
+        auto *buf = acquire_buffer();
+        table = std::make_unique<AdvanceTable>(font_o->f, plan, buf);
+        release_buffer(buf);
+    }
+    return *table;
+}
+
+hb_buffer_t *HBFontCache::acquire_buffer() const {
+    {
+        std::lock_guard l(buffer_lock);
+        if(!free_buffers.empty()) {
+            auto *buf = free_buffers.back().release();
+            free_buffers.pop_back();
+            return buf;
+        }
+    }
+    auto *buf = hb_buffer_create();
+    if(!hb_buffer_allocation_successful(buf)) {
+        printf("Could not create HarfBuzz buffer.\n");
+        std::abort();
+    }
+    return buf;
+}
+
+void HBFontCache::release_buffer(hb_buffer_t *buf) const {
+    std::unique_ptr<hb_buffer_t, HBBufferCloser> owned{buf};
+    hb_buffer_reset(buf);
+    std::lock_guard l(buffer_lock);
+    if(free_buffers.size() < MAX_POOLED_BUFFERS) {
+        free_buffers.emplace_back(std::move(owned));
+    }
+}
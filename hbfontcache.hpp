@@ -3,13 +3,19 @@
 
 #pragma once
 
+#include <advancetable.hpp>
 #include <chaptercommon.hpp>
 #include <metadata.hpp>
 #include <units.hpp>
+#include <widthcache.hpp>
 #include <hb.h>
 
 #include <filesystem>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
 
 struct HBFontCloser {
     void operator()(hb_font_t *f) const noexcept { hb_font_destroy(f); }
@@ -19,10 +25,17 @@ struct HBBufferCloser {
     void operator()(hb_buffer_t *b) const noexcept { hb_buffer_destroy(b); }
 };
 
+struct HBShapePlanCloser {
+    void operator()(hb_shape_plan_t *p) const noexcept { hb_shape_plan_destroy(p); }
+};
+
+void append_shaping_options(const HBFontProperties &par, std::vector<hb_feature_t> &out);
+
 struct FontOwner {
     std::unique_ptr<hb_font_t, HBFontCloser> handle;
     std::filesystem::path file;
     uint32_t units_per_em;
+    uint64_t digest; // Of the file contents.
 };
 
 struct FontPtrs {
@@ -44,6 +57,30 @@ struct FontInfo {
     uint32_t units_per_em;
 };
 
+// Everything apart from the text and point size that affects shaping.
+struct ShapePlanKey {
+    HBFontProperties par;
+    hb_language_t language;
+
+    bool operator==(const ShapePlanKey &o) const noexcept = default;
+};
+
+template<> struct std::hash<ShapePlanKey> {
+    std::size_t operator()(ShapePlanKey const &k) const noexcept {
+        const size_t shuffle = 13;
+        size_t hashvalue = std::hash<HBFontProperties>{}(k.par);
+        hashvalue = hashvalue * shuffle + std::hash<const void *>{}(k.language);
+        return hashvalue;
+    }
+};
+
+// The features must be passed to hb_shape_plan_execute as well.
+struct ShapePlan {
+    std::unique_ptr<hb_shape_plan_t, HBShapePlanCloser> plan;
+    std::vector<hb_feature_t> features;
+    hb_language_t language;
+};
+
 class HBFontCache {
 public:
     HBFontCache();
@@ -56,7 +93,27 @@ public:
         return get_font(par.cat, par.style);
     }
 
+    // Changes whenever any of the font files change.
+    uint64_t font_digest() const;
+
+    // Shared by everything that measures text with these fonts.
+    WidthCache &widths() const { return width_cache; }
+
+    // Plans are for LTR Latin text. The returned reference stays valid for
+    // the lifetime of the cache.
+    const ShapePlan &get_shape_plan(const HBFontProperties &par, hb_language_t language) const;
+
+    // Advances of the unscaled font shaped with the matching shape plan.
+    const AdvanceTable &get_advance_table(const HBFontProperties &par,
+                                          hb_language_t language) const;
+
+    // Buffers are handed out empty and must be given back with release_buffer.
+    hb_buffer_t *acquire_buffer() const;
+    void release_buffer(hb_buffer_t *buf) const;
+
     static constexpr double NUM_STEPS = 64;
+    static constexpr size_t WIDTH_CACHE_SIZE = 1 << 18;
+    static constexpr size_t MAX_POOLED_BUFFERS = 64;
 
 private:
     void open_files_relative(FontPtrs &ptrs,
@@ -74,4 +131,15 @@ private:
     FontPtrs serif;
     FontPtrs sansserif;
     FontPtrs monospace;
+
+    mutable WidthCache width_cache{WIDTH_CACHE_SIZE};
+
+    mutable std::shared_mutex plan_lock;
+    mutable std::unordered_map<ShapePlanKey, ShapePlan> shape_plans;
+
+    mutable std::shared_mutex table_lock;
+    mutable std::unordered_map<ShapePlanKey, std::unique_ptr<AdvanceTable>> advance_tables;
+
+    mutable std::mutex buffer_lock;
+    mutable std::vector<std::unique_ptr<hb_buffer_t, HBBufferCloser>> free_buffers;
 };
@@ -49,45 +49,32 @@ const std::unordered_map<uint32_t, double> overhang_right{
 
 }
 
-void append_shaping_options(const HBTextParameters &par, std::vector<hb_feature_t> &out) {
-    if(par.par.extra == TextExtra::SmallCaps) {
-        hb_feature_t userfeature;
-        userfeature.tag = HB_TAG('s', 'm', 'c', 'p');
-        userfeature.value = 1;
-        userfeature.start = HB_FEATURE_GLOBAL_START;
-        userfeature.end = HB_FEATURE_GLOBAL_END;
-        out.push_back(std::move(userfeature));
-    }
-    // FIXME, a hack, but works well enough.
-    if(par.par.cat == TextCategory::Serif) {
-        hb_feature_t userfeature;
-        userfeature.tag = HB_TAG('o', 'n', 'u', 'm');
-        userfeature.value = 1;
-        userfeature.start = HB_FEATURE_GLOBAL_START;
-        userfeature.end = HB_FEATURE_GLOBAL_END;
-        out.push_back(std::move(userfeature));
-    }
-}
-
-HBMeasurer::HBMeasurer(const HBFontCache &cache, const char *language) : fc{cache} {
-    buf = hb_buffer_create();
-    assert(buf);
-    hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
-    hb_buffer_set_script(buf, HB_SCRIPT_LATIN);
-    hb_buffer_set_language(buf, hb_language_from_string(language, -1));
+HBMeasurer::HBMeasurer(const HBFontCache &cache, const char *language_)
+    : fc{cache}, language{hb_language_from_string(language_, -1)} {
+    buf = fc.acquire_buffer();
 }
 
-HBMeasurer::~HBMeasurer() { hb_buffer_destroy(buf); }
+HBMeasurer::~HBMeasurer() { fc.release_buffer(buf); }
 
-Length HBMeasurer::text_width(const char *utf8_text, const HBTextParameters &text_par) const {
-    HBStyledPlainText k{utf8_text, text_par};
-    auto f = plaintext_widths.find(k);
-    if(f != plaintext_widths.end()) {
-        return f->second;
+Length HBMeasurer::text_width(std::string_view utf8_text, const HBTextParameters &text_par) const {
+    auto font_o = fc.get_font(text_par.par);
+    if(!font_o) {
+        printf("Requested font does not exist.\n");
+        std::abort();
     }
-    Length total_size = compute_width(utf8_text, text_par);
-    plaintext_widths[k] = total_size;
-    return total_size;
+    auto &font = font_o.value();
+    const auto &table = fc.get_advance_table(text_par.par, language);
+    if(auto units = table.width(utf8_text, buf)) {
+        return double(*units) / font.units_per_em * text_par.size;
+    }
+    const WidthKey key{utf8_text, text_par.par, language};
+    auto &cache = fc.widths();
+    auto width = cache.lookup(key);
+    if(!width) {
+        width = compute_width(utf8_text, text_par, font.f);
+        cache.insert(key, *width);
+    }
+    return *width / font.units_per_em * text_par.size;
 }
 
 Length HBMeasurer::text_width(const HBLine &line) const {
@@ -101,7 +88,7 @@ Length HBMeasurer::text_width(const HBLine &line) const {
 Length HBMeasurer::text_width(const HBWord &word) const {
     Length total_size;
     for(const auto &r : word.runs) {
-        total_size += compute_width(r.text.c_str(), r.par);
+        total_size += text_width(r);
     }
     return total_size;
 }
@@ -109,30 +96,81 @@ Length HBMeasurer::text_width(const HBWord &word) const {
 Length HBMeasurer::text_width(const std::vector<HBRun> &runs) const {
     Length total_size;
     for(const auto &r : runs) {
-        total_size += compute_width(r.text.c_str(), r.par);
+        total_size += text_width(r);
     }
     return total_size;
 }
 
-Length HBMeasurer::compute_width(const char *utf8_text, const HBTextParameters &text_par) const {
-    const double num_steps = 64;
-    const double hbscale = text_par.size.pt() * num_steps;
+Length HBMeasurer::text_width(const HBRun &run) const {
+    if(run.glyphs.empty()) {
+        return text_width(run.text, run.par);
+    }
+    auto font_o = fc.get_font(run.par.par);
+    if(!font_o) {
+        printf("Requested font does not exist.\n");
+        std::abort();
+    }
     double total_width = 0;
-    hb_buffer_clear_contents(buf);
-    hb_buffer_add_utf8(buf, utf8_text, -1, 0, -1);
-    hb_buffer_guess_segment_properties(buf);
+    for(const auto &g : run.glyphs) {
+        total_width += g.x_advance;
+    }
+    return total_width / font_o->units_per_em * run.par.size;
+}
 
-    auto font_o = fc.get_font(text_par.par.cat, text_par.par.style);
+void HBMeasurer::shape(HBRun &run) const {
+    run.glyphs.clear();
+    if(run.text.empty()) {
+        return;
+    }
+    auto font_o = fc.get_font(run.par.par);
     if(!font_o) {
         printf("Requested font does not exist.\n");
         std::abort();
     }
-    auto &font = font_o.value();
-    hb_font_set_scale(font.f, hbscale, hbscale);
+    auto *font = font_o->f;
+    shape_to_buffer(run.text, run.par, font);
+    unsigned int glyph_count;
+    hb_glyph_info_t *glyph_info = hb_buffer_get_glyph_infos(buf, &glyph_count);
+    hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
+    run.glyphs.reserve(glyph_count);
+    for(unsigned int i = 0; i < glyph_count; i++) {
+        const auto glyph_id = glyph_info[i].codepoint;
+        run.glyphs.emplace_back(ShapedGlyph{glyph_id,
+                                            glyph_info[i].cluster,
+                                            glyph_pos[i].x_advance,
+                                            hb_font_get_glyph_h_advance(font, glyph_id)});
+    }
+}
+
+void HBMeasurer::shape(HBLine &line) const {
+    for(auto &w : line.words) {
+        for(auto &r : w.runs) {
+            shape(r);
+        }
+    }
+}
+
+// Shapes with the unscaled font so all positions are in font units.
+void HBMeasurer::shape_to_buffer(std::string_view utf8_text,
+                                 const HBTextParameters &text_par,
+                                 hb_font_t *font) const {
+    hb_buffer_clear_contents(buf);
+    hb_buffer_add_utf8(buf, utf8_text.data(), utf8_text.size(), 0, -1);
+    hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
+    hb_buffer_set_script(buf, HB_SCRIPT_LATIN);
+    hb_buffer_set_language(buf, language);
+    hb_buffer_guess_segment_properties(buf);
 
-    std::vector<hb_feature_t> features;
-    append_shaping_options(text_par, features);
-    hb_shape(font.f, buf, features.data(), features.size());
+    const auto &plan = fc.get_shape_plan(text_par.par, language);
+    hb_shape_plan_execute(
+        plan.plan.get(), font, buf, plan.features.data(), plan.features.size());
+}
+
+double HBMeasurer::compute_width(std::string_view utf8_text,
+                                 const HBTextParameters &text_par,
+                                 hb_font_t *font) const {
+    double total_width = 0;
+    shape_to_buffer(utf8_text, text_par, font);
 
     unsigned int glyph_count;
     hb_glyph_info_t *glyph_info = hb_buffer_get_glyph_infos(buf, &glyph_count);
@@ -149,13 +187,11 @@ Length HBMeasurer::compute_width(const char *utf8_text, const HBTextParameters &
     for(unsigned int i = 0; i < glyph_count; i++) {
         // const hb_glyph_info_t *current = glyph_info + i;
         const hb_glyph_position_t *curpos = glyph_pos + i;
-        const auto advance = curpos->x_advance / hbscale;
         // Glyph's plain advance can be obtained with
         // hb_font_get_glyph_h_advance(font, current->codepoint);
-        total_width += advance;
+        total_width += curpos->x_advance;
     }
-    Length total_size = total_width * text_par.size;
-    return total_size;
+    return total_width;
 }
 
 Length HBMeasurer::codepoint_right_overhang(const uint32_t uchar,
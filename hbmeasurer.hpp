@@ -22,22 +22,16 @@
 #include <utils.hpp>
 
 #include <string>
-#include <unordered_map>
+#include <string_view>
 
 // Measures a single "run", that is, a single text sequence with the same font properties.
 
-void append_shaping_options(const HBTextParameters &pars, std::vector<hb_feature_t> &out);
-
 class HBMeasurer {
 public:
     explicit HBMeasurer(const HBFontCache &cache, const char *language);
     ~HBMeasurer();
 
-    Length text_width(const char *utf8_text, const HBTextParameters &font) const;
-
-    Length text_width(const std::string &s, const HBTextParameters &font) const {
-        return text_width(s.c_str(), font);
-    };
+    Length text_width(std::string_view utf8_text, const HBTextParameters &font) const;
 
     Length text_width(const HBLine &line) const;
 
@@ -45,13 +39,24 @@ public:
 
     Length text_width(const HBWord &word) const;
 
+    // Uses the glyphs if the run has been shaped.
+    Length text_width(const HBRun &run) const;
+
+    void shape(HBRun &run) const;
+    void shape(HBLine &line) const;
+
     Length codepoint_right_overhang(const uint32_t uchar, const HBTextParameters &font) const;
 
 private:
-    Length compute_width(const char *utf8_text, const HBTextParameters &text_par) const;
+    void shape_to_buffer(std::string_view utf8_text,
+                         const HBTextParameters &text_par,
+                         hb_font_t *font) const;
+    double compute_width(std::string_view utf8_text,
+                         const HBTextParameters &text_par,
+                         hb_font_t *font) const;
 
     const HBFontCache &fc;
 
-    hb_buffer_t *buf;
-    mutable std::unordered_map<HBStyledPlainText, Length> plaintext_widths;
+    hb_buffer_t *buf; // From the font cache's pool.
+    hb_language_t language;
 };
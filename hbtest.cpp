@@ -5,8 +5,14 @@
 
 #include <cassert>
 
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include <memory>
 #include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
 
 double width_test(HBFontCache &fc,
                   TextCategory cat,
@@ -17,8 +23,6 @@ double width_test(HBFontCache &fc,
     const char *language = "en";
     double total_width = 0;
     hb_buffer_t *buf;
-    const double num_steps = 64;
-    const double hbscale = pointsize * num_steps;
     buf = hb_buffer_create();
     assert(buf);
     std::unique_ptr<hb_buffer_t, HBBufferCloser> bc(buf);
@@ -37,7 +41,6 @@ double width_test(HBFontCache &fc,
         std::abort();
     }
     auto &font = font_o.value();
-    hb_font_set_scale(font.f, hbscale, hbscale);
 
     if(extra == TextExtra::None) {
         hb_shape(font.f, buf, nullptr, 0);
@@ -67,7 +70,7 @@ double width_test(HBFontCache &fc,
     for(unsigned int i = 0; i < glyph_count; i++) {
         // const hb_glyph_info_t *current = glyph_info + i;
         const hb_glyph_position_t *curpos = glyph_pos + i;
-        const auto advance = curpos->x_advance / hbscale;
+        const auto advance = double(curpos->x_advance) / font.units_per_em;
         // Glyph's plain advance can be obtained with
         // hb_font_get_glyph_h_advance(font, current->codepoint);
         total_width += advance;
@@ -76,7 +79,197 @@ double width_test(HBFontCache &fc,
     return total_width * pointsize;
 }
 
-int main(int, char **) {
+namespace {
+
+std::vector<std::string> load_words(int first_arg, int argc, char **argv) {
+    std::vector<std::string> words;
+    for(int i = first_arg; i < argc; ++i) {
+        std::ifstream ifile(argv[i]);
+        if(ifile.fail()) {
+            printf("Could not open %s.\n", argv[i]);
+            std::abort();
+        }
+        std::string word;
+        while(ifile >> word) {
+            words.emplace_back(std::move(word));
+        }
+    }
+    return words;
+}
+
+void fill_buffer(hb_buffer_t *buf, const std::string &word, hb_language_t language) {
+    hb_buffer_add_utf8(buf, word.c_str(), word.size(), 0, -1);
+    hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
+    hb_buffer_set_script(buf, HB_SCRIPT_LATIN);
+    hb_buffer_set_language(buf, language);
+    hb_buffer_guess_segment_properties(buf);
+}
+
+// How the measurer shaped text before plans and buffers were cached.
+void shape_plain(const FontInfo &font,
+                 const HBFontProperties &par,
+                 const std::vector<std::string> &words,
+                 hb_language_t language) {
+    for(const auto &w : words) {
+        std::unique_ptr<hb_buffer_t, HBBufferCloser> buf(hb_buffer_create());
+        fill_buffer(buf.get(), w, language);
+        std::vector<hb_feature_t> features;
+        append_shaping_options(par, features);
+        hb_shape(font.f, buf.get(), features.data(), features.size());
+    }
+}
+
+void shape_with_plan(const HBFontCache &fc,
+                     const FontInfo &font,
+                     const HBFontProperties &par,
+                     const std::vector<std::string> &words,
+                     hb_language_t language) {
+    for(const auto &w : words) {
+        std::unique_ptr<hb_buffer_t, HBBufferCloser> buf(hb_buffer_create());
+        fill_buffer(buf.get(), w, language);
+        const auto &plan = fc.get_shape_plan(par, language);
+        hb_shape_plan_execute(
+            plan.plan.get(), font.f, buf.get(), plan.features.data(), plan.features.size());
+    }
+}
+
+void shape_with_plan_and_buffer(const HBFontCache &fc,
+                                const FontInfo &font,
+                                const HBFontProperties &par,
+                                const std::vector<std::string> &words,
+                                hb_language_t language) {
+    auto *buf = fc.acquire_buffer();
+    for(const auto &w : words) {
+        hb_buffer_clear_contents(buf);
+        fill_buffer(buf, w, language);
+        const auto &plan = fc.get_shape_plan(par, language);
+        hb_shape_plan_execute(
+            plan.plan.get(), font.f, buf, plan.features.data(), plan.features.size());
+    }
+    fc.release_buffer(buf);
+}
+
+template<typename F> double time_rounds(int rounds, F &&f) {
+    const auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i) {
+        f();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Shapes every word of the given files one at a time, which is
+// what the paragraph formatters do.
+int benchmark(int argc, char **argv) {
+    const int rounds = 10;
+    HBFontCache fc;
+    const auto words = load_words(1, argc, argv);
+    const auto language = hb_language_from_string("fi", -1);
+    const HBFontProperties par{};
+    auto font_o = fc.get_font(par);
+    if(!font_o) {
+        printf("Requested font does not exist.\n");
+        std::abort();
+    }
+    const auto &font = font_o.value();
+
+    const auto plain = time_rounds(rounds, [&] { shape_plain(font, par, words, language); });
+    const auto planned =
+        time_rounds(rounds, [&] { shape_with_plan(fc, font, par, words, language); });
+    const auto reused =
+        time_rounds(rounds, [&] { shape_with_plan_and_buffer(fc, font, par, words, language); });
+    const double num_shapes = double(words.size()) * rounds;
+    printf("Shaped %d x %d words.\n", rounds, (int)words.size());
+    printf("hb_shape:               %.3f s, %.0f ns/word\n", plain, 1e9 * plain / num_shapes);
+    printf("Cached plan:            %.3f s, %.0f ns/word\n", planned, 1e9 * planned / num_shapes);
+    printf("Cached plan and buffer: %.3f s, %.0f ns/word\n", reused, 1e9 * reused / num_shapes);
+    return 0;
+}
+
+int32_t shaped_width(const HBFontCache &fc,
+                     const FontInfo &font,
+                     const HBFontProperties &par,
+                     hb_buffer_t *buf,
+                     const std::string &text,
+                     hb_language_t language) {
+    hb_buffer_clear_contents(buf);
+    fill_buffer(buf, text, language);
+    const auto &plan = fc.get_shape_plan(par, language);
+    hb_shape_plan_execute(
+        plan.plan.get(), font.f, buf, plan.features.data(), plan.features.size());
+    unsigned int glyph_count;
+    hb_glyph_position_t *glyph_pos = hb_buffer_get_glyph_positions(buf, &glyph_count);
+    int32_t total_width = 0;
+    for(unsigned int i = 0; i < glyph_count; i++) {
+        total_width += glyph_pos[i].x_advance;
+    }
+    return total_width;
+}
+
+// Checks that every width the advance tables produce is the same
+// as what shaping the whole text gives.
+int validate(int argc, char **argv) {
+    HBFontCache fc;
+    const auto words = load_words(2, argc, argv);
+    const auto language = hb_language_from_string("fi", -1);
+    const HBFontProperties fonts[] = {
+        {TextCategory::Serif, TextStyle::Regular, TextExtra::None},
+        {TextCategory::Serif, TextStyle::Italic, TextExtra::None},
+        {TextCategory::Serif, TextStyle::Bold, TextExtra::None},
+        {TextCategory::Serif, TextStyle::Regular, TextExtra::SmallCaps},
+        {TextCategory::SansSerif, TextStyle::Regular, TextExtra::None},
+        {TextCategory::Monospace, TextStyle::Regular, TextExtra::None},
+    };
+    auto *buf = fc.acquire_buffer();
+    size_t num_failures = 0;
+    for(const auto &par : fonts) {
+        auto font_o = fc.get_font(par);
+        if(!font_o) {
+            continue;
+        }
+        const auto &table = fc.get_advance_table(par, language);
+        size_t num_resolved = 0;
+        size_t num_texts = 0;
+        for(const auto &w : words) {
+            // Words are usually measured with the following space.
+            for(const auto &text : {w, w + " "}) {
+                ++num_texts;
+                const auto table_width = table.width(text, buf);
+                if(!table_width) {
+                    continue;
+                }
+                ++num_resolved;
+                const auto correct = shaped_width(fc, *font_o, par, buf, text, language);
+                if(*table_width != correct) {
+                    ++num_failures;
+                    printf("Mismatch for \"%s\": table %d, shaped %d.\n",
+                           text.c_str(),
+                           (int)*table_width,
+                           (int)correct);
+                }
+            }
+        }
+        printf("Category %d style %d extra %d: %d of %d texts measured from the table.\n",
+               (int)par.cat,
+               (int)par.style,
+               (int)par.extra,
+               (int)num_resolved,
+               (int)num_texts);
+    }
+    fc.release_buffer(buf);
+    printf("%d mismatches.\n", (int)num_failures);
+    return num_failures == 0 ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if(argc > 2 && strcmp(argv[1], "--validate") == 0) {
+        return validate(argc, argv);
+    }
+    if(argc > 1) {
+        return benchmark(argc, argv);
+    }
     HBFontCache fc;
     const char *text = "Hello world!";
     const double ptsize = 10;
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#include <hyphenationcache.hpp>
+#include <utils.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+#include <unistd.h>
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'C', 'H', 'A', 'P', 'H', 'Y', 'P', 'H'};
+
+// Each word is stored as its language, number of hyphen points and length
+// followed by its text and its hyphen points.
+struct WordHeader {
+    uint8_t lang;
+    uint8_t num_points;
+    uint16_t num_bytes;
+};
+
+struct StoredPoint {
+    uint16_t loc;
+    uint8_t type;
+};
+
+const size_t STORED_POINT_SIZE = 3;
+
+bool is_hyphenated_language(uint32_t lang) {
+    return lang == uint32_t(Language::English) || lang == uint32_t(Language::Finnish);
+}
+
+bool fits_in_file(std::string_view word, const std::vector<HyphenPoint> &points) {
+    return word.size() <= UINT16_MAX && points.size() <= UINT8_MAX;
+}
+
+template<typename T> bool read_value(std::string_view &data, T &value, size_t size = sizeof(T)) {
+    if(data.size() < size) {
+        return false;
+    }
+    memcpy(&value, data.data(), size);
+    data.remove_prefix(size);
+    return true;
+}
+
+template<typename T> void write_value(std::string &out, const T &value, size_t size = sizeof(T)) {
+    out.append(reinterpret_cast<const char *>(&value), size);
+}
+
+} // namespace
+
+HyphenationCache::HyphenationCache(std::filesystem::path cache_file) : path{std::move(cache_file)} {
+    std::error_code ec;
+    const auto file_size = std::filesystem::file_size(path, ec);
+    if(ec || file_size < sizeof(FileHeader)) {
+        return;
+    }
+    MMapper map(path.c_str());
+    if(!load(map.view())) {
+        printf("Ignoring invalid hyphenation cache %s.\n", path.c_str());
+        languages.clear();
+    }
+}
+
+bool HyphenationCache::load(std::string_view data) {
+    FileHeader header;
+    if(!read_value(data, header) || memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+       header.version != HYPHENATOR_VERSION) {
+        return false;
+    }
+    // Words of languages whose hyphenation data has changed are dropped.
+    std::map<Language, bool> current;
+    for(uint32_t i = 0; i < header.num_languages; ++i) {
+        LanguageHeader lh;
+        if(!read_value(data, lh) || !is_hyphenated_language(lh.lang)) {
+            return false;
+        }
+        const auto lang = Language(lh.lang);
+        current[lang] = lh.data_digest == data_digest(lang);
+        if(!current[lang]) {
+            modified = true;
+        }
+    }
+    for(uint64_t i = 0; i < header.num_words; ++i) {
+        WordHeader wh;
+        if(!read_value(data, wh) || data.size() < wh.num_bytes) {
+            return false;
+        }
+        const auto lang_it = current.find(Language(wh.lang));
+        if(lang_it == current.end()) {
+            return false;
+        }
+        const auto word = data.substr(0, wh.num_bytes);
+        data.remove_prefix(wh.num_bytes);
+        std::vector<HyphenPoint> points;
+        points.reserve(wh.num_points);
+        for(uint8_t p = 0; p < wh.num_points; ++p) {
+            StoredPoint sp{};
+            if(!read_value(data, sp, STORED_POINT_SIZE) || sp.loc >= word.size() ||
+               sp.type > uint8_t(SplitType::NoHyphen)) {
+                return false;
+            }
+            points.emplace_back(HyphenPoint{sp.loc, SplitType(sp.type)});
+        }
+        if(lang_it->second) {
+            languages[lang_it->first].emplace(word, std::move(points));
+        }
+    }
+    return data.empty();
+}
+
+uint64_t HyphenationCache::data_digest(Language lang) {
+    auto it = digests.find(lang);
+    if(it == digests.end()) {
+        it = digests.emplace(lang, hyphenation_data_digest(lang)).first;
+    }
+    return it->second;
+}
+
+std::optional<std::vector<HyphenPoint>> HyphenationCache::lookup(std::string_view word,
+                                                                 Language lang) const {
+    std::vector<HyphenPoint> points;
+    if(!lookup(word, lang, points)) {
+        return {};
+    }
+    return points;
+}
+
+bool HyphenationCache::lookup(std::string_view word,
+                              Language lang,
+                              std::vector<HyphenPoint> &points) const {
+    std::shared_lock l(lock);
+    auto words = languages.find(lang);
+    if(words == languages.end()) {
+        return false;
+    }
+    auto it = words->second.find(word);
+    if(it == words->second.end()) {
+        return false;
+    }
+    points.assign(it->second.begin(), it->second.end());
+    return true;
+}
+
+void HyphenationCache::insert(std::string_view word,
+                              Language lang,
+                              const std::vector<HyphenPoint> &points) {
+    std::unique_lock l(lock);
+    auto &words = languages[lang];
+    if(words.find(word) == words.end()) {
+        words.emplace(word, points);
+        modified = true;
+    }
+}
+
+void HyphenationCache::save() {
+    std::unique_lock l(lock);
+    if(path.empty() || !modified) {
+        return;
+    }
+    std::string out;
+    uint32_t num_languages = 0;
+    for(const auto &[lang, words] : languages) {
+        if(!words.empty()) {
+            write_value(out, LanguageHeader{uint32_t(lang), 0, data_digest(lang)});
+            ++num_languages;
+        }
+    }
+    uint64_t num_words = 0;
+    for(const auto &[lang, words] : languages) {
+        for(const auto &[word, points] : words) {
+            if(!fits_in_file(word, points)) {
+                continue;
+            }
+            write_value(out,
+                        WordHeader{uint8_t(lang), uint8_t(points.size()), uint16_t(word.size())});
+            out += word;
+            for(const auto &p : points) {
+                write_value(out, StoredPoint{uint16_t(p.loc), uint8_t(p.type)}, STORED_POINT_SIZE);
+            }
+            ++num_words;
+        }
+    }
+
+    FileHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = HYPHENATOR_VERSION;
+    header.num_languages = num_languages;
+    header.num_words = num_words;
+    auto tmpfile = path;
+    tmpfile += ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream ofile(tmpfile, std::ios::binary | std::ios::trunc);
+        ofile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofile.write(out.data(), out.size());
+        if(ofile.fail()) {
+            printf("Could not write hyphenation cache %s.\n", tmpfile.c_str());
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpfile, path, ec);
+    if(ec) {
+        printf("Could not replace hyphenation cache %s: %s\n", path.c_str(), ec.message().c_str());
+        std::filesystem::remove(tmpfile, ec);
+        return;
+    }
+    modified = false;
+}
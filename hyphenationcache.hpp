@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#pragma once
+
+#include <wordhyphenator.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Relative to the directory of the book definition.
+const char HYPHENATION_CACHE_FILE[] = "chapterizer.hyphencache";
+
+// Bump whenever a change to the hyphenator can change its results.
+const uint32_t HYPHENATOR_VERSION = 2;
+
+// Hyphen points of words that have already been hyphenated. If it has a
+// file, the words in it are loaded on construction and save() writes the
+// new ones back so that later builds start with them.
+class HyphenationCache {
+public:
+    HyphenationCache() = default;
+    explicit HyphenationCache(std::filesystem::path cache_file);
+
+    // Thread safe.
+    std::optional<std::vector<HyphenPoint>> lookup(std::string_view word, Language lang) const;
+    // Overwrites points, which lets callers reuse one vector for all words.
+    bool lookup(std::string_view word, Language lang, std::vector<HyphenPoint> &points) const;
+    void insert(std::string_view word, Language lang, const std::vector<HyphenPoint> &points);
+
+    void save();
+
+    // The file starts with this and a LanguageHeader for each language that
+    // has words in it. The words come after them.
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_languages;
+        uint64_t num_words;
+    };
+
+    struct LanguageHeader {
+        uint32_t lang;
+        uint32_t reserved;
+        uint64_t data_digest;
+    };
+
+private:
+    struct WordHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+    };
+
+    typedef std::unordered_map<std::string, std::vector<HyphenPoint>, WordHash, std::equal_to<>>
+        WordMap;
+
+    bool load(std::string_view data);
+    uint64_t data_digest(Language lang);
+
+    std::filesystem::path path;
+    mutable std::shared_mutex lock;
+    std::map<Language, WordMap> languages;
+    std::map<Language, uint64_t> digests;
+    bool modified = false;
+};
@@ -0,0 +1,448 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#include <hyphenationtrie.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include <glib.h>
+#include <unistd.h>
+
+namespace {
+
+const char TRIE_MAGIC[8] = {'C', 'H', 'A', 'P', 'T', 'R', 'I', 'E'};
+
+// The letters of a pattern and the values of the gaps around them.
+struct Pattern {
+    std::string text;
+    std::vector<uint8_t> values;
+};
+
+struct BuildNode {
+    std::map<uint8_t, uint32_t> children;
+    std::vector<uint8_t> values;
+};
+
+bool is_continuation_byte(char c) { return (uint8_t(c) & 0xC0) == 0x80; }
+
+std::string latin1_to_utf8(std::string_view in) {
+    std::string out;
+    for(const auto c : in) {
+        char buf[6];
+        const int len = g_unichar_to_utf8(uint8_t(c), buf);
+        out.append(buf, len);
+    }
+    return out;
+}
+
+// Clears the breaks that leave fewer characters than the minimums before
+// or after them.
+void apply_minimums(std::string_view text, uint8_t *breaks, uint32_t lmin, uint32_t rmin) {
+    const size_t num_chars = g_utf8_strlen(text.data(), text.size());
+    size_t chars_before = 0;
+    for(size_t i = 0; i < text.size(); ++i) {
+        if(!is_continuation_byte(text[i])) {
+            ++chars_before;
+        }
+        if(chars_before < lmin || num_chars - chars_before < rmin) {
+            breaks[i] = 0;
+        }
+    }
+}
+
+bool starts_with(std::string_view line, std::string_view keyword) {
+    return line.substr(0, keyword.size()) == keyword;
+}
+
+uint32_t keyword_value(std::string_view line, std::string_view keyword) {
+    return uint32_t(atoi(std::string(line.substr(keyword.size())).c_str()));
+}
+
+Pattern parse_pattern(std::string_view line) {
+    Pattern p;
+    p.values.push_back(0);
+    for(const auto c : line) {
+        if(c >= '0' && c <= '9') {
+            p.values.back() = c - '0';
+        } else {
+            p.text += c;
+            p.values.push_back(0);
+        }
+    }
+    return p;
+}
+
+void pad(std::vector<char> &out) {
+    while(out.size() % 4 != 0) {
+        out.push_back('\0');
+    }
+}
+
+template<typename T> void append(std::vector<char> &out, const T &value) {
+    const auto *bytes = reinterpret_cast<const char *>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void add_level(const std::vector<Pattern> &patterns, std::vector<char> &out) {
+    std::vector<BuildNode> nodes(1);
+    for(const auto &p : patterns) {
+        uint32_t node = 0;
+        for(const auto c : p.text) {
+            auto it = nodes[node].children.find(uint8_t(c));
+            if(it == nodes[node].children.end()) {
+                nodes[node].children[uint8_t(c)] = nodes.size();
+                node = nodes.size();
+                nodes.emplace_back();
+            } else {
+                node = it->second;
+            }
+        }
+        auto &values = nodes[node].values;
+        if(values.empty()) {
+            values = p.values;
+        } else {
+            for(size_t i = 0; i < values.size(); ++i) {
+                values[i] = std::max(values[i], p.values[i]);
+            }
+        }
+    }
+    HyphenationTrie::LevelHeader lh{uint32_t(nodes.size()), 0, 0, 0};
+    for(const auto &n : nodes) {
+        lh.num_edges += n.children.size();
+        lh.num_values += n.values.size();
+    }
+    append(out, lh);
+    uint32_t first_edge = 0;
+    uint32_t first_value = 0;
+    for(const auto &n : nodes) {
+        const HyphenationTrie::Node node{
+            first_edge, uint32_t(n.children.size()), first_value, uint32_t(n.values.size())};
+        append(out, node);
+        first_edge += n.children.size();
+        first_value += n.values.size();
+    }
+    // std::map keeps the edges of each node sorted by byte.
+    for(const auto &n : nodes) {
+        for(const auto &[byte, target] : n.children) {
+            append(out, HyphenationTrie::Edge{byte, target});
+        }
+    }
+    for(const auto &n : nodes) {
+        out.insert(out.end(), n.values.begin(), n.values.end());
+    }
+    pad(out);
+}
+
+std::vector<char>
+compile(const std::filesystem::path &dic_file, uint64_t source_size, int64_t source_time) {
+    std::ifstream input(dic_file, std::ios::binary);
+    if(input.fail()) {
+        printf("Could not open hyphenation dictionary %s.\n", dic_file.c_str());
+        std::abort();
+    }
+    const std::string contents{std::istreambuf_iterator<char>(input),
+                               std::istreambuf_iterator<char>()};
+    StableHasher hasher;
+    hasher.add(std::string_view{contents});
+    HyphenationTrie::FileHeader h{};
+    memcpy(h.magic, TRIE_MAGIC, sizeof(TRIE_MAGIC));
+    h.version = HYPHENATION_TRIE_VERSION;
+    h.left_min = 2;
+    h.right_min = 2;
+    h.source_size = source_size;
+    h.source_time = source_time;
+    h.source_hash = hasher.value();
+    std::vector<std::vector<Pattern>> levels(1);
+    std::string nohyphen;
+    bool latin1 = false;
+    bool first_line = true;
+    std::istringstream lines(contents);
+    for(std::string raw; std::getline(lines, raw);) {
+        std::string line = latin1 ? latin1_to_utf8(raw) : raw;
+        while(!line.empty() && isspace(uint8_t(line.back()))) {
+            line.pop_back();
+        }
+        if(first_line) {
+            // The character set of the file.
+            first_line = false;
+            if(line == "ISO8859-1") {
+                latin1 = true;
+            } else if(line != "UTF-8") {
+                printf("Unsupported encoding %s in %s.\n", line.c_str(), dic_file.c_str());
+                std::abort();
+            }
+            continue;
+        }
+        if(line.empty() || line[0] == '%' || line[0] == '#') {
+            continue;
+        }
+        if(starts_with(line, "LEFTHYPHENMIN")) {
+            h.left_min = keyword_value(line, "LEFTHYPHENMIN");
+        } else if(starts_with(line, "RIGHTHYPHENMIN")) {
+            h.right_min = keyword_value(line, "RIGHTHYPHENMIN");
+        } else if(starts_with(line, "COMPOUNDLEFTHYPHENMIN")) {
+            h.compound_left_min = keyword_value(line, "COMPOUNDLEFTHYPHENMIN");
+        } else if(starts_with(line, "COMPOUNDRIGHTHYPHENMIN")) {
+            h.compound_right_min = keyword_value(line, "COMPOUNDRIGHTHYPHENMIN");
+        } else if(starts_with(line, "NEXTLEVEL")) {
+            if(levels.size() == 2) {
+                printf("More than two pattern levels in %s.\n", dic_file.c_str());
+                std::abort();
+            }
+            levels.emplace_back();
+        } else if(starts_with(line, "NOHYPHEN")) {
+            std::string_view list = std::string_view(line).substr(strlen("NOHYPHEN"));
+            while(!list.empty() && list.front() == ' ') {
+                list.remove_prefix(1);
+            }
+            while(!list.empty()) {
+                const auto comma = std::min(list.find(','), list.size());
+                if(comma > 0) {
+                    nohyphen += list.substr(0, comma);
+                    nohyphen += '\0';
+                }
+                list.remove_prefix(std::min(comma + 1, list.size()));
+            }
+        } else if(line.find('/') != std::string::npos) {
+            // Non-standard patterns that change the word are not supported.
+        } else {
+            auto p = parse_pattern(line);
+            if(!p.text.empty()) {
+                levels.back().emplace_back(std::move(p));
+            }
+        }
+    }
+    h.num_levels = levels.size();
+    h.nohyphen_bytes = nohyphen.size();
+    std::vector<char> out;
+    append(out, h);
+    out.insert(out.end(), nohyphen.begin(), nohyphen.end());
+    pad(out);
+    for(const auto &patterns : levels) {
+        add_level(patterns, out);
+    }
+    return out;
+}
+
+} // namespace
+
+std::unique_ptr<HyphenationTrie> HyphenationTrie::load(const std::filesystem::path &dic_file,
+                                                       const std::filesystem::path &cache_file) {
+    std::error_code ec;
+    const uint64_t source_size = std::filesystem::file_size(dic_file, ec);
+    if(ec) {
+        return nullptr;
+    }
+    const int64_t source_time =
+        std::filesystem::last_write_time(dic_file, ec).time_since_epoch().count();
+    std::unique_ptr<HyphenationTrie> trie(new HyphenationTrie());
+    const auto cache_size = std::filesystem::file_size(cache_file, ec);
+    if(!ec && cache_size >= sizeof(FileHeader)) {
+        trie->map = std::make_unique<MMapper>(cache_file.c_str());
+        if(trie->set_data(trie->map->data(), trie->map->size()) &&
+           trie->header.source_size == source_size && trie->header.source_time == source_time) {
+            return trie;
+        }
+        trie->map.reset();
+    }
+    trie->compiled = compile(dic_file, source_size, source_time);
+    if(!trie->set_data(trie->compiled.data(), trie->compiled.size())) {
+        printf("Could not compile hyphenation patterns from %s.\n", dic_file.c_str());
+        std::abort();
+    }
+    auto tmpfile = cache_file;
+    tmpfile += ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream ofile(tmpfile, std::ios::binary | std::ios::trunc);
+        ofile.write(trie->compiled.data(), trie->compiled.size());
+        if(ofile.fail()) {
+            printf("Could not write hyphenation trie %s.\n", tmpfile.c_str());
+            return trie;
+        }
+    }
+    std::filesystem::rename(tmpfile, cache_file, ec);
+    if(ec) {
+        printf("Could not replace hyphenation trie %s: %s\n",
+               cache_file.c_str(),
+               ec.message().c_str());
+        std::filesystem::remove(tmpfile, ec);
+    }
+    return trie;
+}
+
+bool HyphenationTrie::set_data(const char *data, size_t size) {
+    levels.clear();
+    nohyphen.clear();
+    if(size < sizeof(FileHeader)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(FileHeader));
+    if(memcmp(header.magic, TRIE_MAGIC, sizeof(TRIE_MAGIC)) != 0 ||
+       header.version != HYPHENATION_TRIE_VERSION || header.num_levels < 1 ||
+       header.num_levels > 2) {
+        return false;
+    }
+    size_t offset = sizeof(FileHeader);
+    if(size - offset < header.nohyphen_bytes) {
+        return false;
+    }
+    std::string_view strings(data + offset, header.nohyphen_bytes);
+    while(!strings.empty()) {
+        const auto end = strings.find('\0');
+        if(end == std::string_view::npos) {
+            return false;
+        }
+        nohyphen.push_back(strings.substr(0, end));
+        strings.remove_prefix(end + 1);
+    }
+    offset += (header.nohyphen_bytes + 3) / 4 * 4;
+    for(uint32_t l = 0; l < header.num_levels; ++l) {
+        LevelHeader lh;
+        if(offset > size || size - offset < sizeof(LevelHeader)) {
+            return false;
+        }
+        memcpy(&lh, data + offset, sizeof(LevelHeader));
+        offset += sizeof(LevelHeader);
+        const uint64_t level_size = uint64_t(lh.num_nodes) * sizeof(Node) +
+                                    uint64_t(lh.num_edges) * sizeof(Edge) + lh.num_values;
+        if(lh.num_nodes == 0 || size - offset < level_size) {
+            return false;
+        }
+        Level level;
+        level.nodes = reinterpret_cast<const Node *>(data + offset);
+        level.edges = reinterpret_cast<const Edge *>(level.nodes + lh.num_nodes);
+        level.values = reinterpret_cast<const uint8_t *>(level.edges + lh.num_edges);
+        for(uint32_t i = 0; i < lh.num_nodes; ++i) {
+            const auto &n = level.nodes[i];
+            if(uint64_t(n.first_edge) + n.num_edges > lh.num_edges ||
+               uint64_t(n.first_value) + n.num_values > lh.num_values) {
+                return false;
+            }
+        }
+        for(uint32_t i = 0; i < lh.num_edges; ++i) {
+            if(level.edges[i].target >= lh.num_nodes) {
+                return false;
+            }
+        }
+        levels.push_back(level);
+        offset += (level_size + 3) / 4 * 4;
+    }
+    return offset == size;
+}
+
+uint64_t HyphenationTrie::source_digest() const { return header.source_hash; }
+
+// Sets values[i] to the highest value any pattern has for the gap before
+// dotted[i].
+void HyphenationTrie::match(const Level &level, std::string_view dotted, uint8_t *values) const {
+    for(size_t start = 0; start < dotted.size(); ++start) {
+        uint32_t node = 0;
+        for(size_t i = start; i < dotted.size(); ++i) {
+            const auto &n = level.nodes[node];
+            const auto *first = level.edges + n.first_edge;
+            const auto *last = first + n.num_edges;
+            const uint32_t byte = uint8_t(dotted[i]);
+            const auto *e = std::lower_bound(
+                first, last, byte, [](const Edge &edge, uint32_t b) { return edge.byte < b; });
+            if(e == last || e->byte != byte) {
+                break;
+            }
+            node = e->target;
+            const auto &found = level.nodes[node];
+            for(uint32_t j = 0; j < found.num_values; ++j) {
+                const auto v = level.values[found.first_value + j];
+                values[start + j] = std::max(values[start + j], v);
+            }
+        }
+    }
+}
+
+// Sets breaks[i] if the part can be hyphenated after its byte i.
+void HyphenationTrie::hyphenate_part(const Level &level,
+                                     std::string_view part,
+                                     uint32_t lmin,
+                                     uint32_t rmin,
+                                     uint8_t *breaks) const {
+    std::array<char, MAX_WORD_BYTES + 2> dotted;
+    std::array<uint8_t, MAX_WORD_BYTES + 3> values{};
+    dotted[0] = '.';
+    memcpy(dotted.data() + 1, part.data(), part.size());
+    dotted[part.size() + 1] = '.';
+    match(level, std::string_view(dotted.data(), part.size() + 2), values.data());
+    std::array<uint8_t, MAX_WORD_BYTES> part_breaks{};
+    for(size_t i = 0; i + 1 < part.size(); ++i) {
+        // The gap after part[i] is the one before dotted[i + 2].
+        part_breaks[i] = !is_continuation_byte(part[i + 1]) && values[i + 2] % 2 == 1;
+    }
+    apply_minimums(part, part_breaks.data(), lmin, rmin);
+    for(size_t i = 0; i < part.size(); ++i) {
+        breaks[i] |= part_breaks[i];
+    }
+}
+
+void HyphenationTrie::hyphenate(std::string_view word,
+                                size_t word_offset,
+                                std::vector<HyphenPoint> &hyphen_points) const {
+    if(word.size() > MAX_WORD_BYTES) {
+        return;
+    }
+    // Lower case letters whose encoding has a different length are kept as
+    // is so that offsets do not change.
+    std::array<char, MAX_WORD_BYTES> lower;
+    for(size_t i = 0; i < word.size();) {
+        const char *c = word.data() + i;
+        const size_t len = g_utf8_next_char(c) - c;
+        if(i + len > word.size()) {
+            return;
+        }
+        char buf[6];
+        if(size_t(g_unichar_to_utf8(g_unichar_tolower(g_utf8_get_char(c)), buf)) == len) {
+            memcpy(lower.data() + i, buf, len);
+        } else {
+            memcpy(lower.data() + i, c, len);
+        }
+        i += len;
+    }
+    const std::string_view text(lower.data(), word.size());
+    std::array<uint8_t, MAX_WORD_BYTES> breaks{};
+    if(levels.size() == 1) {
+        hyphenate_part(levels[0], text, header.left_min, header.right_min, breaks.data());
+    } else {
+        // The first level splits the word to parts like a compound word
+        // and the second one hyphenates the parts.
+        hyphenate_part(levels[0], text, 1, 1, breaks.data());
+        const uint32_t lmin = std::max(header.compound_left_min, 1u);
+        const uint32_t rmin = std::max(header.compound_right_min, 1u);
+        size_t part_start = 0;
+        for(size_t i = 0; i < text.size(); ++i) {
+            if(breaks[i] || i + 1 == text.size()) {
+                hyphenate_part(levels[1],
+                               text.substr(part_start, i + 1 - part_start),
+                               lmin,
+                               rmin,
+                               breaks.data() + part_start);
+                part_start = i + 1;
+            }
+        }
+        apply_minimums(text, breaks.data(), header.left_min, header.right_min);
+    }
+    for(const auto &s : nohyphen) {
+        for(auto pos = text.find(s); pos != std::string_view::npos; pos = text.find(s, pos + 1)) {
+            const size_t first = pos > 0 ? pos - 1 : 0;
+            const size_t last = std::min(pos + s.size(), text.size());
+            std::fill(breaks.begin() + first, breaks.begin() + last, 0);
+        }
+    }
+    for(size_t i = 0; i < text.size(); ++i) {
+        if(breaks[i]) {
+            hyphen_points.emplace_back(HyphenPoint{word_offset + i, SplitType::Regular});
+        }
+    }
+}
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#pragma once
+
+#include <wordhyphenator.hpp>
+#include <utils.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Bump whenever the layout of compiled tries changes.
+const uint32_t HYPHENATION_TRIE_VERSION = 2;
+
+// Liang's hyphenation patterns from a libhyphen style dictionary, compiled
+// to a trie. The trie is a single flat buffer that is stored in a file as
+// is and memory mapped on later runs. Patterns are matched byte by byte so
+// UTF-8 needs no conversions, but hyphens only go between characters.
+class HyphenationTrie {
+public:
+    // Words longer than this are not hyphenated.
+    static constexpr size_t MAX_WORD_BYTES = 250;
+
+    // Uses the trie in cache_file if it was compiled from the current
+    // dic_file. Otherwise compiles dic_file and writes it to cache_file.
+    static std::unique_ptr<HyphenationTrie> load(const std::filesystem::path &dic_file,
+                                                 const std::filesystem::path &cache_file);
+
+    // Appends the hyphenation points of a word that has no punctuation
+    // around it. The word may have upper case letters. Their locations are
+    // offset by word_offset.
+    void hyphenate(std::string_view word,
+                   size_t word_offset,
+                   std::vector<HyphenPoint> &hyphen_points) const;
+
+    // Hash of the contents of the dictionary the trie was compiled from.
+    uint64_t source_digest() const;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_levels;
+        uint32_t left_min;
+        uint32_t right_min;
+        uint32_t compound_left_min;
+        uint32_t compound_right_min;
+        // The size and time tell if the trie is out of date without reading
+        // the dictionary, the hash identifies its contents.
+        uint64_t source_size;
+        int64_t source_time;
+        uint64_t source_hash;
+        uint32_t nohyphen_bytes; // Strings next to which no hyphens go, each ends in a '\0'.
+        uint32_t reserved;
+    };
+
+    struct LevelHeader {
+        uint32_t num_nodes;
+        uint32_t num_edges;
+        uint32_t num_values;
+        uint32_t reserved;
+    };
+
+    struct Node {
+        uint32_t first_edge;
+        uint32_t num_edges;
+        uint32_t first_value;
+        // Of the pattern that ends here, one more than its length in
+        // bytes. Zero if no pattern ends here.
+        uint32_t num_values;
+    };
+
+    struct Edge {
+        uint32_t byte;
+        uint32_t target;
+    };
+
+private:
+    HyphenationTrie() = default;
+
+    struct Level {
+        const Node *nodes;
+        const Edge *edges;
+        const uint8_t *values;
+    };
+
+    bool set_data(const char *data, size_t size);
+    void match(const Level &level, std::string_view dotted, uint8_t *values) const;
+    void hyphenate_part(const Level &level,
+                        std::string_view part,
+                        uint32_t lmin,
+                        uint32_t rmin,
+                        uint8_t *breaks) const;
+
+    std::unique_ptr<MMapper> map;
+    std::vector<char> compiled;
+    FileHeader header;
+    // With two levels the second one hyphenates the parts that the first
+    // one splits words to.
+    std::vector<Level> levels;
+    std::vector<std::string_view> nohyphen;
+};
@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#include <layoutcache.hpp>
+#include <hyphenationcache.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include <unistd.h>
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'C', 'H', 'A', 'P', 'L', 'A', 'Y', 'C'};
+
+void add_length(StableHasher &hasher, Length l) { hasher.add(l.mm()); }
+
+void serialize(const std::vector<ParagraphBreaking> &breakings, std::vector<uint32_t> &out) {
+    for(const auto &b : breakings) {
+        uint32_t penalty[2];
+        static_assert(sizeof(penalty) == sizeof(b.penalty));
+        memcpy(penalty, &b.penalty, sizeof(penalty));
+        out.push_back(b.line_ends.size());
+        out.push_back(penalty[0]);
+        out.push_back(penalty[1]);
+        out.push_back(b.hyphenated_words.size());
+        out.insert(out.end(), b.line_ends.begin(), b.line_ends.end());
+        out.insert(out.end(), b.hyphenated_words.begin(), b.hyphenated_words.end());
+    }
+}
+
+// The number of words the breaking at data takes, or zero if it does not
+// fit before end.
+size_t breaking_size(const uint32_t *data, const uint32_t *end) {
+    const size_t header_words = 4;
+    if(end - data < ptrdiff_t(header_words)) {
+        return 0;
+    }
+    const uint64_t size = header_words + uint64_t(data[0]) + uint64_t(data[3]);
+    if(size > uint64_t(end - data)) {
+        return 0;
+    }
+    return size;
+}
+
+bool breakings_fit(const uint32_t *data, size_t count) {
+    const auto *end = data + count;
+    while(data < end) {
+        const auto size = breaking_size(data, end);
+        if(size == 0) {
+            return false;
+        }
+        data += size;
+    }
+    return true;
+}
+
+std::optional<std::vector<ParagraphBreaking>> deserialize(const uint32_t *data, size_t count) {
+    std::vector<ParagraphBreaking> breakings;
+    const auto *end = data + count;
+    while(data < end) {
+        if(breaking_size(data, end) == 0) {
+            return {};
+        }
+        ParagraphBreaking b;
+        const size_t num_lines = data[0];
+        memcpy(&b.penalty, data + 1, sizeof(b.penalty));
+        const size_t num_hyphenated = data[3];
+        data += 4;
+        b.line_ends.assign(data, data + num_lines);
+        data += num_lines;
+        b.hyphenated_words.assign(data, data + num_hyphenated);
+        data += num_hyphenated;
+        breakings.emplace_back(std::move(b));
+    }
+    return breakings;
+}
+
+void add_text_parameters(StableHasher &hasher, const HBTextParameters &par) {
+    add_length(hasher, par.size);
+    hasher.add(par.par.cat);
+    hasher.add(par.par.style);
+    hasher.add(par.par.extra);
+}
+
+} // namespace
+
+uint64_t layout_key(const WordStore &words,
+                    Length target_width,
+                    const HBChapterParameters &par,
+                    const ExtraPenaltyAmounts &extras,
+                    SplitAlgorithm alg,
+                    bool with_variants,
+                    uint64_t font_digest) {
+    StableHasher hasher;
+    hasher.add(LAYOUT_ENGINE_VERSION);
+    hasher.add(alg);
+    hasher.add(with_variants);
+    hasher.add(font_digest);
+    add_length(hasher, target_width);
+    add_length(hasher, par.line_height);
+    add_length(hasher, par.indent);
+    add_text_parameters(hasher, par.font);
+    hasher.add(par.indent_last_line);
+    hasher.add(extras.multiple_dashes);
+    hasher.add(extras.single_word_line);
+    hasher.add(extras.single_split_word_line);
+    hasher.add(words.pending_hyphenation());
+    if(words.pending_hyphenation() != Language::Unset) {
+        // The words are not hyphenated yet, so changes to hyphenation would
+        // not show up in them.
+        hasher.add(HYPHENATOR_VERSION);
+        hasher.add(hyphenation_data_digest(words.pending_hyphenation()));
+    }
+    hasher.add(words.size());
+    for(size_t i = 0; i < words.size(); ++i) {
+        const auto w = words[i];
+        hasher.add(w.text);
+        hasher.add(w.hyphen_points.size());
+        for(const auto &h : w.hyphen_points) {
+            hasher.add(h.loc);
+            hasher.add(h.type);
+        }
+        hasher.add(w.f.size());
+        for(const auto &f : w.f) {
+            hasher.add(f.offset);
+            hasher.add(f.format);
+        }
+        hasher.add(w.start_style.cend() - w.start_style.cbegin());
+        for(auto c = w.start_style.cbegin(); c != w.start_style.cend(); ++c) {
+            hasher.add(*c);
+        }
+    }
+    return hasher.value();
+}
+
+LayoutCache::LayoutCache(std::filesystem::path cache_file) : path{std::move(cache_file)} {
+    load();
+}
+
+void LayoutCache::load() {
+    map.reset();
+    index = nullptr;
+    words = nullptr;
+    num_entries = 0;
+    used.reset();
+    if(path.empty()) {
+        return;
+    }
+    std::error_code ec;
+    const auto file_size = std::filesystem::file_size(path, ec);
+    if(ec || file_size < sizeof(FileHeader)) {
+        return;
+    }
+    map = std::make_unique<MMapper>(path.c_str());
+    FileHeader header;
+    memcpy(&header, map->data(), sizeof(header));
+    const auto data_size = file_size - sizeof(FileHeader);
+    const bool counts_fit = header.num_entries <= data_size / sizeof(IndexEntry) &&
+                            header.num_words <= data_size / sizeof(uint32_t);
+    if(memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+       header.version != LAYOUT_ENGINE_VERSION || !counts_fit ||
+       header.num_entries * sizeof(IndexEntry) + header.num_words * sizeof(uint32_t) !=
+           data_size) {
+        printf("Ignoring invalid layout cache %s.\n", path.c_str());
+        map.reset();
+        return;
+    }
+    const auto *file_index = reinterpret_cast<const IndexEntry *>(map->data() + sizeof(FileHeader));
+    const auto *file_words = reinterpret_cast<const uint32_t *>(file_index + header.num_entries);
+    // Lookups trust the index, so every entry must be sorted and point to
+    // complete breakings.
+    for(size_t i = 0; i < header.num_entries; ++i) {
+        const auto &e = file_index[i];
+        if((i > 0 && file_index[i - 1].key >= e.key) ||
+           uint64_t(e.first) + e.count > header.num_words ||
+           !breakings_fit(file_words + e.first, e.count)) {
+            printf("Ignoring corrupt layout cache %s.\n", path.c_str());
+            map.reset();
+            return;
+        }
+    }
+    num_entries = header.num_entries;
+    index = file_index;
+    words = file_words;
+    used.reset(new std::atomic<bool>[num_entries]);
+    for(size_t i = 0; i < num_entries; ++i) {
+        used[i].store(false, std::memory_order_relaxed);
+    }
+}
+
+const LayoutCache::IndexEntry *LayoutCache::find(uint64_t key) const {
+    const auto *end = index + num_entries;
+    auto it = std::lower_bound(
+        index, end, key, [](const IndexEntry &e, uint64_t k) { return e.key < k; });
+    if(it == end || it->key != key) {
+        return nullptr;
+    }
+    return it;
+}
+
+std::optional<std::vector<ParagraphBreaking>> LayoutCache::lookup(uint64_t key) const {
+    const auto *entry = find(key);
+    if(!entry) {
+        return {};
+    }
+    auto breakings = deserialize(words + entry->first, entry->count);
+    if(breakings) {
+        used[entry - index].store(true, std::memory_order_relaxed);
+    }
+    return breakings;
+}
+
+void LayoutCache::insert(uint64_t key, const std::vector<ParagraphBreaking> &breakings) {
+    if(path.empty()) {
+        return;
+    }
+    std::vector<uint32_t> stored;
+    serialize(breakings, stored);
+    std::lock_guard l(new_lock);
+    new_entries[key] = std::move(stored);
+}
+
+void LayoutCache::save() {
+    std::lock_guard l(new_lock);
+    if(new_entries.empty()) {
+        return;
+    }
+    const bool keep_unused = num_entries + new_entries.size() <= MAX_ENTRIES;
+    std::vector<IndexEntry> out_index;
+    std::vector<uint32_t> out_words;
+    auto append = [&](uint64_t key, const uint32_t *data, size_t count) {
+        out_index.emplace_back(IndexEntry{key, (uint32_t)out_words.size(), (uint32_t)count});
+        out_words.insert(out_words.end(), data, data + count);
+    };
+    // Both inputs are sorted so merging them keeps the output sorted.
+    size_t old_i = 0;
+    auto new_it = new_entries.begin();
+    while(old_i < num_entries || new_it != new_entries.end()) {
+        const bool take_old = new_it == new_entries.end() ||
+                              (old_i < num_entries && index[old_i].key < new_it->first);
+        if(take_old) {
+            const auto &e = index[old_i];
+            if(keep_unused || used[old_i].load(std::memory_order_relaxed)) {
+                append(e.key, words + e.first, e.count);
+            }
+            ++old_i;
+        } else {
+            if(old_i < num_entries && index[old_i].key == new_it->first) {
+                ++old_i;
+            }
+            append(new_it->first, new_it->second.data(), new_it->second.size());
+            ++new_it;
+        }
+    }
+
+    FileHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = LAYOUT_ENGINE_VERSION;
+    header.reserved = 0;
+    header.num_entries = out_index.size();
+    header.num_words = out_words.size();
+    auto tmpfile = path;
+    tmpfile += ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream ofile(tmpfile, std::ios::binary | std::ios::trunc);
+        ofile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofile.write(reinterpret_cast<const char *>(out_index.data()),
+                    out_index.size() * sizeof(IndexEntry));
+        ofile.write(reinterpret_cast<const char *>(out_words.data()),
+                    out_words.size() * sizeof(uint32_t));
+        if(ofile.fail()) {
+            printf("Could not write layout cache %s.\n", tmpfile.c_str());
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpfile, path, ec);
+    if(ec) {
+        printf("Could not replace layout cache %s: %s\n", path.c_str(), ec.message().c_str());
+        std::filesystem::remove(tmpfile, ec);
+        return;
+    }
+    // The new entries are in the file now, so later lookups and saves get
+    // them from there.
+    new_entries.clear();
+    load();
+}
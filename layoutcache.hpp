@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#pragma once
+
+#include <chaptercommon.hpp>
+#include <formatting.hpp>
+#include <utils.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Relative to the working directory, which is usually the build directory.
+const char LAYOUT_CACHE_FILE[] = "chapterizer.layoutcache";
+
+// Bump whenever a change to paragraph splitting can change its results.
+const uint32_t LAYOUT_ENGINE_VERSION = 4;
+
+uint64_t layout_key(const WordStore &words,
+                    Length target_width,
+                    const HBChapterParameters &par,
+                    const ExtraPenaltyAmounts &extras,
+                    SplitAlgorithm alg,
+                    bool with_variants,
+                    uint64_t font_digest);
+
+// Stores the breakings of paragraphs between runs. The file
+// is memory mapped and never modified in place. save() writes a new file
+// and renames it over the old one so other processes can read the cache
+// while it is being updated. With an empty path nothing is cached.
+class LayoutCache {
+public:
+    explicit LayoutCache(std::filesystem::path cache_file);
+
+    // Thread safe.
+    std::optional<std::vector<ParagraphBreaking>> lookup(uint64_t key) const;
+    void insert(uint64_t key, const std::vector<ParagraphBreaking> &breakings);
+
+    void save();
+
+    static constexpr size_t MAX_ENTRIES = 1 << 20;
+
+private:
+    struct IndexEntry {
+        uint64_t key;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t num_entries;
+        uint64_t num_words;
+    };
+
+    void load();
+    const IndexEntry *find(uint64_t key) const;
+
+    std::filesystem::path path;
+    std::unique_ptr<MMapper> map;
+    const IndexEntry *index = nullptr; // Sorted by key.
+    // Each breaking is stored as its line count, its penalty as two
+    // words, its number of hyphenated words, its line ends and its
+    // hyphenated words.
+    const uint32_t *words = nullptr;
+    size_t num_entries = 0;
+    // Old entries that were looked up are kept when the cache is full.
+    std::unique_ptr<std::atomic<bool>[]> used;
+
+    std::mutex new_lock;
+    std::map<uint64_t, std::vector<uint32_t>> new_entries;
+};
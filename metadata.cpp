@@ -18,6 +18,7 @@
 #include <utils.hpp>
 #include <fstream>
 #include <nlohmann/json.hpp>
+#include <stdexcept>
 #include <unordered_map>
 
 namespace {
@@ -38,13 +39,12 @@ std::vector<std::string> extract_stringarray(const nlohmann::json &data, const c
     std::vector<std::string> result;
     auto arr = data[entryname];
     if(!arr.is_array()) {
-        printf("%s must be an array of strings.\n", entryname);
-        std::abort();
+        throw std::runtime_error(std::string(entryname) + " must be an array of strings.");
     }
     for(const auto &e : arr) {
         if(!e.is_string()) {
-            printf("Source array %s entry is not a string.\n", entryname);
-            std::abort();
+            throw std::runtime_error(std::string("Source array ") + entryname +
+                                     " entry is not a string.");
         }
         result.push_back(e.get<std::string>());
     }
@@ -57,43 +57,56 @@ using json = nlohmann::json;
 
 std::string get_string(const json &data, const char *key) {
     if(!data.contains(key)) {
-        printf("Missing required key %s.\n", key);
-        std::abort();
+        throw std::runtime_error(std::string("Missing required key ") + key + ".");
     }
     auto value = data[key];
     if(!value.is_string()) {
-        printf("Element %s is not a string.\n", key);
-        std::abort();
+        throw std::runtime_error(std::string("Element ") + key + " is not a string.");
     }
     return value.get<std::string>();
 }
 
 double get_double(const json &data, const char *key) {
     if(!data.contains(key)) {
-        printf("Missing required key %s.\n", key);
-        std::abort();
+        throw std::runtime_error(std::string("Missing required key ") + key + ".");
     }
     auto value = data[key];
     if(!value.is_number()) {
-        printf("Element %s is not a string.\n", key);
-        std::abort();
+        throw std::runtime_error(std::string("Element ") + key + " is not a string.");
     }
     return value.get<double>();
 }
 
 int get_int(const json &data, const char *key) {
     if(!data.contains(key)) {
-        printf("Missing required key %s.\n", key);
-        std::abort();
+        throw std::runtime_error(std::string("Missing required key ") + key + ".");
     }
     auto value = data[key];
     if(!value.is_number_integer()) {
-        printf("Element %s is not a string.\n", key);
-        std::abort();
+        throw std::runtime_error(std::string("Element ") + key + " is not a string.");
     }
     return value.get<int>();
 }
 
+// Both limits are optional.
+SearchLimits parse_search_limits(const json &data) {
+    SearchLimits limits;
+    if(data.contains("milliseconds")) {
+        limits.milliseconds = get_int(data, "milliseconds");
+    }
+    if(data.contains("nodes")) {
+        const int nodes = get_int(data, "nodes");
+        if(nodes < 0) {
+            throw std::runtime_error("Search node budget can not be negative.");
+        }
+        limits.nodes = nodes;
+    }
+    if(limits.milliseconds < 0) {
+        throw std::runtime_error("Search time budget can not be negative.");
+    }
+    return limits;
+}
+
 HBChapterParameters parse_chapterstyle(const json &data) {
     HBChapterParameters chapter_style;
     chapter_style.line_height = Length::from_pt(get_double(data, "line_height"));
@@ -102,15 +115,14 @@ HBChapterParameters parse_chapterstyle(const json &data) {
     auto cat = get_string(font, "category");
     auto cit = categorymap.find(cat);
     if(cit == categorymap.end()) {
-        fprintf(stderr, "Unknown category: %s\n", cat.c_str());
+        throw std::runtime_error("Unknown category: " + cat);
     }
     chapter_style.font.par.cat = cit->second;
 
     const auto stylestr = get_string(font, "type");
     auto it = stylemap.find(stylestr);
     if(it == stylemap.end()) {
-        printf("Unknown type \"%s\".", stylestr.c_str());
-        std::abort();
+        throw std::runtime_error("Unknown type \"" + stylestr + "\".");
     }
     chapter_style.font.par.style = it->second;
     chapter_style.font.size = Length::from_pt(get_double(font, "pointsize"));
@@ -214,6 +226,28 @@ void load_pdf_element(Metadata &m, const json &pdf) {
         auto colophon_file = m.top_dir / get_string(pdf, "colophon");
         m.pdf.colophon = read_lines(colophon_file.c_str());
     }
+    if(pdf.contains("line_splitter")) {
+        const auto splitter = get_string(pdf, "line_splitter");
+        if(splitter == "dynamic") {
+            m.pdf.line_splitter = SplitAlgorithm::Dynamic;
+        } else if(splitter == "recursive") {
+            m.pdf.line_splitter = SplitAlgorithm::Recursive;
+        } else {
+            throw std::runtime_error("Unknown line splitter " + splitter + ".");
+        }
+    }
+    if(pdf.contains("threads")) {
+        m.pdf.threads = get_int(pdf, "threads");
+        if(m.pdf.threads < 0) {
+            throw std::runtime_error("Thread count can not be negative.");
+        }
+    }
+    if(pdf.contains("paragraph_budget")) {
+        m.pdf.paragraph_budget = parse_search_limits(pdf["paragraph_budget"]);
+    }
+    if(pdf.contains("chapter_budget")) {
+        m.pdf.chapter_budget = parse_search_limits(pdf["chapter_budget"]);
+    }
     if(m.is_draft) {
         setup_draft_settings(m);
     } else {
@@ -306,8 +340,7 @@ Metadata load_book_json(const char *path) {
     m.top_dir = json_file.parent_path();
     std::ifstream ifile(path);
     if(ifile.fail()) {
-        printf("Could not open file %s.\n", path);
-        std::abort();
+        throw std::runtime_error(std::string("Could not open file ") + path + ".");
     }
 
     json data = json::parse(ifile);
@@ -329,11 +362,16 @@ Metadata load_book_json(const char *path) {
     if(data.contains("debug_draw")) {
         m.debug_draw = data["debug_draw"].get<bool>();
     }
+    if(data.contains("hyphenation_cache")) {
+        m.hyphenation_cache = data["hyphenation_cache"].get<bool>();
+    }
+    if(data.contains("layout_cache")) {
+        m.layout_cache = data["layout_cache"].get<bool>();
+    }
     const auto langstr = get_string(data, "language");
     auto it = langmap.find(langstr);
     if(it == langmap.end()) {
-        printf("Unsupported language %s\n", langstr.c_str());
-        std::abort();
+        throw std::runtime_error("Unsupported language " + langstr);
     }
     m.language = it->second;
 
@@ -353,8 +391,7 @@ Metadata load_book_json(const char *path) {
             auto sfile = m.top_dir / text;
             m.frontmatter.emplace_back(Signing{read_lines(sfile.c_str())});
         } else {
-            fprintf(stderr, "Frontmatter not supported yet.\n");
-            std::abort();
+            throw std::runtime_error("Frontmatter not supported yet.");
         }
     }
     m.sources = extract_stringarray(data, "sources");
@@ -367,8 +404,7 @@ Metadata load_book_json(const char *path) {
             auto recipe_path = m.top_dir / text;
             m.recipe = load_recipe(recipe_path.c_str());
         } else {
-            fprintf(stderr, "Backmatter of type %s not yet supported.\n", text.c_str());
-            std::abort();
+            throw std::runtime_error("Backmatter of type " + text + " not yet supported.");
         }
     }
 
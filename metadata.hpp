@@ -85,6 +85,10 @@ struct PdfMetadata {
     HBChapterStyles styles;
     FontFilePaths font_files;
     Spaces spaces;
+    SplitAlgorithm line_splitter = SplitAlgorithm::Dynamic;
+    int threads = 1; // Zero means one per core.
+    SearchLimits paragraph_budget;
+    SearchLimits chapter_budget;
 };
 
 struct EpubMetadata {
@@ -142,6 +146,10 @@ struct Metadata {
     std::vector<std::string> recipe;
     std::vector<std::string> postcredits;
     bool debug_draw = false;
+    // Keep hyphenated words in a file next to the book definition.
+    bool hyphenation_cache = true;
+    // Keep paragraph layouts in a file in the working directory.
+    bool layout_cache = true;
 };
 
 struct Paragraph {
@@ -17,13 +17,19 @@
 #include <paragraphformatter.hpp>
 #include <glib.h>
 #include <algorithm>
-#include <numeric>
+#include <map>
 #include <optional>
 #include <cassert>
 #include <cmath>
 
 namespace {
 
+// Nodes of the recursive splitter. Reused by every paragraph the thread
+// formats so that the search does not need to allocate memory per node.
+thread_local std::vector<SearchNode> search_arena;
+
+const size_t NO_NODE = size_t(-1);
+
 double difference_penalty(Length actual_width, Length target_width) {
     // assert(actual_width >= 0);
     const double multiplier = actual_width > target_width ? 5.0 : 1.0;
@@ -176,64 +182,73 @@ void toggle_format(StyleStack &current_style, const char format_to_toggle) {
     }
 }
 
-HBWord wordfragment2runs(const HBTextParameters &original_par,
-                         StyleStack &sstack,
-                         const EnrichedWord &w,
-                         size_t start,
-                         size_t end,
-                         bool add_space,
-                         bool add_dash) {
-    HBWord word;
-    HBTextParameters active_par = original_par;
-    {
-        HBStyleApplier tmp(sstack);
-        tmp.apply_to_base_style(active_par.par);
-    }
-    std::string current_run;
+} // namespace
 
-    std::string_view view = std::string_view{w.text}.substr(start, end);
-    assert(g_utf8_validate(view.data(), view.length(), nullptr));
-    size_t style_point = 0;
-    while(style_point < w.f.size() && w.f[style_point].offset < start) {
-        ++style_point;
-    }
-    for(size_t i = 0; i < view.size(); ++i) {
-        while(style_point < w.f.size() && w.f[style_point].offset == start + i) {
-            if(current_run.empty()) {
-                // Skip multiple style changes in a row.
-            } else {
-                word.runs.emplace_back(active_par, std::move(current_run));
-                current_run.clear();
+void SplitPointTable::build(const WordStore &words) {
+    kind.clear();
+    word_index.clear();
+    hyphen_index.clear();
+    offset.clear();
+    hyphen_type.clear();
+    style.clear();
+    const size_t expected_size = words.size() * 3;
+    kind.reserve(expected_size);
+    word_index.reserve(expected_size);
+    hyphen_index.reserve(expected_size);
+    offset.reserve(expected_size);
+    hyphen_type.reserve(expected_size);
+    style.reserve(expected_size);
+    auto add_point = [this](SplitKind k,
+                            size_t word,
+                            size_t hyphen,
+                            size_t byte_offset,
+                            SplitType type,
+                            const StyleStack &current_style) {
+        kind.push_back(k);
+        word_index.push_back(word);
+        hyphen_index.push_back(hyphen);
+        offset.push_back(byte_offset);
+        hyphen_type.push_back(type);
+        style.push_back(current_style);
+    };
+    for(size_t w = 0; w < words.size(); ++w) {
+        const auto &word = words[w];
+        add_point(SplitKind::BetweenWords, w, 0, 0, SplitType::NoHyphen, word.start_style);
+        // The text after a hyphen point starts with the byte after it.
+        // Formatting changes up to it are only replayed once per word.
+        StyleStack current_style = word.start_style;
+        size_t style_point = 0;
+        for(size_t h = 0; h < word.hyphen_points.size(); ++h) {
+            const auto &point = word.hyphen_points[h];
+            assert(h == 0 || word.hyphen_points[h - 1].loc < point.loc);
+            while(style_point < word.f.size() && word.f[style_point].offset <= point.loc) {
+                toggle_format(current_style, word.f[style_point].format);
+                ++style_point;
             }
-            toggle_format(sstack, w.f[style_point].format);
-            HBStyleApplier applier(sstack);
-            active_par = original_par;
-            applier.apply_to_base_style(active_par.par);
-            ++style_point;
+            add_point(SplitKind::WithinWord, w, h, point.loc, point.type, current_style);
         }
-        current_run += view[i];
     }
+    // The end sentinel
+    add_point(SplitKind::BetweenWords, words.size(), 0, 0, SplitType::NoHyphen, StyleStack{});
+}
 
-    if(add_dash) {
-        current_run += '-';
-    }
-    while(style_point < w.f.size()) {
-        toggle_format(sstack, w.f[style_point].format);
-        HBStyleApplier applier(sstack);
-        applier.apply_to_base_style(active_par.par);
-        ++style_point;
-    }
-    if(add_space) {
-        current_run += ' ';
+WordsOnLine SplitPointTable::words_for_splits(size_t from_split_ind, size_t to_split_ind) const {
+    WordsOnLine w;
+    if(within_word(from_split_ind)) {
+        w.first = WordStart{word_index[from_split_ind], offset[from_split_ind] + 1};
+        w.full_word_begin = word_index[from_split_ind] + 1;
+    } else {
+        w.full_word_begin = word_index[from_split_ind];
     }
-    if(!current_run.empty()) {
-        word.runs.emplace_back(active_par, std::move(current_run));
+
+    w.full_word_end = word_index[to_split_ind];
+    if(within_word(to_split_ind)) {
+        w.last =
+            WordEnd{word_index[to_split_ind], offset[to_split_ind] + 1, adds_dash(to_split_ind)};
     }
-    return word;
+    return w;
 }
 
-} // namespace
-
 PenaltyStatistics compute_stats(const std::vector<std::string> &lines,
                                 const Length paragraph_width,
                                 const HBChapterParameters &par,
@@ -244,20 +259,23 @@ PenaltyStatistics compute_stats(const std::vector<std::string> &lines,
                              compute_extra_penalties(lines, amounts)};
 }
 
-ParagraphFormatter::ParagraphFormatter(const std::vector<EnrichedWord> &words_,
+ParagraphFormatter::ParagraphFormatter(const WordStore &words_,
                                        const Length target_width,
                                        const HBChapterParameters &in_params,
                                        const ExtraPenaltyAmounts &ea,
-                                       HBFontCache &fc_)
-    : paragraph_width(target_width), words{words_}, params{in_params}, extras(ea), fc(fc_) {}
+                                       HBFontCache &fc_,
+                                       SplitAlgorithm alg,
+                                       const SearchLimits &limits_)
+    : paragraph_width(target_width), words{words_}, params{in_params}, extras(ea), fc(fc_),
+      algorithm(alg), limits{limits_} {}
 
 std::vector<std::string> ParagraphFormatter::split_lines() {
-    precompute();
     HBMeasurer shaper(fc, "fi");
+    precompute(shaper);
     best_penalty = 1e100;
     best_split.clear();
     if(false) {
-        best_split = simple_split(shaper);
+        best_split = simple_split();
         best_penalty = total_penalty(best_split);
         std::abort();
     } else {
@@ -265,20 +283,126 @@ std::vector<std::string> ParagraphFormatter::split_lines() {
     }
 }
 
+// With pending hyphenation the search starts without hyphen points and
+// notes the words that its line end choices may need. Those are hyphenated
+// and the search is run again until it needs no new ones. By then every
+// choice it made saw the same split points as it would have with every word
+// hyphenated, so the result is the same.
 std::vector<HBLine> ParagraphFormatter::split_formatted_lines() {
-    precompute();
     HBMeasurer shaper{fc, "fi"};
-    best_penalty = 1e100;
+    precompute_word_styles();
+    measure_words(shaper);
+    if(words.pending_hyphenation() != Language::Unset) {
+        use_hyphenation_of({});
+    }
+    std::vector<HBLine> lines;
+    do {
+        precompute_splits(shaper);
+        best_penalty = 1e100;
+        best_split.clear();
+        line_count_variants.clear();
+        budget = SearchBudget(limits);
+        lines = global_split_runs();
+    } while(hyphenate_line_end_words());
+    // Shaped here so that rendering does not need to do it again.
+    for(auto &line : lines) {
+        shaper.shape(line);
+    }
+    return lines;
+}
+
+std::vector<HBLine> ParagraphFormatter::split_formatted_lines(const ParagraphBreaking &breaking) {
+    HBMeasurer shaper{fc, "fi"};
+    const auto &line_ends = breaking.line_ends;
+    bool valid = true;
+    for(const auto w : breaking.hyphenated_words) {
+        valid = valid && w < words.size();
+    }
+    if(valid && words.pending_hyphenation() != Language::Unset) {
+        use_hyphenation_of(breaking.hyphenated_words);
+    }
+    precompute_word_styles();
+    compute_split_points();
+    precompute_split_styles();
+    valid = valid && !line_ends.empty() && line_ends.back() == split_points.size() - 1;
+    for(size_t i = 0; valid && i < line_ends.size(); ++i) {
+        valid = line_ends[i] > (i == 0 ? 0 : line_ends[i - 1]);
+    }
+    if(!valid) {
+        return split_formatted_lines();
+    }
     best_split.clear();
-    return global_split_runs(shaper);
+    line_count_variants.clear();
+    budget = SearchBudget(SearchLimits{});
+    for(const auto end_split : line_ends) {
+        best_split.emplace_back(LineStats{end_split, Length::zero(), false});
+    }
+    auto lines = stats_to_lines(best_split);
+    for(auto &line : lines) {
+        shaper.shape(line);
+    }
+    return lines;
+}
+
+std::vector<size_t> ParagraphFormatter::line_ends() const {
+    std::vector<size_t> ends;
+    ends.reserve(best_split.size());
+    for(const auto &line : best_split) {
+        ends.push_back(line.end_split);
+    }
+    return ends;
 }
 
-std::vector<LineStats> ParagraphFormatter::simple_split(HBMeasurer &shaper) {
+std::vector<ParagraphBreaking> ParagraphFormatter::breakings() const {
+    std::vector<ParagraphBreaking> result;
+    result.emplace_back(minimal_breaking(line_ends(), best_penalty));
+    for(const auto &variant : line_count_variants) {
+        result.emplace_back(minimal_breaking(variant.line_ends, variant.penalty));
+    }
+    return result;
+}
+
+// With pending hyphenation the line ends are moved to split points where
+// only the words that lines end within are hyphenated, so that they can be
+// rebuilt without searching again.
+ParagraphBreaking ParagraphFormatter::minimal_breaking(const std::vector<size_t> &ends,
+                                                       double penalty) const {
+    if(words.pending_hyphenation() == Language::Unset) {
+        return ParagraphBreaking{ends, penalty, {}};
+    }
+    ParagraphBreaking breaking{{}, penalty, {}};
+    auto &hyphenated_words = breaking.hyphenated_words;
+    for(const auto end : ends) {
+        const size_t word = split_points.word_index[end];
+        if(split_points.within_word(end) &&
+           (hyphenated_words.empty() || hyphenated_words.back() != word)) {
+            hyphenated_words.push_back(word);
+        }
+    }
+    size_t hyphen_points_before = 0;
+    size_t next_hyphenated = 0;
+    for(const auto end : ends) {
+        const size_t word = split_points.word_index[end];
+        while(next_hyphenated < hyphenated_words.size() &&
+              hyphenated_words[next_hyphenated] < word) {
+            hyphen_points_before += words[hyphenated_words[next_hyphenated]].hyphen_points.size();
+            ++next_hyphenated;
+        }
+        size_t minimal_end = word + hyphen_points_before;
+        if(split_points.within_word(end)) {
+            minimal_end += 1 + split_points.hyphen_index[end];
+        }
+        breaking.line_ends.push_back(minimal_end);
+    }
+    return breaking;
+}
+
+std::vector<LineStats> ParagraphFormatter::simple_split() {
     std::vector<LineStats> lines;
     std::vector<TextLocation> splits;
     size_t current_split = 0;
     while(current_split < split_points.size() - 1) {
-        auto line_end = get_closest_line_end(current_split, shaper, lines.size());
+        auto line_end = get_closest_line_end(current_split, lines.size());
         lines.emplace_back(line_end);
         current_split = line_end.end_split;
     }
@@ -287,6 +411,41 @@ std::vector<LineStats> ParagraphFormatter::simple_split(HBMeasurer &shaper) {
     return lines;
 }
 
+// Finishes a partial split one line at a time, always taking the line
+// that is cheapest on its own.
+std::vector<LineStats> ParagraphFormatter::complete_greedily(std::vector<LineStats> lines) const {
+    const size_t end_split = split_points.size() - 1;
+    size_t dashes = 0;
+    for(auto it = lines.rbegin(); it != lines.rend() && line_ends_in_dash(*it); ++it) {
+        ++dashes;
+    }
+    size_t current_split = lines.empty() ? 0 : lines.back().end_split;
+    while(current_split < end_split) {
+        const auto choices = get_line_end_choices(current_split, lines.size());
+        const Length line_width = current_line_width(lines.size());
+        auto cost = [&](const LineStats &line) {
+            double penalty = line_penalty(line, line_width);
+            if(line_ends_in_dash(line)) {
+                // The penalty of the dash run grows with every line added to it.
+                penalty += compute_dash_penalty(dashes + 1, extras.multiple_dashes) -
+                           compute_dash_penalty(dashes, extras.multiple_dashes);
+            }
+            return penalty;
+        };
+        auto chosen = choices.begin();
+        if(chosen->end_split != end_split) {
+            chosen = std::min_element(
+                choices.begin(), choices.end(), [&cost](const LineStats &a, const LineStats &b) {
+                    return cost(a) < cost(b);
+                });
+        }
+        dashes = line_ends_in_dash(*chosen) ? dashes + 1 : 0;
+        lines.push_back(*chosen);
+        current_split = chosen->end_split;
+    }
+    return lines;
+}
+
 std::vector<HBLine>
 ParagraphFormatter::stats_to_lines(const std::vector<LineStats> &linestats) const {
     std::vector<HBLine> lines;
@@ -305,13 +464,22 @@ Length ParagraphFormatter::current_line_width(size_t line_num) const {
     return paragraph_width;
 }
 
-std::vector<HBLine> ParagraphFormatter::global_split_runs(const HBMeasurer &shaper) {
-    std::vector<std::string> lines;
-    std::vector<TextLocation> splits;
-    size_t current_split = 0;
-    std::vector<LineStats> line_stats;
-
-    global_split_recursive(shaper, line_stats, current_split);
+std::vector<HBLine> ParagraphFormatter::global_split_runs() {
+    if(algorithm == SplitAlgorithm::Recursive) {
+        search_arena.clear();
+        search_arena.emplace_back(SearchNode{LineStats{0, Length::zero(), false}, 0, NO_NODE});
+        best_node = NO_NODE;
+        global_split_recursive(0, 0, 0, PathPenalty{});
+        if(best_node != NO_NODE) {
+            best_split = search_path(best_node);
+        } else {
+            // Ran out of budget before reaching the end.
+            best_split = complete_greedily({});
+            best_penalty = total_penalty(best_split, true);
+        }
+    } else {
+        global_split_dynamic();
+    }
     // printf("Total penalty: %.2f\n", best_penalty);
     // for(size_t i = 0; i < split_points.size(); ++i) {
     //    const auto line = build_line_text_debug(i, split_points.size() - 1);
@@ -320,133 +488,466 @@ std::vector<HBLine> ParagraphFormatter::global_split_runs(const HBMeasurer &shap
     return stats_to_lines(best_split);
 }
 
-void ParagraphFormatter::global_split_recursive(const HBMeasurer &shaper,
-                                                std::vector<LineStats> &line_stats,
-                                                size_t current_split) {
-    if(state_cache.abandon_search(line_stats, total_penalty(line_stats))) {
+// The node is the end of the path so far. Nodes are only appended to the
+// arena and a subtree is dropped once it is done unless the best path so
+// far is in it. Parents always come before their children.
+void ParagraphFormatter::global_split_recursive(size_t node,
+                                                size_t num_lines,
+                                                size_t current_split,
+                                                const PathPenalty &path) {
+    if(!budget.spend()) {
         return;
     }
-    auto line_end_choices = get_line_end_choices(current_split, shaper, line_stats.size());
+    if(state_cache.abandon_search(num_lines, search_arena[node].penalty)) {
+        return;
+    }
+    auto line_end_choices = get_line_end_choices(current_split, num_lines);
     if(line_end_choices.front().end_split == split_points.size() - 1) {
         // Text exhausted.
-        line_stats.emplace_back(line_end_choices.front());
-        const auto current_penalty = total_penalty(line_stats, true);
+        const auto &last_line = line_end_choices.front();
+        const auto last_path = extend_path(path, last_line, num_lines);
+        const auto end_penalty =
+            num_lines > 0 ? paragraph_end_penalty(current_split, last_line.end_split) : 0.0;
+        const auto current_penalty = total_penalty(last_path, end_penalty);
         // printf("Total penalty: %.1f\n", current_penalty);
         // FIXME: change to include extra penalties here.
         if(current_penalty < best_penalty) {
             best_penalty = current_penalty;
-            best_split = line_stats;
+            best_node = search_arena.size();
+            search_arena.emplace_back(SearchNode{last_line, current_penalty, node});
         }
-        line_stats.pop_back();
     } else {
         for(const auto &line_choice : line_end_choices) {
-            line_stats.emplace_back(line_choice);
-            current_split = line_choice.end_split;
-            const auto sanity_check = line_stats.size();
-            global_split_recursive(shaper, line_stats, current_split);
-            assert(sanity_check == line_stats.size());
-            line_stats.pop_back();
+            const auto next_path = extend_path(path, line_choice, num_lines);
+            const size_t child = search_arena.size();
+            search_arena.emplace_back(SearchNode{line_choice, total_penalty(next_path), node});
+            global_split_recursive(child, num_lines + 1, line_choice.end_split, next_path);
+            if(best_node == NO_NODE || best_node < child) {
+                search_arena.resize(child);
+            }
         }
     }
 }
 
+std::vector<LineStats> ParagraphFormatter::search_path(size_t node) const {
+    std::vector<LineStats> lines;
+    for(size_t i = node; i != 0; i = search_arena[i].parent) {
+        lines.push_back(search_arena[i].line);
+    }
+    std::reverse(lines.begin(), lines.end());
+    return lines;
+}
+
+// Every split point keeps the cheapest way of reaching it for each length of
+// the dash run ending there. The choices only ever move forward, so processing
+// split points in order visits every node after all of its predecessors. When
+// line count variants are wanted, nodes are also kept apart by the number of
+// lines before them, which gives the best breaking for every feasible line
+// count from the same pass. Only the first line has a different width, so
+// this does not change the best breaking.
+void ParagraphFormatter::global_split_dynamic() {
+    struct Ending {
+        double penalty;
+        size_t node;
+        LineStats last_line;
+    };
+    const size_t end_split = split_points.size() - 1;
+    std::vector<BreakNode> nodes;
+    std::vector<std::vector<size_t>> nodes_at(split_points.size());
+    nodes.emplace_back(BreakNode{0, 0, 0, size_t(-1), LineStats{0, Length::zero(), false}});
+    nodes_at[0].push_back(0);
+    std::unordered_map<BreakSlot, size_t> slots;
+    std::optional<Ending> best;
+    std::map<size_t, Ending> best_by_count;
+
+    size_t current_split = 0;
+    for(; current_split < end_split && !budget.exhausted(); ++current_split) {
+        for(const auto node_index : nodes_at[current_split]) {
+            budget.spend();
+            const BreakNode node = nodes[node_index];
+            const auto line_end_choices = get_line_end_choices(current_split, node.line_count);
+            const auto &front = line_end_choices.front();
+            if(front.end_split == end_split) {
+                // Text exhausted.
+                double total =
+                    node.penalty + compute_dash_penalty(node.dashes, extras.multiple_dashes);
+                if(params.indent_last_line) {
+                    total += line_penalty(front, current_line_width(node.line_count));
+                }
+                if(node.line_count > 0) {
+                    total += paragraph_end_penalty(current_split, end_split);
+                }
+                const Ending ending{total, node_index, front};
+                if(!best || total < best->penalty) {
+                    best = ending;
+                }
+                auto [it, inserted] = best_by_count.try_emplace(node.line_count + 1, ending);
+                if(!inserted && total < it->second.penalty) {
+                    it->second = ending;
+                }
+                continue;
+            }
+            const Length line_width = current_line_width(node.line_count);
+            for(const auto &line_choice : line_end_choices) {
+                BreakNode next{node.penalty + line_penalty(line_choice, line_width),
+                               0,
+                               node.line_count + 1,
+                               node_index,
+                               line_choice};
+                if(line_ends_in_dash(line_choice)) {
+                    next.dashes = node.dashes + 1;
+                } else {
+                    next.penalty += compute_dash_penalty(node.dashes, extras.multiple_dashes);
+                }
+                const BreakSlot slot{line_choice.end_split,
+                                     next.dashes,
+                                     find_line_count_variants ? next.line_count : 0};
+                auto [it, inserted] = slots.try_emplace(slot, nodes.size());
+                if(inserted) {
+                    nodes_at[line_choice.end_split].push_back(nodes.size());
+                    nodes.emplace_back(std::move(next));
+                } else if(next.penalty < nodes[it->second].penalty) {
+                    nodes[it->second] = std::move(next);
+                }
+            }
+        }
+    }
+    auto trace_node = [&nodes](size_t node) {
+        std::vector<LineStats> lines;
+        for(size_t i = node; i != 0; i = nodes[i].previous) {
+            lines.push_back(nodes[i].line);
+        }
+        std::reverse(lines.begin(), lines.end());
+        return lines;
+    };
+    auto trace = [&trace_node](const Ending &ending) {
+        auto lines = trace_node(ending.node);
+        lines.push_back(ending.last_line);
+        return lines;
+    };
+    while(current_split < end_split && nodes_at[current_split].empty()) {
+        ++current_split;
+    }
+    if(current_split < end_split) {
+        // Out of budget. Finish the cheapest unexpanded break greedily.
+        const auto &candidates = nodes_at[current_split];
+        auto pending = [&](size_t i) {
+            return nodes[i].penalty + compute_dash_penalty(nodes[i].dashes, extras.multiple_dashes);
+        };
+        const auto cheapest =
+            *std::min_element(candidates.begin(), candidates.end(), [&pending](size_t a, size_t b) {
+                return pending(a) < pending(b);
+            });
+        best_split = complete_greedily(trace_node(cheapest));
+        best_penalty = total_penalty(best_split, true);
+        if(best && best->penalty <= best_penalty) {
+            best_penalty = best->penalty;
+            best_split = trace(*best);
+        }
+        return;
+    }
+    assert(best);
+    best_penalty = best->penalty;
+    best_split = trace(*best);
+    if(!find_line_count_variants) {
+        return;
+    }
+    for(const auto line_count : {best_split.size() - 1, best_split.size() + 1}) {
+        auto it = best_by_count.find(line_count);
+        if(it == best_by_count.end()) {
+            continue;
+        }
+        ParagraphBreaking variant{{}, it->second.penalty, {}};
+        for(const auto &line : trace(it->second)) {
+            variant.line_ends.push_back(line.end_split);
+        }
+        line_count_variants.emplace_back(std::move(variant));
+    }
+}
+
 double ParagraphFormatter::paragraph_end_penalty(const std::vector<LineStats> &lines) const {
     if(lines.size() < 2) {
         return 0;
     }
-    const auto &last_split_var = split_points[lines[lines.size() - 1].end_split];
-    const auto &penultimate_split_var = split_points[lines[lines.size() - 2].end_split];
-    assert(std::holds_alternative<BetweenWordSplit>(last_split_var));
-    const auto &last_split = std::get<BetweenWordSplit>(last_split_var);
-    assert(last_split.word_index ==
-           words.size()); // The last one is a sentinel that points one-past-the-end.
-    if(std::holds_alternative<BetweenWordSplit>(penultimate_split_var)) {
-        const auto &penultimate_split = std::get<BetweenWordSplit>(penultimate_split_var);
-        if(penultimate_split.word_index + 1 == last_split.word_index) {
-            return extras.single_word_line;
-        }
-    } else {
-        const auto &penultimate_split = std::get<WithinWordSplit>(penultimate_split_var);
-        if(penultimate_split.word_index + 1 == last_split.word_index) {
-            return extras.single_split_word_line;
-        }
+    return paragraph_end_penalty(lines[lines.size() - 2].end_split,
+                                 lines[lines.size() - 1].end_split);
+}
+
+double ParagraphFormatter::paragraph_end_penalty(size_t penultimate_split_ind,
+                                                 size_t last_split_ind) const {
+    assert(!split_points.within_word(last_split_ind));
+    const auto last_word = split_points.word_index[last_split_ind];
+    assert(last_word == words.size()); // The last one is a sentinel that points one-past-the-end.
+    if(split_points.word_index[penultimate_split_ind] + 1 == last_word) {
+        return split_points.within_word(penultimate_split_ind) ? extras.single_split_word_line
+                                                                : extras.single_word_line;
     }
     return 0.0;
 }
 
 double ParagraphFormatter::total_penalty(const std::vector<LineStats> &lines,
                                          bool is_complete) const {
-    double total = 0;
-    double last_line_penalty = 0;
-    size_t line_number = 0;
-    for(const auto &l : lines) {
-        last_line_penalty = line_penalty(l, current_line_width(line_number));
-        total += last_line_penalty;
-        ++line_number;
-    }
-    const auto line_penalty = params.indent_last_line ? total : total - last_line_penalty;
-    const auto extra_penalties = compute_multihyphen_penalties(lines, extras);
-    auto extra_penalty = std::accumulate(
-        extra_penalties.begin(),
-        extra_penalties.end(),
-        0.0,
-        [](double i, const ExtraPenaltyStatistics &stats) { return i + stats.penalty; });
-    if(is_complete) {
-        extra_penalty += paragraph_end_penalty(lines);
+    PathPenalty path;
+    for(size_t line_number = 0; line_number < lines.size(); ++line_number) {
+        path = extend_path(path, lines[line_number], line_number);
+    }
+    return total_penalty(path, is_complete ? paragraph_end_penalty(lines) : 0.0);
+}
+
+PathPenalty ParagraphFormatter::extend_path(const PathPenalty &path,
+                                            const LineStats &line,
+                                            size_t line_num) const {
+    PathPenalty next = path;
+    next.last_line = line_penalty(line, current_line_width(line_num));
+    next.lines += next.last_line;
+    if(line_ends_in_dash(line)) {
+        ++next.dashes;
+    } else {
+        next.dash_runs += compute_dash_penalty(path.dashes, extras.multiple_dashes);
+        next.dashes = 0;
     }
+    return next;
+}
+
+// The end penalty is only added once the paragraph is complete.
+double ParagraphFormatter::total_penalty(const PathPenalty &path, double end_penalty) const {
+    const auto line_penalty = params.indent_last_line ? path.lines : path.lines - path.last_line;
+    auto extra_penalty =
+        path.dash_runs + compute_dash_penalty(path.dashes, extras.multiple_dashes);
+    extra_penalty += end_penalty;
     return line_penalty + extra_penalty;
 }
 
-void ParagraphFormatter::precompute() {
-    split_points.clear();
-    split_points.reserve(words.size() * 3);
-    for(size_t word_index = 0; word_index < words.size(); ++word_index) {
-        split_points.emplace_back(BetweenWordSplit{word_index});
-        for(size_t hyphen_index = 0; hyphen_index < words[word_index].hyphen_points.size();
-            ++hyphen_index) {
-            split_points.emplace_back(WithinWordSplit{word_index, hyphen_index});
-        }
+void ParagraphFormatter::precompute(const HBMeasurer &shaper) {
+    precompute_word_styles();
+    measure_words(shaper);
+    precompute_splits(shaper);
+}
+
+void ParagraphFormatter::precompute_splits(const HBMeasurer &shaper) {
+    compute_split_points();
+    precompute_split_styles();
+    measure_splits(shaper);
+    closest_line_ends.clear();
+    state_cache.clear();
+    for(size_t i = 0; i < split_points.size(); ++i) {
+        state_cache.best_to.emplace_back(std::vector<UpTo>{});
     }
-    split_points.emplace_back(BetweenWordSplit{words.size()}); // The end sentinel
+}
+
+void ParagraphFormatter::compute_split_points() {
+    split_points.build(words);
     // printf("The text has a total of %d words and %d split points.\n\n",
     //        (int)words.size(),
     //        (int)split_points.size());
-    split_locations.clear();
-    split_locations.reserve(split_points.size());
-    for(const auto &i : split_points) {
-        split_locations.emplace_back(point_to_location(i));
+}
+
+// Hyphen points are computed at most once per word, even if the word is
+// hyphenated again for another breaking.
+void ParagraphFormatter::use_hyphenation_of(const std::vector<size_t> &hyphenated_words) {
+    const auto lang = words.pending_hyphenation();
+    if(hyphenated.size() != words.size()) {
+        hyphenated.assign(words.size(), false);
+        lazy_hyphens.assign(words.size(), {});
     }
-    assert(split_points.size() == split_locations.size());
-    state_cache.clear();
-    for(size_t i = 0; i < split_points.size(); ++i) {
-        state_cache.best_to.emplace_back(std::vector<UpTo>{});
+    hyphenation_used.assign(words.size(), false);
+    line_end_words.assign(words.size(), false);
+    for(const auto w : hyphenated_words) {
+        if(!hyphenated[w] && hyphenator) {
+            lazy_hyphens[w] = hyphenator->hyphenate(std::string{words[w].text}, lang);
+        }
+        hyphenated[w] = true;
+        hyphenation_used[w] = true;
     }
+    std::vector<std::vector<HyphenPoint>> points(words.size());
+    for(size_t w = 0; w < words.size(); ++w) {
+        if(hyphenation_used[w]) {
+            points[w] = lazy_hyphens[w];
+        }
+    }
+    words.set_hyphen_points(points);
 }
 
-WordsOnLine ParagraphFormatter::words_for_splits(size_t from_split_ind, size_t to_split_ind) const {
-    WordsOnLine w;
-    const auto &from_split = split_points[from_split_ind];
-    const auto &to_split = split_points[to_split_ind];
-    const auto &from_loc = split_locations[from_split_ind];
-    const auto &to_loc = split_locations[to_split_ind];
-
-    if(std::holds_alternative<WithinWordSplit>(from_split)) {
-        w.first = WordStart{from_loc.word_index, from_loc.offset + 1};
-        w.full_word_begin = from_loc.word_index + 1;
-    } else {
-        w.full_word_begin = from_loc.word_index;
+// Returns true if there were words to hyphenate, in which case the split
+// points need to be recomputed.
+bool ParagraphFormatter::hyphenate_line_end_words() {
+    if(std::find(line_end_words.begin(), line_end_words.end(), true) == line_end_words.end()) {
+        return false;
+    }
+    std::vector<size_t> hyphenated_words;
+    for(size_t w = 0; w < words.size(); ++w) {
+        if(hyphenation_used[w] || line_end_words[w]) {
+            hyphenated_words.push_back(w);
+        }
     }
+    use_hyphenation_of(hyphenated_words);
+    return true;
+}
 
-    w.full_word_end = to_loc.word_index;
-    if(std::holds_alternative<WithinWordSplit>(to_split)) {
-        const auto &fs = std::get<WithinWordSplit>(to_split);
+// The choices from a start split only depend on the words from the one the
+// start is in to the one the tightest line ends in, or on the last four of
+// them if there are more. With all of those hyphenated the choices are
+// the same as with every word hyphenated. The rest of the line is made of
+// full words with at least four split points in it either way.
+void ParagraphFormatter::note_line_end_words(size_t start_split, size_t tightest_split) const {
+    if(words.pending_hyphenation() == Language::Unset) {
+        return;
+    }
+    const size_t last = split_points.word_index[tightest_split];
+    const size_t first =
+        std::max(size_t(split_points.word_index[start_split]), last < 3 ? 0 : last - 3);
+    for(size_t w = first; w <= last && w < words.size(); ++w) {
+        if(!hyphenation_used[w]) {
+            line_end_words[w] = true;
+        }
+    }
+}
 
-        w.last =
-            WordEnd{fs.word_index,
-                    to_loc.offset + 1,
-                    words[fs.word_index].hyphen_points[fs.hyphen_index].type == SplitType::Regular};
+void ParagraphFormatter::precompute_split_styles() {
+    split_pars.clear();
+    split_pars.reserve(split_points.size());
+    for(const auto &style : split_points.style) {
+        HBTextParameters par = params.font;
+        HBStyleApplier applier(style);
+        applier.apply_to_base_style(par.par);
+        split_pars.push_back(par);
     }
-    return w;
+}
+
+void ParagraphFormatter::precompute_word_styles() {
+    auto resolve = [this](const StyleStack &style) {
+        HBTextParameters par = params.font;
+        HBStyleApplier applier(style);
+        applier.apply_to_base_style(par.par);
+        return par;
+    };
+    word_pars.clear();
+    change_pars.clear();
+    first_change.clear();
+    word_pars.reserve(words.size());
+    first_change.reserve(words.size() + 1);
+    for(size_t i = 0; i < words.size(); ++i) {
+        const auto w = words[i];
+        word_pars.push_back(resolve(w.start_style));
+        first_change.push_back(change_pars.size());
+        StyleStack style = w.start_style;
+        for(const auto &change : w.f) {
+            toggle_format(style, change.format);
+            change_pars.push_back(resolve(style));
+        }
+    }
+    first_change.push_back(change_pars.size());
+}
+
+// The text from start to end of a word, split into runs at formatting changes.
+HBWord ParagraphFormatter::word_fragment(size_t word_index,
+                                         const HBTextParameters &start_par,
+                                         size_t start,
+                                         size_t end,
+                                         bool add_space,
+                                         bool add_dash) const {
+    const auto &w = words[word_index];
+    const HBTextParameters *active_par = &start_par;
+    const std::string_view view = std::string_view{w.text}.substr(start, end);
+    assert(g_utf8_validate(view.data(), view.length(), nullptr));
+    HBWord word;
+    size_t style_point = 0;
+    while(style_point < w.f.size() && w.f[style_point].offset < start) {
+        ++style_point;
+    }
+    size_t run_start = 0;
+    for(; style_point < w.f.size() && w.f[style_point].offset < start + view.size();
+        ++style_point) {
+        const size_t change_at = w.f[style_point].offset - start;
+        if(change_at > run_start) {
+            // Multiple style changes in a row only end one run.
+            word.runs.emplace_back(*active_par,
+                                   std::string{view.substr(run_start, change_at - run_start)});
+            run_start = change_at;
+        }
+        active_par = &change_pars[first_change[word_index] + style_point];
+    }
+    std::string current_run{view.substr(run_start)};
+    if(add_dash) {
+        current_run += '-';
+    }
+    if(add_space) {
+        current_run += ' ';
+    }
+    if(!current_run.empty()) {
+        word.runs.emplace_back(*active_par, std::move(current_run));
+    }
+    return word;
+}
+
+void ParagraphFormatter::measure_words(const HBMeasurer &shaper) {
+    auto fragment_width = [this, &shaper](size_t word_index, bool add_space) {
+        return shaper.text_width(word_fragment(
+            word_index, word_pars[word_index], 0, std::string::npos, add_space, false));
+    };
+    word_widths.clear();
+    spaced_word_widths.clear();
+    spaced_width_sums.clear();
+    word_widths.reserve(words.size());
+    spaced_word_widths.reserve(words.size());
+    spaced_width_sums.reserve(words.size() + 1);
+    spaced_width_sums.push_back(Length::zero());
+    for(size_t w = 0; w < words.size(); ++w) {
+        word_widths.push_back(fragment_width(w, false));
+        spaced_word_widths.push_back(fragment_width(w, true));
+        spaced_width_sums.push_back(spaced_width_sums.back() + spaced_word_widths.back());
+    }
+}
+
+void ParagraphFormatter::measure_splits(const HBMeasurer &shaper) {
+    auto fragment_width = [this, &shaper](size_t word_index,
+                                          const HBTextParameters &start_par,
+                                          size_t start,
+                                          size_t end,
+                                          bool add_space,
+                                          bool add_dash) {
+        return shaper.text_width(
+            word_fragment(word_index, start_par, start, end, add_space, add_dash));
+    };
+    head_widths.assign(split_points.size(), Length::zero());
+    tail_widths.assign(split_points.size(), Length::zero());
+    for(size_t i = 0; i < split_points.size(); ++i) {
+        if(!split_points.within_word(i)) {
+            continue;
+        }
+        const auto offset = split_points.offset[i];
+        const auto w = split_points.word_index[i];
+        head_widths[i] =
+            fragment_width(w, word_pars[w], 0, offset + 1, false, split_points.adds_dash(i));
+        tail_widths[i] =
+            fragment_width(w, split_pars[i], offset + 1, std::string::npos, true, false);
+    }
+}
+
+// Equal to measuring build_line_words_runs(from_split_ind, to_split_ind) but
+// only uses the precomputed widths.
+Length ParagraphFormatter::line_width(size_t from_split_ind, size_t to_split_ind) const {
+    if(from_split_ind == to_split_ind) {
+        return Length::zero();
+    }
+    const WordsOnLine line_words = words_for_splits(from_split_ind, to_split_ind);
+    Length width;
+    if(line_words.first) {
+        width += tail_widths[from_split_ind];
+    }
+    if(line_words.full_word_begin < line_words.full_word_end) {
+        const auto last_full = line_words.full_word_end - 1;
+        width += spaced_width_sums[last_full] - spaced_width_sums[line_words.full_word_begin];
+        width += line_words.last ? spaced_word_widths[last_full] : word_widths[last_full];
+    }
+    if(line_words.last) {
+        width += head_widths[to_split_ind];
+    }
+    return width;
+}
+
+WordsOnLine ParagraphFormatter::words_for_splits(size_t from_split_ind, size_t to_split_ind) const {
+    return split_points.words_for_splits(from_split_ind, to_split_ind);
 }
 
 std::string ParagraphFormatter::build_line_text_debug(size_t from_split_ind,
@@ -479,104 +980,64 @@ std::string ParagraphFormatter::build_line_text_debug(size_t from_split_ind,
     return result;
 }
 
-StyleStack ParagraphFormatter::determine_style(TextLocation t) const {
-    const auto &current_word = words[t.word_index];
-    StyleStack style = words[t.word_index].start_style;
-    size_t i = 0;
-    size_t style_point = 0;
-    std::string dummy;
-    while(i < t.offset) {
-        while(style_point < current_word.f.size() && current_word.f[style_point].offset == i) {
-            toggle_format(style, current_word.f[style_point].format);
-            ++style_point;
-        }
-        ++i;
-    }
-    return style;
-}
-
-TextLocation ParagraphFormatter::point_to_location(const SplitPoint &p) const {
-    if(std::holds_alternative<BetweenWordSplit>(p)) {
-        const auto &r = std::get<BetweenWordSplit>(p);
-        return TextLocation{r.word_index, 0};
-    } else if(std::holds_alternative<WithinWordSplit>(p)) {
-        const auto &r = std::get<WithinWordSplit>(p);
-        return TextLocation{r.word_index, words[r.word_index].hyphen_points[r.hyphen_index].loc};
-    } else {
-        assert(false);
-    }
-}
-
-LineStats ParagraphFormatter::get_closest_line_end(size_t start_split,
-                                                   const HBMeasurer &shaper,
-                                                   size_t line_num) const {
+LineStats ParagraphFormatter::get_closest_line_end(size_t start_split, size_t line_num) const {
     auto f = closest_line_ends.find(start_split);
     if(f != closest_line_ends.end()) {
         return f->second;
     }
-    auto val = compute_closest_line_end(start_split, shaper, line_num);
+    auto val = compute_closest_line_end(start_split, line_num);
     closest_line_ends[start_split] = val;
     return val;
 }
 
 LineStats ParagraphFormatter::compute_closest_line_end(size_t start_split,
-                                                       const HBMeasurer &shaper,
                                                        size_t line_num) const {
     assert(start_split < split_points.size() - 1);
     const Length target_line_width_mm = current_line_width(line_num);
-    size_t chosen_point = -1;
-    auto ppoint = std::partition_point(
-        split_points.begin() + start_split + 2,
-        split_points.end(),
-        [this, &shaper, start_split, target_line_width_mm](const SplitPoint &p) {
-            const auto loc = &p - split_points.data();
-            const auto trial_line = build_line_words_runs(start_split, loc);
-            const auto trial_width = shaper.text_width(trial_line);
-            return trial_width <= target_line_width_mm;
+    size_t chosen_point = split_points.first_not_fitting(
+        start_split + 2, [this, start_split, target_line_width_mm](size_t end_split) {
+            return line_width(start_split, end_split) <= target_line_width_mm;
         });
-    if(ppoint == split_points.end()) {
+    if(chosen_point == split_points.size()) {
         chosen_point = split_points.size() - 1;
     } else {
-        --ppoint; // We want the last point that satisfies the constraint rather than the first
-                  // which does not.
-        chosen_point = size_t(&(*ppoint) - split_points.data());
+        --chosen_point; // We want the last point that satisfies the constraint rather than the
+                        // first which does not.
     }
 
-    const auto final_line = build_line_words_runs(start_split, chosen_point);
-    const auto final_width = shaper.text_width(final_line);
+    const auto final_width = line_width(start_split, chosen_point);
     // FIXME, check whether the word ends in a dash.
-    return LineStats{chosen_point,
-                     final_width,
-                     std::holds_alternative<WithinWordSplit>(split_points[chosen_point])};
+    return LineStats{chosen_point, final_width, split_points.within_word(chosen_point)};
 }
 
 // Sorted by decreasing fitness.
 std::vector<LineStats> ParagraphFormatter::get_line_end_choices(size_t start_split,
-                                                                const HBMeasurer &shaper,
                                                                 size_t line_num) const {
     std::vector<LineStats> potentials;
     potentials.reserve(5);
-    auto tightest_split = get_closest_line_end(start_split, shaper, line_num);
+    auto tightest_split = get_closest_line_end(start_split, line_num);
     potentials.push_back(tightest_split);
+    if(tightest_split.end_split == split_points.size() - 1) {
+        // The rest of the text fits on this line and the other choices are
+        // never used.
+        return potentials;
+    }
+    note_line_end_words(start_split, tightest_split.end_split);
 
     bool word_split_seen = false;
     // Lambdas, yo!
     auto check_word_split = [&word_split_seen, this](size_t split_point) {
-        if(std::holds_alternative<BetweenWordSplit>(split_points[split_point])) {
+        if(!split_points.within_word(split_point)) {
             word_split_seen = true;
         }
     };
     check_word_split(tightest_split.end_split);
     auto add_point = [&](size_t split_point) {
         const auto trial_split = split_point;
-        const auto trial_line = build_line_words_runs(start_split, trial_split);
-        const auto trial_width = shaper.text_width(trial_line);
+        const auto trial_width = line_width(start_split, trial_split);
+        // FIXME, check if word ends with a dash character.
         potentials.emplace_back(
-            LineStats{trial_split,
-                      trial_width,
-                      std::holds_alternative<WithinWordSplit>(
-                          split_points[trial_split])}); // FIXME, check if word ends with a dash
-                                                        // character.
+            LineStats{trial_split, trial_width, split_points.within_word(trial_split)});
     };
 
     if(tightest_split.end_split > start_split + 2) {
@@ -607,7 +1068,7 @@ std::vector<LineStats> ParagraphFormatter::get_line_end_choices(size_t start_spl
         if(tightest_split.end_split > 3) {
             size_t i = tightest_split.end_split - 3;
             while(i > start_split) {
-                if(std::holds_alternative<BetweenWordSplit>(split_points[i])) {
+                if(!split_points.within_word(i)) {
                     add_point(i);
                     break;
                 }
@@ -618,14 +1079,12 @@ std::vector<LineStats> ParagraphFormatter::get_line_end_choices(size_t start_spl
     return potentials;
 }
 
-bool SplitStates::abandon_search(const std::vector<LineStats> &new_splits,
-                                 const double new_penalty) {
-    const auto current_index = new_splits.size();
-    auto &current_slot = best_to[current_index];
+bool SplitStates::abandon_search(size_t num_lines, const double new_penalty) {
+    auto &current_slot = best_to[num_lines];
     if(current_slot.size() >= cache_size && current_slot.back().penalty < new_penalty) {
         return true;
     }
-    UpTo new_value{new_penalty, new_splits};
+    UpTo new_value{new_penalty};
     auto insertion_point = std::lower_bound(current_slot.begin(), current_slot.end(), new_value);
     current_slot.insert(insertion_point, std::move(new_value));
     while(current_slot.size() > cache_size) {
@@ -641,35 +1100,26 @@ HBLine ParagraphFormatter::build_line_words_runs(size_t from_split_ind, size_t t
     }
 
     const WordsOnLine line_words = words_for_splits(from_split_ind, to_split_ind);
-    const auto &from_loc = split_locations[from_split_ind];
-
-    StyleStack current_style = determine_style(from_loc);
-
     if(line_words.first) {
-        auto new_word = wordfragment2runs(params.font,
-                                          current_style,
-                                          words[line_words.first->word],
-                                          line_words.first->from_bytes,
-                                          std::string::npos,
-                                          true,
-                                          false);
-        line.words.push_back(std::move(new_word));
+        line.words.push_back(word_fragment(line_words.first->word,
+                                           split_pars[from_split_ind],
+                                           line_words.first->from_bytes,
+                                           std::string::npos,
+                                           true,
+                                           false));
     }
     for(size_t i = line_words.full_word_begin; i < line_words.full_word_end; ++i) {
         const bool add_space = i + 1 != line_words.full_word_end || line_words.last;
-        auto new_word = wordfragment2runs(
-            params.font, current_style, words[i], 0, std::string::npos, add_space, false);
-        line.words.push_back(std::move(new_word));
+        line.words.push_back(
+            word_fragment(i, word_pars[i], 0, std::string::npos, add_space, false));
     }
     if(line_words.last) {
-        auto new_word = wordfragment2runs(params.font,
-                                          current_style,
-                                          words[line_words.last->word],
-                                          0,
-                                          line_words.last->to_bytes,
-                                          false,
-                                          line_words.last->add_dash);
-        line.words.push_back(std::move(new_word));
+        line.words.push_back(word_fragment(line_words.last->word,
+                                           word_pars[line_words.last->word],
+                                           0,
+                                           line_words.last->to_bytes,
+                                           false,
+                                           line_words.last->add_dash));
     }
     return line;
 }
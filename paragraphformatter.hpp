@@ -21,9 +21,10 @@
 #include <wordhyphenator.hpp>
 #include <formatting.hpp>
 #include <hbfontcache.hpp>
+#include <searchbudget.hpp>
 #include <utils.hpp>
-#include <variant>
 #include <optional>
+#include <unordered_map>
 
 class TextStats;
 
@@ -48,15 +49,6 @@ class TextStats;
 
 // clang-format on
 
-struct BetweenWordSplit {
-    size_t word_index;
-};
-
-struct WithinWordSplit {
-    size_t word_index;
-    size_t hyphen_index;
-};
-
 struct TextLocation {
     size_t word_index;
     size_t offset; // in characters
@@ -71,7 +63,6 @@ struct LineStats {
 
 struct UpTo {
     double penalty;
-    std::vector<LineStats> splits;
 
     bool operator<(const UpTo &o) const { return penalty < o.penalty; }
 };
@@ -94,13 +85,104 @@ struct WordsOnLine {
     std::optional<WordEnd> last;
 };
 
+enum class SplitKind : uint8_t {
+    BetweenWords,
+    WithinWord,
+};
+
+// All split points of a paragraph, stored as parallel arrays so that the
+// line breakers can look them up without going through variants. The last
+// entry is a sentinel between words that points one past the last word.
+class SplitPointTable {
+public:
+    void build(const WordStore &words);
+
+    size_t size() const { return kind.size(); }
+    bool within_word(size_t i) const { return kind[i] == SplitKind::WithinWord; }
+    // Splits within words that need a dash at the end of the line.
+    bool adds_dash(size_t i) const {
+        return within_word(i) && hyphen_type[i] == SplitType::Regular;
+    }
+    TextLocation location(size_t i) const { return TextLocation{word_index[i], offset[i]}; }
+    WordsOnLine words_for_splits(size_t from_split_ind, size_t to_split_ind) const;
+
+    // Binary search for the first split point from begin on for which
+    // fits returns false. Lines only get longer, so the points are
+    // partitioned by it. Returns size() if every point fits.
+    template<typename F> size_t first_not_fitting(size_t begin, F &&fits) const {
+        size_t end = size();
+        while(begin < end) {
+            const size_t middle = begin + (end - begin) / 2;
+            if(fits(middle)) {
+                begin = middle + 1;
+            } else {
+                end = middle;
+            }
+        }
+        return begin;
+    }
+
+    std::vector<SplitKind> kind;
+    std::vector<uint32_t> word_index;
+    std::vector<uint32_t> hyphen_index; // Zero for splits between words.
+    std::vector<uint32_t> offset;       // Of the hyphen point, zero for splits between words.
+    std::vector<SplitType> hyphen_type;
+    std::vector<StyleStack> style; // Formatting of the text right after the split.
+};
+
 struct SplitStates {
     size_t cache_size = 12;
     std::vector<std::vector<UpTo>> best_to;
 
     void clear() { best_to.clear(); }
 
-    bool abandon_search(const std::vector<LineStats> &new_splits, const double new_penalty);
+    bool abandon_search(size_t num_lines, const double new_penalty);
+};
+
+// A line break reached by the recursive splitter. The path to it is found
+// by following the parents.
+struct SearchNode {
+    LineStats line; // The line that ends at this node.
+    double penalty; // Of the path up to and including the line.
+    size_t parent;
+};
+
+// Penalty of a partial split, updated one line at a time so that the
+// recursive splitter does not need to go through all earlier lines again.
+struct PathPenalty {
+    double lines = 0;     // Sum of line penalties.
+    double last_line = 0; // Penalty of the latest line.
+    double dash_runs = 0; // Penalties of completed dash runs.
+    size_t dashes = 0;    // Length of the dash run at the end.
+};
+
+// A line break reached by the dynamic programming splitter.
+struct BreakNode {
+    double penalty; // Line penalties plus penalties of completed dash runs.
+    size_t dashes;  // Number of consecutive lines ending in a dash, including this one.
+    size_t line_count;
+    size_t previous; // Index of the preceding node, -1 for the paragraph start.
+    LineStats line;  // The line that ends at this node.
+};
+
+// Identifies the one node that the dynamic programming splitter keeps for
+// each state at a split point.
+struct BreakSlot {
+    size_t split;
+    size_t dashes;
+    size_t line_count; // Zero unless line counts are kept apart.
+
+    bool operator==(const BreakSlot &o) const noexcept = default;
+};
+
+template<> struct std::hash<BreakSlot> {
+    std::size_t operator()(BreakSlot const &s) const noexcept {
+        const size_t shuffle = 13;
+        size_t hashvalue = std::hash<size_t>{}(s.split);
+        hashvalue = hashvalue * shuffle + std::hash<size_t>{}(s.dashes);
+        hashvalue = hashvalue * shuffle + std::hash<size_t>{}(s.line_count);
+        return hashvalue;
+    }
 };
 
 struct LinePenaltyStatistics {
@@ -108,8 +190,6 @@ struct LinePenaltyStatistics {
     double penalty;
 };
 
-typedef std::variant<BetweenWordSplit, WithinWordSplit> SplitPoint;
-
 struct PenaltyStatistics {
     std::vector<LinePenaltyStatistics> lines;
     std::vector<ExtraPenaltyStatistics> extras;
@@ -122,56 +202,127 @@ PenaltyStatistics compute_stats(const std::vector<std::string> &lines,
 
 class ParagraphFormatter {
 public:
-    ParagraphFormatter(const std::vector<EnrichedWord> &words,
+    ParagraphFormatter(const WordStore &words,
                        const Length target_width,
                        const HBChapterParameters &in_params,
                        const ExtraPenaltyAmounts &ea,
-                       HBFontCache &fc_);
+                       HBFontCache &fc_,
+                       SplitAlgorithm alg = SplitAlgorithm::Dynamic,
+                       const SearchLimits &limits_ = SearchLimits{});
 
     std::vector<std::string> split_lines();
     std::vector<HBLine> split_formatted_lines();
+    // Rebuilds the result of an earlier split_formatted_lines from one of its
+    // breakings. Splits the text again if it does not fit the text.
+    std::vector<HBLine> split_formatted_lines(const ParagraphBreaking &breaking);
+
+    // Split point indices where the lines of the last result end.
+    std::vector<size_t> line_ends() const;
+    // The last result followed by the best breakings with one line less and
+    // one line more, if the dynamic splitter found them.
+    std::vector<ParagraphBreaking> breakings() const;
 
     double paragraph_end_penalty(const std::vector<LineStats> &lines) const;
 
+    // True if the last search ran out of budget and its result may not be optimal.
+    bool budget_limited() const { return budget.exhausted(); }
+
+    // Used for words that are pending hyphenation. Without one they are
+    // not hyphenated at all. Only the words that the line breaker may end a
+    // line within are hyphenated, but the result is the same as if all of
+    // them were.
+    void set_hyphenator(const WordHyphenator *hyph) { hyphenator = hyph; }
+
+    // Makes the dynamic splitter also find the breakings with one line less
+    // and one line more. This costs more, so it is off by default.
+    void set_line_count_variants(bool enabled) { find_line_count_variants = enabled; }
+
 private:
-    void precompute();
-    TextLocation point_to_location(const SplitPoint &p) const;
-    LineStats
-    get_closest_line_end(size_t start_split, const HBMeasurer &shaper, size_t line_num) const;
-    LineStats
-    compute_closest_line_end(size_t start_split, const HBMeasurer &shaper, size_t line_num) const;
-
-    std::vector<LineStats>
-    get_line_end_choices(size_t start_split, const HBMeasurer &shaper, size_t line_num) const;
-
-    std::vector<LineStats> simple_split(HBMeasurer &shaper);
-    std::vector<HBLine> global_split_runs(const HBMeasurer &shaper);
-    void global_split_recursive(const HBMeasurer &shaper,
-                                std::vector<LineStats> &line_stats,
-                                size_t split_pos);
+    void precompute(const HBMeasurer &shaper);
+    void precompute_splits(const HBMeasurer &shaper);
+    void compute_split_points();
+    void use_hyphenation_of(const std::vector<size_t> &hyphenated_words);
+    bool hyphenate_line_end_words();
+    void note_line_end_words(size_t start_split, size_t tightest_split) const;
+    ParagraphBreaking minimal_breaking(const std::vector<size_t> &ends, double penalty) const;
+    void precompute_word_styles();
+    void precompute_split_styles();
+    void measure_words(const HBMeasurer &shaper);
+    void measure_splits(const HBMeasurer &shaper);
+    HBWord word_fragment(size_t word_index,
+                         const HBTextParameters &start_par,
+                         size_t start,
+                         size_t end,
+                         bool add_space,
+                         bool add_dash) const;
+    LineStats get_closest_line_end(size_t start_split, size_t line_num) const;
+    LineStats compute_closest_line_end(size_t start_split, size_t line_num) const;
+
+    std::vector<LineStats> get_line_end_choices(size_t start_split, size_t line_num) const;
+
+    std::vector<LineStats> simple_split();
+    std::vector<LineStats> complete_greedily(std::vector<LineStats> lines) const;
+    std::vector<HBLine> global_split_runs();
+    void global_split_recursive(size_t node,
+                                size_t num_lines,
+                                size_t split_pos,
+                                const PathPenalty &path);
+    std::vector<LineStats> search_path(size_t node) const;
+    void global_split_dynamic();
+    double paragraph_end_penalty(size_t penultimate_split_ind, size_t last_split_ind) const;
     std::vector<HBLine> stats_to_lines(const std::vector<LineStats> &linestats) const;
     Length current_line_width(size_t line_num) const;
     double total_penalty(const std::vector<LineStats> &lines, bool is_complete = false) const;
+    PathPenalty extend_path(const PathPenalty &path, const LineStats &line, size_t line_num) const;
+    double total_penalty(const PathPenalty &path, double end_penalty = 0) const;
 
     WordsOnLine words_for_splits(size_t from_split_ind, size_t to_split_ind) const;
     HBLine build_line_words_runs(size_t from_split_ind, size_t to_split_ind) const;
+    Length line_width(size_t from_split_ind, size_t to_split_ind) const;
     std::string build_line_text_debug(size_t from_split_ind, size_t to_split_ind) const;
 
     Length paragraph_width;
-    std::vector<EnrichedWord> words;
-    std::vector<SplitPoint> split_points;
-    std::vector<TextLocation> split_locations;
-
-    StyleStack determine_style(TextLocation t) const;
+    WordStore words;
+    SplitPointTable split_points;
+
+    const WordHyphenator *hyphenator = nullptr;
+    // Hyphen points of the words pending hyphenation, computed at most once.
+    std::vector<std::vector<HyphenPoint>> lazy_hyphens;
+    std::vector<bool> hyphenated;
+    std::vector<bool> hyphenation_used; // The words hyphenated in split_points.
+    // Words that the last search needed hyphenated but were not.
+    mutable std::vector<bool> line_end_words;
+
+    // Widths measured once per paragraph. Full words are measured with and
+    // without a trailing space. For a within word split, the head is the part
+    // before it (plus dash) and the tail is the part after it (plus space).
+    std::vector<Length> word_widths;
+    std::vector<Length> spaced_word_widths;
+    std::vector<Length> spaced_width_sums; // Prefix sums of spaced_word_widths.
+    std::vector<Length> head_widths;       // Indexed by split point.
+    std::vector<Length> tail_widths;       // Indexed by split point.
+
+    // Formatting resolved to text parameters once per paragraph, so that
+    // lines can be built from any split without replaying it.
+    std::vector<HBTextParameters> split_pars;  // Indexed by split point.
+    std::vector<HBTextParameters> word_pars;   // At the start of each word.
+    std::vector<HBTextParameters> change_pars; // After each formatting change of each word.
+    std::vector<size_t> first_change;          // Of each word in change_pars, plus the total.
 
     double best_penalty = 1e100;
     std::vector<LineStats> best_split;
+    size_t best_node = size_t(-1); // In the search arena of the recursive splitter.
+    std::vector<ParagraphBreaking> line_count_variants;
+    bool find_line_count_variants = false;
 
     // Cached results of best states we have achieved thus far.
     SplitStates state_cache;
     HBChapterParameters params;
     ExtraPenaltyAmounts extras;
     HBFontCache &fc;
+    SplitAlgorithm algorithm;
+    SearchLimits limits;
+    SearchBudget budget{SearchLimits{}};
 
     mutable std::unordered_map<size_t, LineStats> closest_line_ends;
 };
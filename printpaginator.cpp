@@ -19,9 +19,141 @@
 #include <chapterformatter.hpp>
 #include <cassert>
 #include <random>
+#include <atomic>
 
 namespace {
 
+void add_element(StableHasher &hasher, const DocElement &e) {
+    hasher.add(e.index());
+    auto add_lines = [&hasher](const std::vector<std::string> &lines) {
+        hasher.add(lines.size());
+        for(const auto &l : lines) {
+            hasher.add(std::string_view{l});
+        }
+    };
+    if(auto *par = std::get_if<Paragraph>(&e)) {
+        hasher.add(std::string_view{par->text});
+    } else if(auto *sec = std::get_if<Section>(&e)) {
+        hasher.add(sec->level);
+        hasher.add(sec->number);
+        hasher.add(std::string_view{sec->text});
+    } else if(auto *cb = std::get_if<CodeBlock>(&e)) {
+        add_lines(cb->raw_lines);
+    } else if(auto *foot = std::get_if<Footnote>(&e)) {
+        hasher.add(foot->number);
+        hasher.add(std::string_view{foot->text});
+    } else if(auto *list = std::get_if<NumberList>(&e)) {
+        add_lines(list->items);
+    } else if(auto *fig = std::get_if<Figure>(&e)) {
+        hasher.add(std::string_view{fig->file});
+    } else if(auto *letter = std::get_if<Letter>(&e)) {
+        add_lines(letter->paragraphs);
+    } else if(auto *sign = std::get_if<SignBlock>(&e)) {
+        add_lines(sign->raw_lines);
+    } else if(auto *menu = std::get_if<Menu>(&e)) {
+        add_lines(menu->raw_lines);
+    }
+}
+
+// Everything in the document settings that changes how paragraphs are split.
+uint64_t paragraph_settings_digest(const Metadata &data) {
+    StableHasher hasher;
+    hasher.add(data.language);
+    hasher.add(data.pdf.line_splitter);
+    hasher.add(data.pdf.paragraph_budget);
+    if(data.language != Language::Unset) {
+        hasher.add(HYPHENATOR_VERSION);
+        hasher.add(hyphenation_data_digest(data.language));
+    }
+    return hasher.value();
+}
+
+uint64_t paragraph_key(const Paragraph &p,
+                       const HBChapterParameters &chpar,
+                       Length paragraph_width,
+                       const ExtraPenaltyAmounts &extras,
+                       uint64_t settings_digest) {
+    StableHasher hasher;
+    hasher.add(settings_digest);
+    hasher.add(std::string_view{p.text});
+    hasher.add(paragraph_width.mm());
+    hasher.add(chpar.line_height.mm());
+    hasher.add(chpar.indent.mm());
+    hasher.add(chpar.font.size.mm());
+    hasher.add(chpar.font.par);
+    hasher.add(chpar.indent_last_line);
+    hasher.add(extras);
+    return hasher.value();
+}
+
+void rebase_limits(TextLimits &limits, int64_t offset, std::vector<TextElement> *elems) {
+    limits.start.element_id += offset;
+    limits.start.elems = elems;
+    limits.end.element_id += offset;
+    limits.end.elems = elems;
+}
+
+// Moves all text iterators of the pages by offset elements.
+void rebase_pages(std::vector<Page> &pages, int64_t offset, std::vector<TextElement> *elems) {
+    for(auto &p : pages) {
+        if(auto *sp = std::get_if<SectionPage>(&p)) {
+            rebase_limits(sp->main_text, offset, elems);
+        } else if(auto *rp = std::get_if<RegularPage>(&p)) {
+            rebase_limits(rp->main_text, offset, elems);
+            if(rp->footnotes) {
+                rebase_limits(*rp->footnotes, offset, elems);
+            }
+        }
+    }
+}
+
+void swap_variant(std::vector<TextElement> &elements, const VariantSwap &swap) {
+    auto &par = std::get<ParagraphElement>(elements[swap.element_id]);
+    auto &variant = par.variants.at(swap.variant);
+    std::swap(par.lines, variant.lines);
+    std::swap(par.penalty, variant.penalty);
+}
+
+// Paragraphs with variants on pages that have penalties and on the pages
+// before them.
+std::vector<size_t> variant_candidates(const PageLayoutResult &result,
+                                       const std::vector<TextElement> &elements) {
+    const size_t page_number_offset = 1;
+    std::vector<size_t> problem_pages(result.stats.widows);
+    problem_pages.insert(
+        problem_pages.end(), result.stats.orphans.begin(), result.stats.orphans.end());
+    for(const auto &mismatch : result.stats.mismatches) {
+        problem_pages.push_back(mismatch.page_number);
+    }
+    if(result.stats.single_line_last_page) {
+        problem_pages.push_back(result.pages.size() - 1 + page_number_offset);
+    }
+    std::vector<size_t> candidates;
+    for(const auto page_number : problem_pages) {
+        const size_t page_num = page_number - page_number_offset;
+        for(size_t i = page_num == 0 ? 0 : page_num - 1; i <= page_num; ++i) {
+            const TextLimits *limits = nullptr;
+            if(const auto *rp = std::get_if<RegularPage>(&result.pages[i])) {
+                limits = &rp->main_text;
+            } else if(const auto *sp = std::get_if<SectionPage>(&result.pages[i])) {
+                limits = &sp->main_text;
+            } else {
+                continue;
+            }
+            const auto last = std::min(limits->end.element_id, elements.size() - 1);
+            for(size_t e = limits->start.element_id; e <= last; ++e) {
+                const auto *par = std::get_if<ParagraphElement>(&elements[e]);
+                if(par && !par->variants.empty()) {
+                    candidates.push_back(e);
+                }
+            }
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    return candidates;
+}
+
 void plaintextprinter(FILE *f, const TextCommands &c) {
     (void)f;
     (void)c;
@@ -87,31 +219,91 @@ size_t get_num_logical_lines(const TextElement &e) {
     }
 }
 
-size_t lines_on_page(const Page &p) {
-    size_t num_lines = 0;
-    if(auto *reg = std::get_if<RegularPage>(&p)) {
-        for(auto it = reg->main_text.start; it != reg->main_text.end; ++it) {
-            if(num_lines > 0 || !std::holds_alternative<EmptyLineElement>(it.element())) {
-                ++num_lines;
-            }
+void LineTable::build(std::vector<TextElement> &elements,
+                      size_t first_element_,
+                      size_t end_element_) {
+    elems = &elements;
+    first_element = first_element_;
+    end_element = end_element_;
+    element_id.clear();
+    line_id.clear();
+    kind.clear();
+    height.clear();
+    element_lines.clear();
+    element_start.clear();
+    for(size_t i = first_element; i < end_element; ++i) {
+        const auto &e = elements[i];
+        element_start.push_back(kind.size());
+        const size_t num_lines = get_num_logical_lines(e);
+        LineKind k;
+        size_t h = 1;
+        size_t text_lines = 0;
+        if(std::holds_alternative<SectionElement>(e)) {
+            k = LineKind::Section;
+            const size_t chapter_heading_top_whitespace = 8;
+            h = chapter_heading_top_whitespace + 1;
+        } else if(std::holds_alternative<ParagraphElement>(e)) {
+            k = LineKind::Paragraph;
+        } else if(std::holds_alternative<SpecialTextElement>(e)) {
+            k = LineKind::Special;
+        } else if(auto *empty = std::get_if<EmptyLineElement>(&e)) {
+            k = LineKind::Empty;
+            h = empty->num_lines;
+        } else if(auto *image = std::get_if<ImageElement>(&e)) {
+            k = LineKind::Image;
+            h = image->height_in_lines;
+        } else {
+            std::abort();
+        }
+        if(k != LineKind::Image) {
+            text_lines = get_lines(e).size();
+        }
+        for(size_t line = 0; line < num_lines; ++line) {
+            element_id.push_back(i);
+            line_id.push_back(line);
+            kind.push_back(k);
+            height.push_back(h);
+            element_lines.push_back(text_lines);
+        }
+    }
+    element_start.push_back(kind.size());
+    empty_run.assign(kind.size() + 1, 0);
+    for(size_t line = kind.size(); line-- > 0;) {
+        if(kind[line] == LineKind::Empty) {
+            empty_run[line] = empty_run[line + 1] + 1;
         }
+    }
+}
+
+TextElementIterator LineTable::iterator(size_t line) const {
+    TextElementIterator it(*elems);
+    if(line >= size()) {
+        it.element_id = end_element;
+    } else {
+        it.element_id = element_id[line];
+        it.line_id = line_id[line];
+    }
+    return it;
+}
+
+size_t LineTable::lines_on_page(const Page &p) const {
+    if(auto *reg = std::get_if<RegularPage>(&p)) {
+        const auto first = index(reg->main_text.start);
+        const auto num_lines = index(reg->main_text.end) - first;
+        // Empty lines at the top of the page are not counted.
+        size_t page_lines = num_lines - std::min<size_t>(empty_run[first], num_lines);
         if(reg->image) {
-            num_lines += reg->image->height_in_lines;
+            page_lines += reg->image->height_in_lines;
         }
+        return page_lines;
     } else if(auto *sec = std::get_if<SectionPage>(&p)) {
         const size_t chapter_heading_top_whitespace = 8;
-        num_lines += chapter_heading_top_whitespace; // FIXME
-        num_lines += 1;
-        auto it = sec->main_text.start;
-        it.next_element();
-        for(; it != sec->main_text.end; ++it) {
-            ++num_lines;
-        }
+        const auto text_start = element_start[sec->main_text.start.element_id - first_element + 1];
+        return chapter_heading_top_whitespace + 1 + index(sec->main_text.end) - text_start;
     } else {
         fprintf(stderr, "Unsupported page.\n");
         std::abort();
     }
-    return num_lines;
 }
 
 void TextElementIterator::operator++() {
@@ -145,17 +337,89 @@ const TextElement &TextElementIterator::element() { return elems->at(element_id)
 
 const TextCommands &TextElementIterator::line() { return get_lines(element()).at(line_id); }
 
-PrintPaginator::PrintPaginator(const Document &d)
+std::optional<ParagraphElement> RebuildCache::find_paragraph(uint64_t key) {
+    std::lock_guard l(lock);
+    auto it = paragraphs.find(key);
+    if(it == paragraphs.end()) {
+        return {};
+    }
+    it->second.used = true;
+    return it->second.value;
+}
+
+void RebuildCache::add_paragraph(uint64_t key, const ParagraphElement &pelem) {
+    std::lock_guard l(lock);
+    paragraphs[key] = Entry<ParagraphElement>{pelem, true};
+}
+
+std::optional<PageLayoutResult> RebuildCache::find_section(uint64_t key) {
+    std::lock_guard l(lock);
+    auto it = sections.find(key);
+    if(it == sections.end()) {
+        return {};
+    }
+    it->second.used = true;
+    return it->second.value;
+}
+
+void RebuildCache::add_section(uint64_t key, const PageLayoutResult &layout) {
+    std::lock_guard l(lock);
+    sections[key] = Entry<PageLayoutResult>{layout, true};
+}
+
+void RebuildCache::finish_build() {
+    std::lock_guard l(lock);
+    std::erase_if(paragraphs, [](auto &e) { return !e.second.used; });
+    std::erase_if(sections, [](auto &e) { return !e.second.used; });
+    for(auto &e : paragraphs) {
+        e.second.used = false;
+    }
+    for(auto &e : sections) {
+        e.second.used = false;
+    }
+}
+
+void RebuildCache::clear() {
+    std::lock_guard l(lock);
+    paragraphs.clear();
+    sections.clear();
+    fonts.reset();
+}
+
+HBFontCache &RebuildCache::font_cache(const FontFilePaths &files) {
+    std::lock_guard l(lock);
+    if(!fonts) {
+        fonts = std::make_unique<HBFontCache>(files);
+    }
+    return *fonts;
+}
+
+PrintPaginator::PrintPaginator(const Document &d, RebuildCache *rebuild_cache_)
     : doc(d), page(doc.data.pdf.page), styles(d.data.pdf.styles), spaces(d.data.pdf.spaces),
-      m(doc.data.pdf.margins), fc(d.data.pdf.font_files) {
+      m(doc.data.pdf.margins),
+      hyphen_cache(d.data.hyphenation_cache ? d.data.top_dir / HYPHENATION_CACHE_FILE
+                                            : std::filesystem::path{}),
+      own_hyphen(rebuild_cache_ ? nullptr : std::make_unique<WordHyphenator>()),
+      hyphen(own_hyphen ? *own_hyphen : rebuild_cache_->hyphenator()),
+      own_fc(rebuild_cache_ ? nullptr : std::make_unique<HBFontCache>(d.data.pdf.font_files)),
+      fc(own_fc ? *own_fc : rebuild_cache_->font_cache(d.data.pdf.font_files)),
+      font_digest(fc.font_digest()),
+      layout_cache(d.data.layout_cache ? std::filesystem::path{LAYOUT_CACHE_FILE}
+                                       : std::filesystem::path{}),
+      rebuild_cache(rebuild_cache_) {
     stats = nullptr;
+    hyphen.set_cache(&hyphen_cache);
     if(doc.data.is_draft) {
         fprintf(stderr, "Tried to generate final print when in draft mode.\n");
         std::abort();
     }
 }
 
-PrintPaginator::~PrintPaginator() { fclose(stats); }
+PrintPaginator::~PrintPaginator() {
+    // The hyphenator may outlive this build.
+    hyphen.set_cache(nullptr);
+    fclose(stats);
+}
 
 void PrintPaginator::generate_pdf(const char *outfile) {
     capypdf::DocumentProperties dprop;
@@ -187,6 +451,8 @@ void PrintPaginator::generate_pdf(const char *outfile) {
     stats = fopen(statfile.string().c_str(), "w");
     fprintf(stats, "Statistics\n\n");
     build_main_text();
+    layout_cache.save();
+    hyphen_cache.save();
     if(true) {
         std::filesystem::path dumpfile(outfile);
         dumpfile.replace_extension(".dump.txt");
@@ -349,8 +615,10 @@ void PrintPaginator::render_mainmatter() {
                     render_floating_image(reg_page->image.value());
                     y -= line_height * reg_page->image->height_in_lines;
                 }
-                render_maintext_lines(
-                    reg_page->main_text.start, reg_page->main_text.end, book_page_number, y);
+                render_maintext_lines(line_table.index(reg_page->main_text.start),
+                                      line_table.index(reg_page->main_text.end),
+                                      book_page_number,
+                                      y);
                 draw_edge_markers(current_section_number, book_page_number);
                 draw_page_number(book_page_number);
             } else if(auto *sec_page = std::get_if<SectionPage>(&p)) {
@@ -377,7 +645,11 @@ void PrintPaginator::render_mainmatter() {
                                   y - hack_delta,
                                   chapter_number.alignment);
                 y -= line_height;
-                render_maintext_lines(it, sec_page->main_text.end, book_page_number, y, 0);
+                render_maintext_lines(line_table.index(it),
+                                      line_table.index(sec_page->main_text.end),
+                                      book_page_number,
+                                      y,
+                                      0);
             } else if(std::holds_alternative<EmptyPage>(p)) {
             } else {
                 fprintf(stderr, "Not implemented yet.\n");
@@ -432,8 +704,14 @@ void PrintPaginator::render_recipe() {
             rend->render_text_as_is(tmp.c_str(), recipe_style.font, x, y);
             y -= 2 * recipe_style.line_height;
         } else {
-            std::vector<EnrichedWord> processed_words = text_to_formatted_words(line);
-            ParagraphFormatter b(processed_words, textwidth, recipe_style, extra, fc);
+            WordStore processed_words = text_to_formatted_words(line);
+            ParagraphFormatter b(processed_words,
+                                 textwidth,
+                                 recipe_style,
+                                 extra,
+                                 fc,
+                                 doc.data.pdf.line_splitter);
+            b.set_hyphenator(&hyphen);
             auto lines = b.split_formatted_lines();
             auto rag_lines = build_ragged_paragraph(lines, TextAlignment::Left);
             for(const auto &tl : rag_lines) {
@@ -482,40 +760,48 @@ void PrintPaginator::render_credits() {
     rend->new_page();
 }
 
-void PrintPaginator::render_maintext_lines(const TextElementIterator &start_loc,
-                                           const TextElementIterator &end_loc,
+void PrintPaginator::render_maintext_lines(size_t start_line,
+                                           size_t end_line,
                                            size_t book_page_number,
                                            Length y,
                                            int current_line) {
     const Length line_height = styles.normal.line_height;
     const auto &textblock_left =
         (book_page_number % 2) == 0 ? doc.data.pdf.margins.outer : doc.data.pdf.margins.inner;
-    for(auto it = start_loc; it != end_loc; ++it) {
+    for(size_t i = start_line; i < end_line; ++i) {
         ++current_line;
-        if(std::holds_alternative<ParagraphElement>(it.element())) {
-            const auto &line = it.line();
+        const auto &e = elements[line_table.element_id[i]];
+        switch(line_table.kind[i]) {
+        case LineKind::Paragraph: {
+            const auto &line = std::get<ParagraphElement>(e).lines[line_table.line_id[i]];
             if(const auto *j = std::get_if<JustifiedTextDrawCommand>(&line)) {
-                rend->render_line_justified(j->words, j->width, textblock_left + j->x, y);
+                rend->render_line_justified(
+                    j->words, j->width, j->text_width, textblock_left + j->x, y);
             } else if(const auto *r = std::get_if<TextDrawCommand>(&line)) {
                 rend->render_runs(r->runs, textblock_left + r->x, y, TextAlignment::Left);
             } else {
                 std::abort();
             }
             y -= line_height;
-        } else if(auto *special = std::get_if<SpecialTextElement>(&it.element())) {
-            const auto &line = it.line();
-            const auto mu = std::get<TextDrawCommand>(line);
-            rend->render_runs(
-                mu.runs, textblock_left + special->extra_indent, y, special->alignment);
+            break;
+        }
+        case LineKind::Special: {
+            const auto &special = std::get<SpecialTextElement>(e);
+            const auto &mu = std::get<TextDrawCommand>(special.lines[line_table.line_id[i]]);
+            rend->render_runs(mu.runs, textblock_left + special.extra_indent, y, special.alignment);
             y -= line_height;
-        } else if(auto *empty = std::get_if<EmptyLineElement>(&it.element())) {
+            break;
+        }
+        case LineKind::Empty:
             // Empty lines at the top of the page are ignored.
             if(current_line != 0) {
-                y -= empty->num_lines * line_height;
+                y -= line_table.fill_height(i) * line_height;
             }
-        } else if(std::holds_alternative<ImageElement>(it.element())) {
+            break;
+        case LineKind::Image:
             // Images are rendered at the start of the page.
-        } else {
+            break;
+        default:
             fprintf(stderr, "ERROR is.\n");
             std::abort();
         }
@@ -576,19 +862,31 @@ void PrintPaginator::draw_page_number(size_t page_number) {
 void PrintPaginator::build_main_text() {
     ExtraPenaltyAmounts extras;
     bool first_paragraph = true;
+    const size_t num_threads = worker_thread_count(doc.data.pdf.threads);
+    std::vector<ParagraphJob> paragraph_jobs;
+    std::optional<StableHasher> section_hasher;
 
     assert(std::holds_alternative<Section>(doc.elements.front()));
-    for(const auto &e : doc.elements) {
+    for(size_t element_id = 0; element_id < doc.elements.size(); ++element_id) {
+        const auto &e = doc.elements[element_id];
+        if(std::holds_alternative<Section>(e)) {
+            if(section_hasher) {
+                section_keys.push_back(section_hasher->value());
+            }
+            section_hasher.emplace();
+        }
+        add_element(*section_hasher, e);
 
         if(auto *sec = std::get_if<Section>(&e)) {
             create_section(*sec, extras);
             // first_section, first_paragraph;
             first_paragraph = true;
         } else if(auto *par = std::get_if<Paragraph>(&e)) {
-            create_paragraph(*par,
-                             extras,
-                             first_paragraph ? styles.normal_noindent : styles.normal,
-                             Length::zero());
+            const auto &chpar = first_paragraph ? styles.normal_noindent : styles.normal;
+            // Filled in by create_paragraphs below.
+            paragraph_jobs.emplace_back(
+                ParagraphJob{par, nullptr, &chpar, elements.size(), element_id});
+            elements.emplace_back(ParagraphElement{});
             first_paragraph = false;
         } else if(auto *fig = std::get_if<Figure>(&e)) {
             const auto fullpath = doc.data.top_dir / fig->file;
@@ -630,6 +928,8 @@ void PrintPaginator::build_main_text() {
             std::abort();
         }
     }
+    section_keys.push_back(section_hasher->value());
+    create_paragraphs(paragraph_jobs, extras, num_threads);
     printf("Optimizing page splits.\n");
     optimize_page_splits();
     // create_pdf();
@@ -656,9 +956,11 @@ void PrintPaginator::create_sign(const SignBlock &sign) {
     el.font = &styles.normal.font;
     const auto textwidth = textblock_width();
     for(const auto &line : sign.raw_lines) {
-        std::vector<EnrichedWord> processed_words = text_to_formatted_words(line);
-        ParagraphFormatter b(processed_words, textwidth, styles.sign, extra, fc);
-        auto lines = b.split_formatted_lines();
+        WordStore processed_words = text_to_formatted_words(line);
+        auto lines =
+            split_paragraph(processed_words, textwidth, styles.sign, extra, fc, hyphen)
+                .front()
+                .lines;
         el.extra_indent = textblock_width() / 2;
         el.alignment = TextAlignment::Centered;
         auto rag_lines = build_ragged_paragraph(lines, el.alignment);
@@ -679,9 +981,15 @@ void PrintPaginator::create_menu(const Menu &menu) {
             el.lines.push_back(
                 TextDrawCommand{{}, Length::zero(), Length::zero(), TextAlignment::Centered});
         } else {
-            std::vector<EnrichedWord> processed_words = text_to_formatted_words(line);
+            WordStore processed_words = text_to_formatted_words(line);
             // FIXME, should use a custom style element for menu.
-            ParagraphFormatter b(processed_words, textwidth, styles.normal, extra, fc);
+            ParagraphFormatter b(processed_words,
+                                 textwidth,
+                                 styles.normal,
+                                 extra,
+                                 fc,
+                                 doc.data.pdf.line_splitter);
+            b.set_hyphenator(&hyphen);
             auto lines = b.split_formatted_lines();
             el.extra_indent = textblock_width() / 2;
             el.alignment = TextAlignment::Centered;
@@ -705,9 +1013,11 @@ void PrintPaginator::create_letter(const Letter &letter) {
         el.font = &styles.letter.font;
         el.alignment = TextAlignment::Left;
         auto paragraph_width = textblock_width() - 2 * spaces.letter_indent;
-        std::vector<EnrichedWord> processed_words = text_to_formatted_words(partext);
-        ParagraphFormatter b(processed_words, paragraph_width, styles.letter, extra, fc);
-        auto lines = b.split_formatted_lines();
+        WordStore processed_words = text_to_formatted_words(partext);
+        auto lines =
+            split_paragraph(processed_words, paragraph_width, styles.letter, extra, fc, hyphen)
+                .front()
+                .lines;
         el.extra_indent = spaces.letter_indent;
         el.lines = build_ragged_paragraph(lines, el.alignment);
         elements.emplace_back(std::move(el));
@@ -721,22 +1031,136 @@ void PrintPaginator::optimize_page_splits() {
     size_t target_height = textblock_height().mm() / styles.normal.line_height.mm();
     end.element_id = elements.size();
     end.line_id = 0;
-    maintext_sections.reserve(100);
     assert(maintext_sections.empty());
-    size_t section_number = 1;
+    std::vector<ChapterJob> jobs;
     while(start != end) {
-        printf("Optimizing section %d.\n", (int)section_number);
         auto next = start;
         do {
             next.next_element();
         } while(!(next == end || std::holds_alternative<SectionElement>(next.element())));
-        ChapterFormatter chf(start, next, elements, target_height);
-        auto optimized_chapter = chf.optimize_pages();
-        print_stats(optimized_chapter, section_number);
-        maintext_sections.emplace_back(std::move(optimized_chapter.pages));
-        ++section_number;
+        StableHasher hasher;
+        hasher.add(section_keys.at(jobs.size()));
+        hasher.add(target_height);
+        jobs.emplace_back(ChapterJob{start, next, hasher.value()});
         start = next;
     }
+
+    // Page numbering restarts at every section so chapters can be
+    // optimized independently. Each job only modifies its own elements.
+    std::vector<PageLayoutResult> results(jobs.size());
+    std::atomic<size_t> next_job{0};
+    const size_t num_threads = worker_thread_count(doc.data.pdf.threads);
+    run_on_threads(std::min(num_threads, jobs.size()), [&]() {
+        for(size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            results[i] = optimize_chapter(jobs[i], target_height);
+        }
+    });
+
+    line_table.build(elements, 0, elements.size());
+    maintext_sections.reserve(jobs.size());
+    for(size_t i = 0; i < results.size(); ++i) {
+        print_stats(results[i], i + 1);
+        maintext_sections.emplace_back(std::move(results[i].pages));
+    }
+}
+
+PageLayoutResult PrintPaginator::optimize_chapter(const ChapterJob &job, size_t target_height) {
+    const auto offset = int64_t(job.start.element_id);
+    size_t limited_paragraphs = 0;
+    for(size_t i = job.start.element_id; i < job.end.element_id; ++i) {
+        if(const auto *par = std::get_if<ParagraphElement>(&elements[i])) {
+            limited_paragraphs += par->budget_limited;
+        }
+    }
+    // Paragraphs that ran out of budget may come out different on the next build.
+    const bool cacheable = rebuild_cache && limited_paragraphs == 0;
+    std::optional<PageLayoutResult> cached;
+    if(cacheable) {
+        cached = rebuild_cache->find_section(job.key);
+    }
+    if(cached) {
+        for(auto &swap : cached->variant_swaps) {
+            swap.element_id += offset;
+            swap_variant(elements, swap);
+        }
+        rebase_pages(cached->pages, offset, &elements);
+        return std::move(*cached);
+    }
+    SearchBudget budget(doc.data.pdf.chapter_budget);
+    auto optimized_chapter = layout_chapter(job, target_height, budget);
+    optimized_chapter.budget_limited_paragraphs = limited_paragraphs;
+    if(cacheable && !optimized_chapter.budget_limited) {
+        auto relative = optimized_chapter;
+        rebase_pages(relative.pages, -offset, nullptr);
+        for(auto &swap : relative.variant_swaps) {
+            swap.element_id -= offset;
+        }
+        rebuild_cache->add_section(job.key, relative);
+    }
+    return optimized_chapter;
+}
+
+// Setting a paragraph one line tighter or looser can fix a widow, an orphan
+// or a height mismatch nearby. After laying out the chapter the best such
+// change is applied, until no change helps or the budget runs out.
+PageLayoutResult
+PrintPaginator::layout_chapter(const ChapterJob &job, size_t target_height, SearchBudget &budget) {
+    const size_t max_rounds = 10;
+    LineTable lines;
+    std::optional<ChapterFormatter> chf;
+    PageLayoutResult result;
+    std::vector<VariantSwap> swaps;
+    for(size_t round = 0;; ++round) {
+        lines.build(elements, job.start.element_id, job.end.element_id);
+        chf.emplace(lines, elements, target_height, budget);
+        result = chf->optimize_pages();
+        if(round == max_rounds || budget.exhausted()) {
+            break;
+        }
+        const auto swap = choose_paragraph_variant(job, target_height, budget, *chf, result);
+        if(!swap) {
+            break;
+        }
+        swap_variant(elements, *swap);
+        swaps.push_back(*swap);
+    }
+    result.variant_swaps = std::move(swaps);
+    result.budget_limited = budget.exhausted();
+    return result;
+}
+
+// Paragraphs on the pages with problems and the pages before them are tried
+// one at a time. The pages after the paragraph are the same as in the
+// current layout, so each trial only lays out the pages before it again.
+std::optional<VariantSwap>
+PrintPaginator::choose_paragraph_variant(const ChapterJob &job,
+                                         size_t target_height,
+                                         SearchBudget &budget,
+                                         ChapterFormatter &current,
+                                         const PageLayoutResult &result) {
+    double best_cost = result.stats.total_penalty;
+    std::optional<VariantSwap> best_swap;
+    LineTable trial_lines;
+    for(const auto element_id : variant_candidates(result, elements)) {
+        const auto &par = std::get<ParagraphElement>(elements[element_id]);
+        for(size_t v = 0; v < par.variants.size(); ++v) {
+            const VariantSwap swap{element_id, v};
+            const double paragraph_delta = ChapterFormatter::ParagraphPenaltyWeight *
+                                           (par.variants[v].penalty - par.penalty);
+            swap_variant(elements, swap);
+            trial_lines.build(elements, job.start.element_id, job.end.element_id);
+            ChapterFormatter trial(
+                trial_lines, elements, target_height, budget, current, element_id);
+            const auto trial_penalty = trial.optimize_pages().stats.total_penalty;
+            swap_variant(elements, swap);
+            const double cost = trial_penalty + paragraph_delta;
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_swap = swap;
+            }
+        }
+    }
+    return best_swap;
 }
 
 void PrintPaginator::create_section(const Section &s, const ExtraPenaltyAmounts &extras) {
@@ -763,8 +1187,13 @@ void PrintPaginator::create_section(const Section &s, const ExtraPenaltyAmounts
     // The title. Hyphenation is prohibited.
     const bool only_number_in_chapter_heading = true;
     if(!only_number_in_chapter_heading) {
-        std::vector<EnrichedWord> processed_words = text_to_formatted_words(title_string, false);
-        ParagraphFormatter b(processed_words, section_width, styles.section, extras, fc);
+        WordStore processed_words = text_to_formatted_words(title_string, false);
+        ParagraphFormatter b(processed_words,
+                             section_width,
+                             styles.section,
+                             extras,
+                             fc,
+                             doc.data.pdf.line_splitter);
         auto lines = b.split_formatted_lines();
         auto built_lines = build_ragged_paragraph(lines, section_alignment);
         for(auto &line : built_lines) {
@@ -775,25 +1204,140 @@ void PrintPaginator::create_section(const Section &s, const ExtraPenaltyAmounts
     elements.emplace_back(EmptyLineElement{1});
 }
 
-void PrintPaginator::create_paragraph(const Paragraph &p,
-                                      const ExtraPenaltyAmounts &extras,
-                                      const HBChapterParameters &chpar,
-                                      Length extra_indent) {
+// Paragraphs found in the rebuild cache are taken from it, so only the
+// rest need their words.
+void PrintPaginator::create_paragraphs(std::vector<ParagraphJob> &jobs,
+                                       const ExtraPenaltyAmounts &extras,
+                                       size_t num_threads) {
+    std::vector<ParagraphJob> misses;
+    std::vector<bool> wanted(doc.elements.size(), false);
+    const auto settings = rebuild_cache ? paragraph_settings_digest(doc.data) : 0;
+    for(auto &job : jobs) {
+        if(rebuild_cache) {
+            job.key =
+                paragraph_key(*job.paragraph, *job.chpar, textblock_width(), extras, settings);
+            if(auto cached = rebuild_cache->find_paragraph(job.key)) {
+                elements[job.element_index] = std::move(*cached);
+                continue;
+            }
+        }
+        wanted[job.doc_index] = true;
+        misses.push_back(job);
+    }
+    if(misses.empty()) {
+        return;
+    }
+    const auto paragraph_words = enrich_paragraphs_lazily(doc, wanted, num_threads);
+    for(auto &job : misses) {
+        job.words = &paragraph_words[job.doc_index];
+    }
+    if(num_threads > 1) {
+        create_paragraphs_parallel(misses, extras, num_threads);
+        return;
+    }
+    for(const auto &job : misses) {
+        elements[job.element_index] = build_paragraph(job, extras, fc, hyphen);
+    }
+}
+
+void PrintPaginator::create_paragraphs_parallel(const std::vector<ParagraphJob> &jobs,
+                                                const ExtraPenaltyAmounts &extras,
+                                                size_t num_threads) {
+    std::atomic<size_t> next_job{0};
+    run_on_threads(std::min(num_threads, jobs.size()), [&]() {
+        // Hyphenators are not thread safe, but they can share the cache.
+        WordHyphenator thread_hyphen;
+        thread_hyphen.set_cache(&hyphen_cache);
+        for(size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            const auto &job = jobs[i];
+            elements[job.element_index] = build_paragraph(job, extras, fc, thread_hyphen);
+        }
+    });
+}
+
+// Only called for paragraphs that are not in the rebuild cache.
+ParagraphElement PrintPaginator::build_paragraph(const ParagraphJob &job,
+                                                 const ExtraPenaltyAmounts &extras,
+                                                 HBFontCache &font_cache,
+                                                 const WordHyphenator &hyph) const {
+    const auto &chpar = *job.chpar;
     ParagraphElement pelem;
-    pelem.paragraph_width = textblock_width() - 2 * extra_indent;
-    std::vector<EnrichedWord> processed_words = text_to_formatted_words(p.text);
-    ParagraphFormatter b(processed_words, pelem.paragraph_width, chpar, extras, fc);
-    auto lines = b.split_formatted_lines();
+    pelem.paragraph_width = textblock_width();
+    auto breakings =
+        split_paragraph(*job.words, pelem.paragraph_width, chpar, extras, font_cache, hyph, true);
     pelem.params = chpar;
-    pelem.lines = build_justified_paragraph(lines, chpar, pelem.paragraph_width);
-    // Shift sideways
-    elements.emplace_back(std::move(pelem));
+    HBMeasurer meas(font_cache, "fi");
+    pelem.lines =
+        build_justified_paragraph(breakings.front().lines, chpar, pelem.paragraph_width, meas);
+    pelem.penalty = breakings.front().penalty;
+    pelem.budget_limited = breakings.front().budget_limited;
+    // The page optimizer may use these to avoid widows and orphans.
+    for(size_t i = 1; i < breakings.size(); ++i) {
+        pelem.variants.emplace_back(ParagraphVariant{
+            build_justified_paragraph(breakings[i].lines, chpar, pelem.paragraph_width, meas),
+            breakings[i].penalty});
+    }
+    if(rebuild_cache && !pelem.budget_limited) {
+        rebuild_cache->add_paragraph(job.key, pelem);
+    }
+    return pelem;
+}
+
+std::vector<ParagraphLines>
+PrintPaginator::split_paragraph(const WordStore &words,
+                                Length paragraph_width,
+                                const HBChapterParameters &chpar,
+                                const ExtraPenaltyAmounts &extras,
+                                HBFontCache &font_cache,
+                                const WordHyphenator &hyph,
+                                bool with_variants) const {
+    ParagraphFormatter b(words,
+                         paragraph_width,
+                         chpar,
+                         extras,
+                         font_cache,
+                         doc.data.pdf.line_splitter,
+                         doc.data.pdf.paragraph_budget);
+    b.set_hyphenator(&hyph);
+    b.set_line_count_variants(with_variants);
+    const auto key = layout_key(words,
+                                paragraph_width,
+                                chpar,
+                                extras,
+                                doc.data.pdf.line_splitter,
+                                with_variants,
+                                font_digest);
+    std::vector<ParagraphLines> result;
+    std::vector<ParagraphBreaking> breakings;
+    if(auto cached = layout_cache.lookup(key)) {
+        breakings = std::move(*cached);
+        result.emplace_back(ParagraphLines{b.split_formatted_lines(breakings.front()),
+                                           breakings.front().penalty});
+    } else {
+        auto lines = b.split_formatted_lines();
+        breakings = b.breakings();
+        // A search that ran out of time would not give the same result every time.
+        const bool limited = b.budget_limited();
+        if(!limited) {
+            layout_cache.insert(key, breakings);
+        }
+        result.emplace_back(
+            ParagraphLines{std::move(lines), breakings.front().penalty, limited});
+    }
+    if(with_variants) {
+        for(size_t i = 1; i < breakings.size(); ++i) {
+            result.emplace_back(ParagraphLines{b.split_formatted_lines(breakings[i]),
+                                               breakings[i].penalty});
+        }
+    }
+    return result;
 }
 
 std::vector<TextCommands>
 PrintPaginator::build_justified_paragraph(const std::vector<HBLine> &lines,
                                           const HBChapterParameters &text_par,
-                                          const Length target_width) {
+                                          const Length target_width,
+                                          const HBMeasurer &meas) const {
     Length rel_y = Length::zero();
     std::vector<TextCommands> line_commands;
     line_commands.reserve(lines.size());
@@ -805,7 +1349,8 @@ PrintPaginator::build_justified_paragraph(const std::vector<HBLine> &lines,
                 JustifiedTextDrawCommand{line /* FIXME, should do a std::move */,
                                          current_indent,
                                          rel_y,
-                                         target_width - current_indent});
+                                         target_width - current_indent,
+                                         meas.text_width(line)});
         } else {
             line_commands.emplace_back(
                 TextDrawCommand{line2runs(line), current_indent, rel_y, TextAlignment::Left});
@@ -830,24 +1375,9 @@ std::vector<TextCommands> PrintPaginator::build_ragged_paragraph(const std::vect
     return line_commands;
 }
 
-std::vector<EnrichedWord> PrintPaginator::text_to_formatted_words(const std::string &text,
-                                                                  bool permit_hyphenation) {
-    StyleStack current_style("dummy", styles.code.font.size);
-    auto plain_words = split_to_words(std::string_view(text));
-    std::vector<EnrichedWord> processed_words;
-    const Language lang = permit_hyphenation ? doc.data.language : Language::Unset;
-    for(const auto &word : plain_words) {
-        auto working_word = word;
-        auto start_style = current_style;
-        auto formatting_data = extract_styling(current_style, working_word);
-        restore_special_chars(working_word);
-        auto hyphenation_data = hyphen.hyphenate(working_word, lang);
-        processed_words.emplace_back(EnrichedWord{std::move(working_word),
-                                                  std::move(hyphenation_data),
-                                                  std::move(formatting_data),
-                                                  start_style});
-    }
-    return processed_words;
+WordStore PrintPaginator::text_to_formatted_words(const std::string &text,
+                                                  bool permit_hyphenation) {
+    return enrich_text_lazily(text, permit_hyphenation ? doc.data.language : Language::Unset);
 }
 
 void PrintPaginator::dump_text(const char *path) {
@@ -946,4 +1476,17 @@ void PrintPaginator::print_stats(const PageLayoutResult &res, size_t section_num
         }
         fprintf(stats, "\n");
     }
+    if(res.budget_limited) {
+        fprintf(stats, "Page break search ran out of budget, the result may not be optimal.\n\n");
+    }
+    if(res.budget_limited_paragraphs > 0) {
+        fprintf(stats,
+                "Line break search of %d paragraphs ran out of budget.\n\n",
+                (int)res.budget_limited_paragraphs);
+    }
+    if(!res.variant_swaps.empty()) {
+        fprintf(stats,
+                "Line counts of %d paragraphs changed to improve page breaks.\n\n",
+                (int)res.variant_swaps.size());
+    }
 }
@@ -19,12 +19,20 @@
 #include <capypdfrenderer.hpp>
 #include <metadata.hpp>
 #include <formatting.hpp>
+#include <hyphenationcache.hpp>
+#include <wordenricher.hpp>
+#include <layoutcache.hpp>
+#include <searchbudget.hpp>
 #include <units.hpp>
+#include <utils.hpp>
 #include <vector>
 #include <string>
 #include <optional>
 #include <variant>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 struct TextDrawCommand {
     std::vector<HBRun> runs;
@@ -38,6 +46,7 @@ struct JustifiedTextDrawCommand {
     Length x;
     Length y;
     Length width;
+    Length text_width; // Natural width of the shaped words.
 };
 
 struct ImageCommand {
@@ -59,10 +68,19 @@ struct EmptyLineElement {
     size_t num_lines = 1;
 };
 
+// The same paragraph set with a different number of lines.
+struct ParagraphVariant {
+    std::vector<TextCommands> lines;
+    double penalty;
+};
+
 struct ParagraphElement {
     std::vector<TextCommands> lines;
     HBChapterParameters params;
     Length paragraph_width;
+    double penalty = 0; // Line breaking penalty of lines.
+    std::vector<ParagraphVariant> variants;
+    bool budget_limited = false; // The line breaks may not be optimal.
 };
 
 struct SpecialTextElement {
@@ -81,8 +99,6 @@ struct ImageElement {
 
 struct FootnoteElement {};
 
-std::vector<FormattingChange> extract_styling(StyleStack &current_style, std::string &word);
-
 typedef std::variant<SectionElement,
                      ParagraphElement,
                      SpecialTextElement,
@@ -174,17 +190,126 @@ struct PageStatistics {
     size_t total_penalty = 0;
 };
 
+// Exchanges the lines of a paragraph with one of its variants.
+struct VariantSwap {
+    size_t element_id;
+    size_t variant;
+};
+
 struct PageLayoutResult {
     std::vector<Page> pages;
     PageStatistics stats;
+    std::vector<VariantSwap> variant_swaps; // Applied in order before laying out the pages.
+    bool budget_limited = false;              // The page breaks may not be optimal.
+    size_t budget_limited_paragraphs = 0;
 };
 
 const std::vector<TextCommands> &get_lines(const TextElement &e);
-size_t lines_on_page(const Page &p);
+
+enum class LineKind : uint8_t {
+    Section,
+    Paragraph,
+    Special,
+    Empty,
+    Image,
+};
+
+// Every logical line of a range of main text elements in reading order,
+// stored as parallel arrays so that pagination can look lines up by index
+// instead of going through the element variants.
+class LineTable {
+public:
+    void build(std::vector<TextElement> &elements, size_t first_element, size_t end_element);
+
+    size_t size() const { return kind.size(); }
+    size_t index(const TextElementIterator &it) const {
+        return element_start[it.element_id - first_element] + it.line_id;
+    }
+    TextElementIterator iterator(size_t line) const;
+    size_t first_line(size_t element) const { return element_start[element - first_element]; }
+
+    // Lines a page takes when filling it. Empty lines count num_lines each
+    // and the section heading takes its top whitespace.
+    size_t fill_height(size_t line) const { return height[line]; }
+    size_t lines_on_page(const Page &p) const;
+
+    std::vector<uint32_t> element_id; // Index to the whole element vector.
+    std::vector<uint32_t> line_id;
+    std::vector<LineKind> kind;
+    std::vector<uint16_t> height;
+    std::vector<uint32_t> element_lines; // Text lines in the element, zero for images.
+    std::vector<uint32_t> empty_run;     // Empty lines starting from this one, plus a zero.
+
+private:
+    std::vector<uint32_t> element_start; // One past the end has the total line count.
+    std::vector<TextElement> *elems = nullptr;
+    size_t first_element = 0;
+    size_t end_element = 0;
+};
+
+class ChapterFormatter;
+
+// Layouts that can be reused by later builds of the same book as long as
+// their inputs have not changed. Used by bookmaker's watch mode.
+class RebuildCache {
+public:
+    // Thread safe.
+    std::optional<ParagraphElement> find_paragraph(uint64_t key);
+    void add_paragraph(uint64_t key, const ParagraphElement &pelem);
+
+    // Page iterators are relative to the section's first element
+    // and do not point to any element vector.
+    std::optional<PageLayoutResult> find_section(uint64_t key);
+    void add_section(uint64_t key, const PageLayoutResult &layout);
+
+    // Drops all entries that were not used after the previous call.
+    void finish_build();
+    void clear();
+
+    // Loading fonts and setting up the hyphenator are slow, so they are
+    // kept between builds too. Fonts are reloaded after clear(), as they
+    // come from the book definition.
+    HBFontCache &font_cache(const FontFilePaths &files);
+    WordHyphenator &hyphenator() { return hyphen; }
+
+private:
+    template<typename T> struct Entry {
+        T value;
+        bool used;
+    };
+
+    std::mutex lock;
+    std::unordered_map<uint64_t, Entry<ParagraphElement>> paragraphs;
+    std::unordered_map<uint64_t, Entry<PageLayoutResult>> sections;
+    std::unique_ptr<HBFontCache> fonts;
+    WordHyphenator hyphen;
+};
+
+struct ParagraphJob {
+    const Paragraph *paragraph;
+    const WordStore *words;
+    const HBChapterParameters *chpar;
+    size_t element_index;
+    size_t doc_index; // In doc.elements.
+    uint64_t key = 0; // In the rebuild cache.
+};
+
+// Lines of a paragraph and the penalty of breaking it that way.
+struct ParagraphLines {
+    std::vector<HBLine> lines;
+    double penalty;
+    bool budget_limited = false;
+};
+
+struct ChapterJob {
+    TextElementIterator start;
+    TextElementIterator end;
+    uint64_t key; // For the rebuild cache.
+};
 
 class PrintPaginator {
 public:
-    PrintPaginator(const Document &d);
+    explicit PrintPaginator(const Document &d, RebuildCache *rebuild_cache_ = nullptr);
     ~PrintPaginator();
 
     void generate_pdf(const char *outfile);
@@ -194,7 +319,8 @@ private:
 
     std::vector<TextCommands> build_justified_paragraph(const std::vector<HBLine> &lines,
                                                         const HBChapterParameters &text_par,
-                                                        const Length target_width);
+                                                        const Length target_width,
+                                                        const HBMeasurer &meas) const;
     std::vector<TextCommands> build_ragged_paragraph(const std::vector<HBLine> &lines,
                                                      const TextAlignment alignment);
 
@@ -204,12 +330,36 @@ private:
     void create_menu(const Menu &menu);
     void create_letter(const Letter &letter);
 
-    void create_paragraph(const Paragraph &p,
-                          const ExtraPenaltyAmounts &extras,
-                          const HBChapterParameters &chpar,
-                          Length extra_indent);
+    void create_paragraphs(std::vector<ParagraphJob> &jobs,
+                           const ExtraPenaltyAmounts &extras,
+                           size_t num_threads);
+    void create_paragraphs_parallel(const std::vector<ParagraphJob> &jobs,
+                                    const ExtraPenaltyAmounts &extras,
+                                    size_t num_threads);
+    ParagraphElement build_paragraph(const ParagraphJob &job,
+                                     const ExtraPenaltyAmounts &extras,
+                                     HBFontCache &font_cache,
+                                     const WordHyphenator &hyph) const;
+    // Goes through the layout cache. The best breaking comes first. With
+    // variants it is followed by the best ones with one line less and more.
+    // Words pending hyphenation are hyphenated with hyph.
+    std::vector<ParagraphLines> split_paragraph(const WordStore &words,
+                                                Length paragraph_width,
+                                                const HBChapterParameters &chpar,
+                                                const ExtraPenaltyAmounts &extras,
+                                                HBFontCache &font_cache,
+                                                const WordHyphenator &hyph,
+                                                bool with_variants = false) const;
 
     void optimize_page_splits();
+    PageLayoutResult optimize_chapter(const ChapterJob &job, size_t target_height);
+    PageLayoutResult
+    layout_chapter(const ChapterJob &job, size_t target_height, SearchBudget &budget);
+    std::optional<VariantSwap> choose_paragraph_variant(const ChapterJob &job,
+                                                        size_t target_height,
+                                                        SearchBudget &budget,
+                                                        ChapterFormatter &current,
+                                                        const PageLayoutResult &result);
 
     void render_output();
     void render_frontmatter();
@@ -221,8 +371,7 @@ private:
 
     void render_floating_image(const ImageElement &imel);
 
-    std::vector<EnrichedWord> text_to_formatted_words(const std::string &text,
-                                                      bool permit_hyphenation = true);
+    WordStore text_to_formatted_words(const std::string &text, bool permit_hyphenation = true);
 
     Length textblock_width() const { return page.w - m.inner - m.outer; }
     Length textblock_height() const { return page.h - m.upper - m.lower; }
@@ -236,8 +385,8 @@ private:
     void draw_page_number(size_t page_number);
 
     void render_signing_page(const Signing &s);
-    void render_maintext_lines(const TextElementIterator &start_loc,
-                               const TextElementIterator &end_loc,
+    void render_maintext_lines(size_t start_line,
+                               size_t end_line,
                                size_t book_page_number,
                                Length y,
                                int current_line = -1);
@@ -251,15 +400,24 @@ private:
     const Spaces &spaces;
     const Margins &m;
     std::unique_ptr<CapyPdfRenderer> rend;
-    WordHyphenator hyphen;
+    HyphenationCache hyphen_cache; // Shared by paragraph worker threads.
+    // Without a rebuild cache the paginator owns its hyphenator and fonts.
+    std::unique_ptr<WordHyphenator> own_hyphen;
+    WordHyphenator &hyphen;
     int current_page = 1;
     int chapter_start_page = -1;
 
-    HBFontCache fc;
+    std::unique_ptr<HBFontCache> own_fc;
+    HBFontCache &fc;
+    uint64_t font_digest;
+    mutable LayoutCache layout_cache; // Filled by paragraph worker threads.
+    RebuildCache *rebuild_cache;
+    std::vector<uint64_t> section_keys; // Hashes of the source elements of each section.
     // Add frontmatter
     std::vector<std::vector<Page>> maintext_sections;
     // Add backmatter
     std::vector<TextElement> elements;
+    LineTable line_table; // Built from elements once they are final.
     FILE *stats;
     bool debug_page = true;
 };
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#include <searchbudget.hpp>
+
+SearchBudget::SearchBudget(const SearchLimits &limits_)
+    : limits{limits_},
+      deadline{std::chrono::steady_clock::now() + std::chrono::milliseconds(limits.milliseconds)} {}
+
+bool SearchBudget::spend(uint64_t nodes) {
+    if(out_of_budget) {
+        return false;
+    }
+    nodes_used += nodes;
+    if(limits.nodes > 0 && nodes_used > limits.nodes) {
+        out_of_budget = true;
+    } else if(limits.milliseconds > 0 && nodes_used >= next_clock_check) {
+        next_clock_check = nodes_used + CLOCK_CHECK_INTERVAL;
+        out_of_budget = std::chrono::steady_clock::now() > deadline;
+    }
+    return !out_of_budget;
+}
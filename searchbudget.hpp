@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#pragma once
+
+#include <chaptercommon.hpp>
+
+#include <chrono>
+#include <cstdint>
+
+// Counts the nodes an optimizer explores and the time it takes against
+// its limits. Once the budget runs out the optimizer should finish with
+// the best result it has.
+class SearchBudget {
+public:
+    explicit SearchBudget(const SearchLimits &limits_);
+
+    // Returns false if the budget has run out.
+    bool spend(uint64_t nodes = 1);
+    bool exhausted() const { return out_of_budget; }
+
+private:
+    // Reading the clock for every node would be too slow.
+    static constexpr uint64_t CLOCK_CHECK_INTERVAL = 256;
+
+    SearchLimits limits;
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t nodes_used = 0;
+    uint64_t next_clock_check = CLOCK_CHECK_INTERVAL;
+    bool out_of_budget = false;
+};
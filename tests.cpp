@@ -15,7 +15,14 @@
  */
 
 #include <wordhyphenator.hpp>
+#include <hyphenationcache.hpp>
+#include <bookparser.hpp>
+#include <paragraphformatter.hpp>
+#include <wordenricher.hpp>
 #include <glib.h>
+#include <filesystem>
+#include <cstddef>
+#include <cstdio>
 
 #define CHECK(cond)                                                                                \
     if(!(cond)) {                                                                                  \
@@ -163,6 +170,55 @@ void test_singleletter_dash() {
     CHECK(w[4] == expected4);
 }
 
+void test_hyphenation_cache() {
+    const char *fname = "hyphenation_cache_test.bin";
+    std::filesystem::remove(fname);
+    {
+        HyphenationCache cache(fname);
+        WordHyphenator h;
+        h.set_cache(&cache);
+        auto w = h.hyphenate("morning", Language::English);
+        CHECK(cache.lookup("morning", Language::English) == w);
+        CHECK(!cache.lookup("morning", Language::Finnish));
+        CHECK(h.hyphenate("morning", Language::English) == w);
+        cache.save();
+    }
+    HyphenationCache loaded(fname);
+    auto w = loaded.lookup("morning", Language::English);
+    HyphenPoint expected{3, SplitType::Regular};
+    CHECK(w);
+    CHECK(w->size() == 1);
+    CHECK(w->front() == expected);
+    std::filesystem::remove(fname);
+}
+
+void test_hyphenation_cache_language() {
+    const char *fname = "hyphenation_cache_test.bin";
+    {
+        HyphenationCache cache(fname);
+        WordHyphenator h;
+        h.set_cache(&cache);
+        h.hyphenate("morning", Language::English);
+        cache.save();
+    }
+    // Change the language in the only language header to one that does not
+    // exist. The whole file is then rejected.
+    auto size = std::filesystem::file_size(fname);
+    std::string contents(size, '\0');
+    FILE *f = fopen(fname, "r+b");
+    CHECK(fread(contents.data(), 1, size, f) == size);
+    const uint32_t bad_language = 77;
+    const size_t language_offset = sizeof(HyphenationCache::FileHeader) +
+                                   offsetof(HyphenationCache::LanguageHeader, lang);
+    CHECK(contents[language_offset] == char(Language::English));
+    fseek(f, language_offset, SEEK_SET);
+    fwrite(&bad_language, sizeof(bad_language), 1, f);
+    fclose(f);
+    HyphenationCache loaded(fname);
+    CHECK(!loaded.lookup("morning", Language::English));
+    std::filesystem::remove(fname);
+}
+
 void test_hyphenation() {
     test_hyphenation_simple();
     test_hyphenation_dash();
@@ -177,9 +233,117 @@ void test_hyphenation() {
     test_singleletter();
     test_singleletter_end();
     test_singleletter_dash();
+    test_hyphenation_cache();
+    test_hyphenation_cache_language();
+}
+
+std::vector<std::string> line_texts(const std::vector<HBLine> &lines) {
+    std::vector<std::string> texts;
+    for(const auto &line : lines) {
+        std::string text;
+        for(const auto &word : line.words) {
+            for(const auto &run : word.runs) {
+                text += run.text;
+            }
+        }
+        texts.emplace_back(std::move(text));
+    }
+    return texts;
+}
+
+void test_lazy_hyphenation() {
+    const std::string text{
+        "Hyphenation points only matter for the words that can end up at the end of a line, "
+        "yet traditionally every single word of every paragraph has been hyphenated before "
+        "the line breaker gets to see any of them. Justified typesetting with narrow columns "
+        "needs considerably more hyphenation than wide columns, particularly with "
+        "extraordinarily long words."};
+    HBFontCache fc;
+    WordHyphenator h;
+    HBChapterParameters par;
+    par.font.size = Length::from_pt(10);
+    par.indent = Length::from_mm(5);
+    const auto eager_words = enrich_text(text, h, Language::English);
+    const auto lazy_words = enrich_text_lazily(text, Language::English);
+    const SearchLimits limits{0, 100000};
+    for(const auto alg : {SplitAlgorithm::Dynamic, SplitAlgorithm::Recursive}) {
+        for(const auto &width : {Length::from_mm(40), Length::from_mm(60)}) {
+            const ExtraPenaltyAmounts extras;
+            ParagraphFormatter eager(eager_words, width, par, extras, fc, alg, limits);
+            ParagraphFormatter lazy(lazy_words, width, par, extras, fc, alg, limits);
+            eager.set_line_count_variants(true);
+            lazy.set_hyphenator(&h);
+            lazy.set_line_count_variants(true);
+            const auto eager_lines = line_texts(eager.split_formatted_lines());
+            CHECK(eager_lines.size() > 3);
+            CHECK(line_texts(lazy.split_formatted_lines()) == eager_lines);
+            // Looking for variants does not change the best breaking.
+            ParagraphFormatter plain(eager_words, width, par, extras, fc, alg, limits);
+            CHECK(line_texts(plain.split_formatted_lines()) == eager_lines);
+            CHECK(plain.breakings().size() == 1);
+            const auto eager_breakings = eager.breakings();
+            const auto lazy_breakings = lazy.breakings();
+            CHECK(lazy_breakings.size() == eager_breakings.size());
+            for(size_t i = 0; i < lazy_breakings.size(); ++i) {
+                CHECK(lazy_breakings[i].penalty == eager_breakings[i].penalty);
+                // Rebuilding from a breaking needs no search.
+                ParagraphFormatter rebuilt(lazy_words, width, par, extras, fc, alg, limits);
+                rebuilt.set_hyphenator(&h);
+                CHECK(line_texts(rebuilt.split_formatted_lines(lazy_breakings[i])) ==
+                      line_texts(eager.split_formatted_lines(eager_breakings[i])));
+            }
+        }
+    }
+}
+
+void test_line_parser() {
+    const std::string_view text{"# Title\n\nSome text\nmore text.\n\n#s\n#figure  pic.png\n"
+                                "```code\nline\n\n```\n"};
+    LineParser p(text.data(), text.size());
+    auto t = p.next();
+    CHECK(std::holds_alternative<SectionDecl>(t));
+    CHECK(std::get<SectionDecl>(t).level == 1);
+    CHECK(std::get<SectionDecl>(t).text == "Title");
+    CHECK(std::holds_alternative<NewBlock>(p.next()));
+    t = p.next();
+    CHECK(std::holds_alternative<PlainLine>(t));
+    CHECK(std::get<PlainLine>(t).text == "Some text");
+    CHECK(std::holds_alternative<NewLine>(p.next()));
+    t = p.next();
+    CHECK(std::get<PlainLine>(t).text == "more text.");
+    CHECK(std::holds_alternative<NewBlock>(p.next()));
+    CHECK(std::holds_alternative<SceneDecl>(p.next()));
+    CHECK(std::holds_alternative<NewLine>(p.next()));
+    t = p.next();
+    CHECK(std::holds_alternative<FigureDecl>(t));
+    CHECK(std::get<FigureDecl>(t).fname == "pic.png");
+    CHECK(std::holds_alternative<NewLine>(p.next()));
+    t = p.next();
+    CHECK(std::holds_alternative<StartOfSpecialBlock>(t));
+    CHECK(std::get<StartOfSpecialBlock>(t).type == SpecialBlockType::Code);
+    CHECK(std::get<PlainLine>(p.next()).text == "line");
+    CHECK(std::get<PlainLine>(p.next()).text.empty());
+    CHECK(std::holds_alternative<EndOfSpecialBlock>(p.next()));
+    CHECK(std::holds_alternative<EndOfFile>(p.next()));
+
+    // Only letters, digits and underscores start directives, also outside ASCII.
+    const std::string_view quotes{"#“Quote”\n#—\n#\u00a0Otsikko\n"};
+    LineParser q(quotes.data(), quotes.size());
+    CHECK(std::get<PlainLine>(q.next()).text == "#“Quote”");
+    CHECK(std::holds_alternative<NewLine>(q.next()));
+    CHECK(std::get<PlainLine>(q.next()).text == "#—");
+    CHECK(std::holds_alternative<NewLine>(q.next()));
+    t = q.next();
+    CHECK(std::get<SectionDecl>(t).text == "Otsikko");
+    CHECK(std::holds_alternative<NewLine>(q.next()));
+    CHECK(std::holds_alternative<EndOfFile>(q.next()));
 }
 
 int main(int, char **) {
     printf("Running hyphenation tests.\n");
     test_hyphenation();
+    printf("Running line breaking tests.\n");
+    test_lazy_hyphenation();
+    printf("Running parser tests.\n");
+    test_line_parser();
 }
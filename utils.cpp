@@ -189,3 +189,11 @@ int words_in_file(const char *fname) {
     }
     return num_words;
 }
+
+size_t worker_thread_count(int requested) {
+    if(requested > 0) {
+        return requested;
+    }
+    const auto hw = std::thread::hardware_concurrency();
+    return hw > 0 ? hw : 1;
+}
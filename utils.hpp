@@ -17,7 +17,10 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
+#include <thread>
 #include <cstdint>
 
 std::vector<std::string> split_to_words(std::string_view in_text);
@@ -50,3 +53,41 @@ char internal2special(char c);
 void restore_special_chars(std::string &s);
 
 int words_in_file(const char *fname);
+
+// 64 bit FNV-1a. Unlike std::hash the result is the same on every run,
+// so it can be stored on disk.
+class StableHasher {
+public:
+    void add(const void *data, size_t size) {
+        const auto *bytes = static_cast<const unsigned char *>(data);
+        for(size_t i = 0; i < size; ++i) {
+            hash_value = (hash_value ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+    void add(std::string_view text) {
+        add(text.size());
+        add(text.data(), text.size());
+    }
+    template<typename T> void add(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        add(&value, sizeof(T));
+    }
+
+    uint64_t value() const { return hash_value; }
+
+private:
+    uint64_t hash_value = 14695981039346656037ull;
+};
+
+// Zero means one thread per hardware core.
+size_t worker_thread_count(int requested);
+
+// Runs worker on num_threads threads, one of which is the calling thread,
+// and returns once all of them have finished.
+template<typename F> void run_on_threads(size_t num_threads, F &&worker) {
+    std::vector<std::jthread> threads;
+    for(size_t i = 1; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#include <widthcache.hpp>
+
+#include <algorithm>
+
+WidthCache::WidthCache(size_t max_entries)
+    : shard_capacity{std::max(max_entries / NUM_SHARDS, size_t(1))} {}
+
+WidthCache::Shard &WidthCache::shard_for(const WidthKey &key) {
+    // The low bits go to the hash table inside the shard.
+    return shards[(std::hash<WidthKey>{}(key) >> 16) % NUM_SHARDS];
+}
+
+std::optional<double> WidthCache::lookup(const WidthKey &key) {
+    auto &shard = shard_for(key);
+    std::lock_guard l(shard.lock);
+    auto it = shard.index.find(key);
+    if(it == shard.index.end()) {
+        return {};
+    }
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    return it->second->width;
+}
+
+void WidthCache::insert(const WidthKey &key, double width) {
+    auto &shard = shard_for(key);
+    std::lock_guard l(shard.lock);
+    if(shard.index.find(key) != shard.index.end()) {
+        // Some other thread got here first.
+        return;
+    }
+    auto &entry = shard.entries.emplace_front(Entry{std::string{key.text}, key, width});
+    entry.key.text = entry.text;
+    shard.index[entry.key] = shard.entries.begin();
+    if(shard.entries.size() > shard_capacity) {
+        shard.index.erase(shard.entries.back().key);
+        shard.entries.pop_back();
+    }
+}
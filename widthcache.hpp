@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#pragma once
+
+#include <chaptercommon.hpp>
+#include <hb.h>
+
+#include <array>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct WidthKey {
+    std::string_view text;
+    HBFontProperties par;
+    hb_language_t language;
+
+    bool operator==(const WidthKey &o) const noexcept {
+        return text == o.text && par == o.par && language == o.language;
+    }
+};
+
+template<> struct std::hash<WidthKey> {
+    std::size_t operator()(WidthKey const &k) const noexcept {
+        const size_t shuffle = 13;
+        size_t hashvalue = std::hash<std::string_view>{}(k.text);
+        hashvalue = hashvalue * shuffle + std::hash<HBFontProperties>{}(k.par);
+        hashvalue = hashvalue * shuffle + std::hash<const void *>{}(k.language);
+        return hashvalue;
+    }
+};
+
+// Shaped text widths in font units, i.e. independent of the point size.
+// Safe to use from multiple threads. The least recently used entries are
+// dropped once the cache is full.
+class WidthCache {
+public:
+    explicit WidthCache(size_t max_entries);
+
+    std::optional<double> lookup(const WidthKey &key);
+    void insert(const WidthKey &key, double width);
+
+private:
+    struct Entry {
+        std::string text;
+        WidthKey key; // Its text points to the string above.
+        double width;
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::list<Entry> entries; // Most recently used first.
+        std::unordered_map<WidthKey, std::list<Entry>::iterator> index;
+    };
+
+    Shard &shard_for(const WidthKey &key);
+
+    static constexpr size_t NUM_SHARDS = 16;
+    size_t shard_capacity;
+    std::array<Shard, NUM_SHARDS> shards;
+};
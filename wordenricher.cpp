@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#include <wordenricher.hpp>
+#include <utils.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <optional>
+#include <variant>
+
+#include <glib.h>
+
+namespace {
+
+template<typename T> void style_change(T &stack, typename T::value_type val) {
+    if(stack.contains(val)) {
+        stack.pop(val);
+    } else {
+        stack.push(val);
+    }
+}
+
+// Words are separated by spaces and newlines, like in split_to_words.
+bool is_word_separator(char c) { return c == ' ' || c == '\n'; }
+
+// Without a hyphenator the words are left for the line breaker to hyphenate.
+// The words are processed in place and the per word data goes through
+// scratch buffers, so the only allocations are those of the word store.
+WordStore
+split_styled_words(const std::string &text, const WordHyphenator *hyph, Language lang) {
+    StyleStack current_style;
+    WordStore processed_words;
+    processed_words.reserve(std::count_if(text.begin(), text.end(), is_word_separator) + 1,
+                            text.size());
+    std::string working_word;
+    std::vector<FormattingChange> formatting_data;
+    std::vector<HyphenPoint> hyphenation_data;
+    const std::string_view view(text);
+    size_t word_start = 0;
+    while(true) {
+        while(word_start < view.size() && is_word_separator(view[word_start])) {
+            ++word_start;
+        }
+        if(word_start == view.size()) {
+            break;
+        }
+        size_t word_end = word_start;
+        while(word_end < view.size() && !is_word_separator(view[word_end])) {
+            ++word_end;
+        }
+        const auto start_style = current_style;
+        extract_styling(current_style,
+                        view.substr(word_start, word_end - word_start),
+                        working_word,
+                        formatting_data);
+        restore_special_chars(working_word);
+        if(hyph) {
+            hyph->hyphenate(working_word, lang, hyphenation_data);
+        }
+        processed_words.add_word(working_word, hyphenation_data, formatting_data, start_style);
+        word_start = word_end;
+    }
+    if(!hyph) {
+        processed_words.set_pending_hyphenation(lang);
+    }
+    return processed_words;
+}
+
+std::vector<WordStore> enrich_all_paragraphs(const Document &doc,
+                                             const std::vector<bool> *wanted,
+                                             HyphenationCache *cache,
+                                             size_t num_threads,
+                                             bool lazy_hyphenation) {
+    std::vector<WordStore> words(doc.elements.size());
+    std::vector<size_t> paragraphs;
+    for(size_t i = 0; i < doc.elements.size(); ++i) {
+        if(std::holds_alternative<Paragraph>(doc.elements[i]) && (!wanted || (*wanted)[i])) {
+            paragraphs.push_back(i);
+        }
+    }
+    std::atomic<size_t> next_paragraph{0};
+    run_on_threads(std::min(num_threads, paragraphs.size()), [&]() {
+        std::optional<WordHyphenator> hyph;
+        if(!lazy_hyphenation) {
+            hyph.emplace();
+            hyph->set_cache(cache);
+        }
+        for(size_t i = next_paragraph++; i < paragraphs.size(); i = next_paragraph++) {
+            const auto element_id = paragraphs[i];
+            const auto &p = std::get<Paragraph>(doc.elements[element_id]);
+            words[element_id] =
+                split_styled_words(p.text, hyph ? &*hyph : nullptr, doc.data.language);
+        }
+    });
+    return words;
+}
+
+} // namespace
+
+std::vector<FormattingChange> extract_styling(StyleStack &current_style, std::string &word) {
+    std::vector<FormattingChange> changes;
+    std::string buf;
+    extract_styling(current_style, word, buf, changes);
+    word = buf;
+    return changes;
+}
+
+void extract_styling(StyleStack &current_style,
+                     std::string_view word,
+                     std::string &plain_word,
+                     std::vector<FormattingChange> &changes) {
+    plain_word.clear();
+    changes.clear();
+    const char *word_start = word.data();
+    const char *word_end = word.data() + word.size();
+    const char *in = word_start;
+    int num_changes = 0;
+
+    while(in < word_end) {
+        auto c = g_utf8_get_char(in);
+        const char *next = g_utf8_next_char(in);
+
+        switch(c) {
+        case italic_codepoint:
+            style_change(current_style, ITALIC_S);
+            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), ITALIC_S});
+            ++num_changes;
+            break;
+        case bold_codepoint:
+            style_change(current_style, BOLD_S);
+            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), BOLD_S});
+            ++num_changes;
+            break;
+        case tt_codepoint:
+            style_change(current_style, TT_S);
+            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), TT_S});
+            ++num_changes;
+            break;
+        case smallcaps_codepoint:
+            style_change(current_style, SMALLCAPS_S);
+            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), SMALLCAPS_S});
+            ++num_changes;
+            break;
+        case superscript_codepoint:
+            style_change(current_style, SUPERSCRIPT_S);
+            changes.push_back(
+                FormattingChange{size_t(in - word_start - num_changes), SUPERSCRIPT_S});
+            ++num_changes;
+            break;
+        case subscript_codepoint:
+            style_change(current_style, SUBSCRIPT_S);
+            changes.push_back(FormattingChange{size_t(in - word_start - num_changes), SUBSCRIPT_S});
+            ++num_changes;
+            break;
+        default:
+            plain_word.append(in, next);
+        }
+        in = next;
+    }
+}
+
+WordStore enrich_text(const std::string &text, const WordHyphenator &hyph, Language lang) {
+    return split_styled_words(text, &hyph, lang);
+}
+
+WordStore enrich_text_lazily(const std::string &text, Language lang) {
+    return split_styled_words(text, nullptr, lang);
+}
+
+std::vector<WordStore>
+enrich_paragraphs(const Document &doc, HyphenationCache *cache, size_t num_threads) {
+    return enrich_all_paragraphs(doc, nullptr, cache, num_threads, false);
+}
+
+std::vector<WordStore> enrich_paragraphs_lazily(const Document &doc,
+                                                const std::vector<bool> &wanted,
+                                                size_t num_threads) {
+    return enrich_all_paragraphs(doc, &wanted, nullptr, num_threads, true);
+}
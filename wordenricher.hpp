@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2026 Jussi Pakkanen
+
+#pragma once
+
+#include <formatting.hpp>
+#include <hyphenationcache.hpp>
+#include <metadata.hpp>
+#include <wordhyphenator.hpp>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// NOTE: mutates the input words.
+std::vector<FormattingChange> extract_styling(StyleStack &current_style, std::string &word);
+
+// Like above, but writes the word without its styling characters to
+// plain_word and the changes to changes, overwriting their old contents.
+void extract_styling(StyleStack &current_style,
+                     std::string_view word,
+                     std::string &plain_word,
+                     std::vector<FormattingChange> &changes);
+
+// Splits text to words, takes the styling characters out of them and
+// hyphenates them.
+WordStore enrich_text(const std::string &text, const WordHyphenator &hyph, Language lang);
+
+// Like enrich_text, but only the words that the line breaker may end a line
+// in get hyphenated, when it needs them.
+WordStore enrich_text_lazily(const std::string &text, Language lang);
+
+// Enriches the text of every paragraph of the document before any of them
+// is laid out. The result is indexed like doc.elements, other elements get
+// empty word stores. Every thread has its own hyphenator, as they are not
+// thread safe, but they share the cache.
+std::vector<WordStore>
+enrich_paragraphs(const Document &doc, HyphenationCache *cache, size_t num_threads);
+
+// Like enrich_paragraphs, but leaves hyphenation to the line breaker and
+// only enriches the paragraphs whose entry in wanted is set.
+std::vector<WordStore> enrich_paragraphs_lazily(const Document &doc,
+                                                const std::vector<bool> &wanted,
+                                                size_t num_threads);
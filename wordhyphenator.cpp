@@ -15,28 +15,28 @@
  */
 
 #include "wordhyphenator.hpp"
+#include "hyphenationcache.hpp"
+#include "hyphenationtrie.hpp"
+#include "utils.hpp"
+#include <algorithm>
 #include <array>
-#include <memory>
-#include <optional>
+#include <cstdlib>
+#include <filesystem>
+#include <string_view>
 
 #include <glib.h>
 #include <cassert>
 #include <cctype>
 
-struct WordPieces {
-    std::string prefix;
-    std::string core;
-    std::string suffix;
-};
-
 namespace {
 
 const std::array<uint32_t, 4> dash_codepoints{0x2d, 0x2012, 0x2014, 0x2212};
 
-struct DashSplit {
-    std::vector<std::string> words;
-    std::vector<uint32_t> separators;
-};
+const std::array<const char *, 2> english_dictionaries{"/usr/share/hyphen/hyph_en.dic",
+                                                        "/usr/share/hyphen/hyph_en_US.dic"};
+
+// Relative to the working directory, which is usually the build directory.
+const char ENGLISH_TRIE_FILE[] = "chapterizer-en.hyphtrie";
 
 bool is_dashlike(uint32_t uchar) {
     for(const auto c : dash_codepoints) {
@@ -47,118 +47,46 @@ bool is_dashlike(uint32_t uchar) {
     return false;
 }
 
-DashSplit split_at_dashes(const std::string &word) {
-    DashSplit splits;
-    std::unique_ptr<char[]> bufd{new char[word.size() + 10]};
-    char *buf = bufd.get();
-    int chars_in_buf = 0;
-    const char *in = word.c_str();
-    while(*in) {
-        auto c = g_utf8_get_char(in);
-        if(is_dashlike(c)) {
-            buf[chars_in_buf] = '\0';
-            splits.words.emplace_back(buf);
-            chars_in_buf = 0;
-            splits.separators.push_back(c);
-        } else {
-            chars_in_buf += g_unichar_to_utf8(c, buf + chars_in_buf);
-        }
-        in = g_utf8_next_char(in);
-    }
-    assert(splits.words.size() == splits.separators.size());
-    buf[chars_in_buf] = '\0';
-    splits.words.emplace_back(buf);
-    return splits;
-}
-
-std::string lowerword(const std::string &w) {
-    std::string lw;
-    lw.reserve(w.size());
-    for(const auto c : w) {
-        lw.push_back(tolower(c));
-    }
-    return lw;
-}
-
-const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
-
-WordPieces tripartite(const std::string &word) {
-    std::string_view letterview(letters);
-    const auto p1 = word.find_first_of(letterview);
-    if(p1 == std::string::npos) {
-        return WordPieces{word, "", ""};
-    }
-    const auto p2 = word.find_last_of(letterview);
-    assert(p2 != std::string::npos);
-
-    return WordPieces{word.substr(0, p1), word.substr(p1, p2 - p1 + 1), word.substr(p2 + 1)};
-};
-
-std::vector<HyphenPoint> build_hyphenation_data(const std::string &word,
-                                                const std::vector<char> &hyphens,
-                                                size_t prefix_length) {
-    std::vector<HyphenPoint> hyphen_points;
-    for(size_t i = 0; i < word.size(); ++i) {
-        if(hyphens[i] == char(-1)) {
-            // The hyphenator library's output is a bit weird.
-            // When we reach an item it has not touched (i.e. is still 255)
-            // exit out.
-            break;
-        }
-        if(hyphens[i] & 1) {
-            hyphen_points.emplace_back(HyphenPoint{i + prefix_length, SplitType::Regular});
+// Loaded when first needed and shared by all hyphenators.
+const HyphenationTrie &english_patterns() {
+    static const auto trie = [] {
+        for(const auto *dic : english_dictionaries) {
+            if(auto t = HyphenationTrie::load(dic, ENGLISH_TRIE_FILE)) {
+                return t;
+            }
         }
-    }
-    return hyphen_points;
+        printf("Could not load english hyphenation data.\n");
+        std::abort();
+    }();
+    return *trie;
 }
 
-void hyphenate_and_append(std::string &reconstructed_word,
-                          std::vector<HyphenPoint> &hyphen_points,
-                          const std::string &word,
-                          std::optional<uint32_t> separator,
-                          HyphenDict *dict) {
-    const auto trips = tripartite(word);
-    char buf[7] = {0, 0, 0, 0, 0, 0, 0};
-    if(trips.core.empty()) {
-        reconstructed_word += word;
-        if(separator) {
-            g_unichar_to_utf8(*separator, buf);
-            reconstructed_word += buf;
+// Hyphenates the letters of a part of a word between dashes, leaving out
+// attached punctuation, quotes and the like. Returns false if the part has
+// no letters.
+bool hyphenate_english_part(std::string_view part,
+                            size_t part_offset,
+                            std::vector<HyphenPoint> &hyphen_points) {
+    size_t letters_start = std::string_view::npos;
+    size_t letters_end = 0;
+    for(size_t i = 0; i < part.size();) {
+        const char *c = part.data() + i;
+        const size_t len = g_utf8_next_char(c) - c;
+        if(g_unichar_isalpha(g_utf8_get_char(c))) {
+            if(letters_start == std::string_view::npos) {
+                letters_start = i;
+            }
+            letters_end = i + len;
         }
-        return;
+        i += len;
     }
-    reconstructed_word += trips.prefix;
-    std::string lowercase_word = lowerword(trips.core);
-    std::vector<char> output(word.size() * 2 + 1, '\0');
-    std::vector<char> hyphens(word.size() + 5, (char)-1);
-    char **rep = nullptr;
-    int *pos = nullptr;
-    int *cut = nullptr;
-    // NOTE: it seems that this function only works with ASCII
-    // characters. At least feeding it some UTF-8 text produced
-    // weird results. Consider checking for this if weird
-    // errors pop up.
-    const auto rc = hnj_hyphen_hyphenate2(dict,
-                                          lowercase_word.c_str(),
-                                          (int)lowercase_word.size(),
-                                          hyphens.data(),
-                                          output.data(),
-                                          &rep,
-                                          &pos,
-                                          &cut);
-    assert(rc == 0);
-    auto subhyphens = build_hyphenation_data(word, hyphens, reconstructed_word.length());
-    free(rep);
-    free(pos);
-    free(cut);
-    hyphen_points.insert(hyphen_points.cend(), subhyphens.begin(), subhyphens.end());
-    reconstructed_word += trips.core;
-    reconstructed_word += trips.suffix;
-    if(separator) {
-        g_unichar_to_utf8(*separator, buf);
-        reconstructed_word += buf;
-        hyphen_points.emplace_back(HyphenPoint{reconstructed_word.size() - 1, SplitType::NoHyphen});
+    if(letters_start == std::string_view::npos) {
+        return false;
     }
+    english_patterns().hyphenate(part.substr(letters_start, letters_end - letters_start),
+                                 part_offset + letters_start,
+                                 hyphen_points);
+    return true;
 }
 
 char *discard_one_letter_syllables(char *hyphen_str) {
@@ -186,63 +114,140 @@ char *discard_one_letter_syllables(char *hyphen_str) {
     return hyphen_str;
 }
 
-} // namespace
-
-WordHyphenator::WordHyphenator() {
-    dict = hnj_hyphen_load("/usr/share/hyphen/hyph_en.dic");
-    if(!dict) {
-        dict = hnj_hyphen_load("/usr/share/hyphen/hyph_en_US.dic");
+// Voikko does not say which dictionary it loaded, so this looks for it the
+// same way: the directories in VOIKKO_DICTIONARY_PATH, then ~/.voikko,
+// /etc/voikko and the system locations. The first one with dictionaries in
+// the current format (version 5) is the one in use.
+std::vector<std::filesystem::path> voikko_dictionary_dirs() {
+    std::vector<std::filesystem::path> dirs;
+    if(const char *env = getenv("VOIKKO_DICTIONARY_PATH")) {
+        std::string_view paths{env};
+        while(!paths.empty()) {
+            const auto colon = paths.find(':');
+            dirs.emplace_back(paths.substr(0, colon));
+            paths = colon == std::string_view::npos ? std::string_view{}
+                                                    : paths.substr(colon + 1);
+        }
     }
-    if(!dict) {
-        printf("Could not load english hyphenation data.\n");
-        std::abort();
+    if(const char *home = getenv("HOME")) {
+        dirs.emplace_back(std::filesystem::path(home) / ".voikko");
     }
-    const char *error;
-    voikko = voikkoInit(&error, "fi", nullptr);
-    if(!voikko) {
-        printf("Voikko init failed: %s\n", error);
-        std::abort();
+    for(const char *d : {"/etc/voikko", "/usr/lib/voikko", "/usr/share/voikko"}) {
+        dirs.emplace_back(d);
     }
+    return dirs;
+}
+
+// Paths, sizes and modification times of the Finnish dictionary files.
+// Computed once, since a running hyphenator does not reload them either.
+uint64_t finnish_dictionary_digest() {
+    static const uint64_t digest = [] {
+        StableHasher hasher;
+        std::error_code ec;
+        for(const auto &dir : voikko_dictionary_dirs()) {
+            const auto formatdir = dir / "5";
+            if(!std::filesystem::is_directory(formatdir, ec)) {
+                continue;
+            }
+            std::vector<std::filesystem::path> files;
+            for(const auto &entry : std::filesystem::recursive_directory_iterator(formatdir, ec)) {
+                if(entry.is_regular_file(ec)) {
+                    files.push_back(entry.path());
+                }
+            }
+            std::sort(files.begin(), files.end());
+            for(const auto &f : files) {
+                hasher.add(std::string_view{f.native()});
+                hasher.add(uint64_t(std::filesystem::file_size(f, ec)));
+                hasher.add(std::filesystem::last_write_time(f, ec).time_since_epoch().count());
+            }
+            break;
+        }
+        return hasher.value();
+    }();
+    return digest;
+}
+
+} // namespace
+
+uint64_t hyphenation_data_digest(Language lang) {
+    StableHasher hasher;
+    hasher.add(lang);
+    if(lang == Language::English) {
+        hasher.add(english_patterns().source_digest());
+    } else if(lang == Language::Finnish) {
+        hasher.add(std::string_view(voikkoGetVersion()));
+        hasher.add(finnish_dictionary_digest());
+    }
+    return hasher.value();
 }
 
 WordHyphenator::~WordHyphenator() {
-    hnj_hyphen_free(dict);
-    voikkoTerminate(voikko);
+    if(voikko) {
+        voikkoTerminate(voikko);
+    }
+}
+
+// Voikko handles are not thread safe, so every hyphenator has its own.
+VoikkoHandle *WordHyphenator::finnish_backend() const {
+    if(!voikko) {
+        const char *error;
+        voikko = voikkoInit(&error, "fi", nullptr);
+        if(!voikko) {
+            printf("Voikko init failed: %s\n", error);
+            std::abort();
+        }
+    }
+    return voikko;
 }
 
 std::vector<HyphenPoint> WordHyphenator::hyphenate(const std::string &word,
                                                    const Language lang) const {
+    std::vector<HyphenPoint> hyphen_points;
+    hyphenate(word, lang, hyphen_points);
+    return hyphen_points;
+}
+
+void WordHyphenator::hyphenate(const std::string &word,
+                               const Language lang,
+                               std::vector<HyphenPoint> &hyphen_points) const {
+    if(!cache || lang == Language::Unset) {
+        compute_hyphen_points(word, lang, hyphen_points);
+        return;
+    }
+    if(cache->lookup(word, lang, hyphen_points)) {
+        return;
+    }
+    compute_hyphen_points(word, lang, hyphen_points);
+    cache->insert(word, lang, hyphen_points);
+}
+
+void WordHyphenator::compute_hyphen_points(const std::string &word,
+                                           const Language lang,
+                                           std::vector<HyphenPoint> &hyphen_points) const {
     assert(word.find(' ') == std::string::npos);
     g_utf8_validate(word.c_str(), word.length(), nullptr);
-    std::vector<HyphenPoint> hyphen_points;
+    hyphen_points.clear();
     if(lang == Language::Unset) {
         // FIXME, split at dashes.
     } else if(lang == Language::English) {
-        std::string reconstructed_word;
-        reconstructed_word.reserve(word.size());
-        // The hyphenation function only deals with lower case single words.
-        // Attached punctuation, quotes, capital letters etc break it.
-        // For words like spatio-temporal it splits the individual words but not the hyphen.
-        std::string_view letterview(letters);
-        const auto p1 = word.find_first_of(letterview);
-        if(p1 == std::string::npos) {
-            // Non-word such as a number or other weird character combinations.
-            // FIXME to add dashelss hyphenation points for things like
-            // 1,000,000.
-            return {};
-        }
-        const auto subwords = split_at_dashes(word);
-        assert(subwords.words.size() == subwords.separators.size() + 1);
-        for(size_t ind = 0; ind < subwords.words.size(); ++ind) {
-            hyphenate_and_append(reconstructed_word,
-                                 hyphen_points,
-                                 subwords.words[ind],
-                                 ind < subwords.separators.size()
-                                     ? std::optional<uint32_t>{subwords.separators[ind]}
-                                     : std::optional<uint32_t>{},
-                                 dict);
+        // Words like spatio-temporal are split at the dashes and the parts
+        // are hyphenated separately.
+        const std::string_view view(word);
+        size_t part_start = 0;
+        for(size_t i = 0; i < view.size();) {
+            const char *c = view.data() + i;
+            const size_t len = g_utf8_next_char(c) - c;
+            if(is_dashlike(g_utf8_get_char(c))) {
+                if(hyphenate_english_part(
+                       view.substr(part_start, i - part_start), part_start, hyphen_points)) {
+                    hyphen_points.emplace_back(HyphenPoint{i + len - 1, SplitType::NoHyphen});
+                }
+                part_start = i + len;
+            }
+            i += len;
         }
-        assert(reconstructed_word == word);
+        hyphenate_english_part(view.substr(part_start), part_start, hyphen_points);
     } else if(lang == Language::Finnish) {
         // The return value is an ASCII string. It lists the hyphenation points
         // in characters, but we need them in bytes.
@@ -254,9 +259,11 @@ std::vector<HyphenPoint> WordHyphenator::hyphenate(const std::string &word,
             ++popped_chars;
         }
         if(popped_chars > 0) {
-            return hyphenate(tmp, lang);
+            hyphenate(tmp, lang, hyphen_points);
+            return;
         }
-        char *hyphenation = discard_one_letter_syllables(voikkoHyphenateCstr(voikko, word.c_str()));
+        char *hyphenation =
+            discard_one_letter_syllables(voikkoHyphenateCstr(finnish_backend(), word.c_str()));
 
         const char *character_location = word.c_str();
         for(size_t i = 0; hyphenation[i]; ++i) {
@@ -284,11 +291,9 @@ std::vector<HyphenPoint> WordHyphenator::hyphenate(const std::string &word,
         printf("Unkown hyphenation language.\n");
         std::abort();
     }
-    HyphenatedWord tmp;
-    tmp.word = word;
-    tmp.hyphen_points = hyphen_points;
-    tmp.sanity_check();
-    return hyphen_points;
+    for(const auto &h : hyphen_points) {
+        assert(h.loc < word.length());
+    }
 }
 
 std::vector<std::vector<HyphenPoint>>
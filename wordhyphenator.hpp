@@ -17,12 +17,13 @@
 #pragma once
 
 #include <metadata.hpp>
-#include <hyphen.h>
 #include <libvoikko/voikko.h>
 
 #include <string>
 #include <vector>
 
+class HyphenationCache;
+
 enum class SplitType : int {
     Regular,
     NoHyphen,
@@ -47,16 +48,35 @@ struct HyphenatedWord {
 std::string get_visual_string(const std::string &word,
                               const std::vector<HyphenPoint> hyphen_points);
 
+// Identifies the hyphenation data of a language, so that stored results
+// can be discarded when it changes.
+uint64_t hyphenation_data_digest(Language lang);
+
 class WordHyphenator {
 public:
-    WordHyphenator();
+    WordHyphenator() = default;
+    WordHyphenator(const WordHyphenator &) = delete;
+    WordHyphenator &operator=(const WordHyphenator &) = delete;
     ~WordHyphenator();
 
+    // Words are looked up from and added to the cache, if there is one.
+    void set_cache(HyphenationCache *cache_) { cache = cache_; }
+
     std::vector<HyphenPoint> hyphenate(const std::string &word, const Language lang) const;
+    // Overwrites hyphen_points, which lets callers reuse one vector for all words.
+    void hyphenate(const std::string &word,
+                   const Language lang,
+                   std::vector<HyphenPoint> &hyphen_points) const;
     std::vector<std::vector<HyphenPoint>> hyphenate(const std::vector<std::string> &words,
                                                     const Language lang) const;
 
 private:
-    HyphenDict *dict;
-    VoikkoHandle *voikko;
+    void compute_hyphen_points(const std::string &word,
+                               const Language lang,
+                               std::vector<HyphenPoint> &hyphen_points) const;
+    VoikkoHandle *finnish_backend() const;
+
+    // Created when first needed.
+    mutable VoikkoHandle *voikko = nullptr;
+    HyphenationCache *cache = nullptr;
 };